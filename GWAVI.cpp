@@ -40,10 +40,96 @@
 #include "GWAVI.h"
 
 #include <string.h>
+#include <errno.h>
 #include <iostream>
+#include <chrono>
+#include <system_error>
 
 #define ZEROIZE(x) {memset(&x, 0, sizeof(x));}
 
+#define AVIIF_KEYFRAME 0x10
+#define AVI_INDEX_OF_INDEXES 0x00
+#define AVI_INDEX_OF_CHUNKS 0x01
+
+#define ODML_RIFF_SIZE 1024 /* MB */
+#define ODML_SUPER_INDEX_ENTRIES 256
+#define INDEX_RAM 16 /* MB */
+#define DIRECT_ALIGN 512
+#define INDEX_BLOCK (1 << 20) /* bytes of index encoded per write */
+#define KEYFRAME_INTERVAL 250
+#define BI_RLE8 1
+#define MAX_STREAMS 100 /* two decimal digits in the chunk ids */
+#define INTERLEAVE_BUFFER 64 /* MB */
+#define AVIF_ISINTERLEAVED 0x100
+#define CLONE_MIN (1 << 20) /* bytes of chunks worth a 'JUNK' chunk to be cloned */
+
+static const unsigned char zero_pad[4096 + 8] = { 0 };
+
+static void release_array(unsigned char *data, size_t /* len */, void * /* opaque */)
+{
+    delete[] data;
+}
+
+static void release_vector(unsigned char * /* data */, size_t /* len */, void *opaque)
+{
+    delete (std::vector<uint8_t> *) opaque;
+}
+
+static inline uint64_t clock_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+	    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* 4 buckets per power of two */
+static inline unsigned int latency_bucket(uint64_t ns)
+{
+    unsigned int msb;
+
+    if (ns < 4)
+	return ns;
+    msb = 63 - __builtin_clzll(ns);
+    return ((msb - 1) << 2) | ((ns >> (msb - 2)) & 3);
+}
+
+static inline uint64_t latency_bucket_max(unsigned int bucket)
+{
+    unsigned int msb;
+
+    if (bucket < 4)
+	return bucket;
+    msb = (bucket >> 2) + 1;
+    return ((uint64_t) (5 + (bucket & 3)) << (msb - 2)) - 1;
+}
+
+static inline unsigned char *put_int(unsigned char *p, unsigned int n)
+{
+    p[0] = n;
+    p[1] = n >> 8;
+    p[2] = n >> 16;
+    p[3] = n >> 24;
+    return p + 4;
+}
+
+static inline unsigned char *put_int64(unsigned char *p, uint64_t n)
+{
+    p = put_int(p, (unsigned int) n);
+    return put_int(p, (unsigned int) (n >> 32));
+}
+
+static inline unsigned char *put_short(unsigned char *p, unsigned int n)
+{
+    p[0] = n;
+    p[1] = n >> 8;
+    return p + 2;
+}
+
+static inline unsigned char *put_chars(unsigned char *p, const char *s, int count)
+{
+    memcpy(p, s, count);
+    return p + count;
+}
+
 using namespace std;
 
 /**
@@ -58,24 +144,97 @@ using namespace std;
  * @param audio This parameter is optionnal. It is used for the audio track. If
  * you do not want to add an audio track to your AVI file, simply pass NULL for
  * this argument.
+ * @param options This parameter is optionnal. Extended writer options, pass
+ * NULL to get a plain AVI 1.0 file.
  *
  */
 GWAVI::GWAVI(const char *filename, unsigned width, unsigned height, unsigned bpp, const char *fourcc, unsigned fps,
-	gwavi_audio_t *audio)
+	gwavi_audio_t *audio, gwavi_options_t *options)
 {
+    init(filename, NULL, width, height, bpp, fourcc, fps, audio, options);
+}
+
+/**
+ * Write to a sink of the caller, e.g. a GWAVIMemorySink, instead of a
+ * file. The sink must be empty and stays the caller's: it is closed by
+ * Finalize() but not deleted, options->output is not used.
+ */
+GWAVI::GWAVI(GWAVISink *sink, unsigned width, unsigned height, unsigned bpp, const char *fourcc, unsigned fps,
+	gwavi_audio_t *audio, gwavi_options_t *options)
+{
+    init(NULL, sink, width, height, bpp, fourcc, fps, audio, options);
+}
+
+void GWAVI::init(const char *filename, GWAVISink *sink, unsigned width, unsigned height, unsigned bpp,
+	const char *fourcc, unsigned fps, gwavi_audio_t *audio, gwavi_options_t *options)
+{
+    unsigned int i;
+    uint64_t rate;
+
     ZEROIZE(avi_header);
-    ZEROIZE(stream_header_v);
-    ZEROIZE(stream_format_v);
-    ZEROIZE(stream_header_a);
-    ZEROIZE(stream_format_a);
+    ZEROIZE(this->options);
     marker = 0;
-    offsets_ptr = 0;
-    offsets_len = 0;
-    offsets_start = 0;
-    offsets = NULL;
-    offset_count = 0;
+    header_pending = false;
+    riff_start = 0;
+    riff_limit = 0;
+    riff_count = 0;
+    segment_start = 0;
+    first_riff_frames = 0;
+    interleave = NULL;
+    checkpoint_time = clock_ns();
+    queue = NULL;
+    async_stop = false;
+    writer_idle = false;
+    producers_waiting = 0;
+    async_error = 0;
+    ZEROIZE(stats);
+    ZEROIZE(latency_hist);
+    raw = false;
+    yuv = -1;
+    rle = false;
+    rle_frames = 0;
+    convert_pool = NULL;
+    reserved = NULL;
+    reserved_len = 0;
+
+    if (options)
+	this->options = *options;
+    if (this->options.riff_size == 0)
+	this->options.riff_size = ODML_RIFF_SIZE;
+    if (this->options.super_index_entries == 0)
+	this->options.super_index_entries = ODML_SUPER_INDEX_ENTRIES;
+    if (this->options.index_ram == 0)
+	this->options.index_ram = INDEX_RAM;
+    if (this->options.keyframe_interval == 0)
+	this->options.keyframe_interval = KEYFRAME_INTERVAL;
+    if (this->options.interleave_period == 0 && fps > 0)
+	this->options.interleave_period = 1000000 / fps;
+    if (this->options.interleave_buffer == 0)
+	this->options.interleave_buffer = INTERLEAVE_BUFFER;
+    if (this->options.streaming) {
+	if (this->options.odml || this->options.checkpoint_interval)
+	    (void) fprintf(stderr, "WARNING: a streamed file cannot be patched, "
+		    "writing AVI 1.0 without checkpoints\n");
+	this->options.odml = 0;
+	this->options.checkpoint_interval = 0;
+	/* the others need to seek, std::ofstream cannot even tell its position on a pipe */
+	this->options.output = GWAVI_OUTPUT_FD;
+    }
+    if (!sink && this->options.output == GWAVI_OUTPUT_DIRECT && this->options.align == 0)
+	this->options.align = DIRECT_ALIGN;
+    if (this->options.align & (this->options.align - 1) || this->options.align > 4096) {
+	(void) fprintf(stderr, "WARNING: chunk alignment must be a power of two "
+		"up to 4096: %u\n", this->options.align);
+	this->options.align = 0;
+    }
+    index.SetRamBudget((size_t) this->options.index_ram << 20);
+    /* a RIFF chunk size is 32 bit */
+    riff_limit = (uint64_t) this->options.riff_size << 20;
+    if (riff_limit > 0xfff00000ULL)
+	riff_limit = 0xfff00000ULL;
 
-    outFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+    out = sink;
+    own_out = !sink;
 
     try {
 	if (check_fourcc(fourcc) != 0)
@@ -84,17 +243,34 @@ GWAVI::GWAVI(const char *filename, unsigned width, unsigned height, unsigned bpp
 	if (fps < 1)
 	    throw 1;
 
-	outFile.open(filename, ios_base::out | ios_base::trunc | ios_base::binary);
+	if (!out && this->options.output == GWAVI_OUTPUT_URING) {
+	    try {
+		out = new GWAVIUringSink(filename);
+	    } catch (std::system_error& e) {
+		(void) fprintf(stderr, "WARNING: io_uring is not available (%s), "
+			"using plain writes\n", e.what());
+	    }
+	}
+	if (!out) {
+	    if (this->options.output == GWAVI_OUTPUT_OFSTREAM)
+		out = new GWAVIFileSink(filename);
+	    else if (this->options.output == GWAVI_OUTPUT_DIRECT)
+		out = new GWAVIDirectSink(filename);
+	    else if (this->options.output == GWAVI_OUTPUT_MMAP)
+		out = new GWAVIMmapSink(filename);
+	    else
+		out = new GWAVIFdSink(filename);
+	}
 
 	/* set avi header */
 	avi_header.time_delay = 1000000 / fps;
 	avi_header.data_rate = width * height * bpp / 8;
 	avi_header.flags = 0x10;
-
-	if (audio)
-	    avi_header.data_streams = 2;
-	else
-	    avi_header.data_streams = 1;
+	if (this->options.interleave) {
+	    avi_header.flags |= AVIF_ISINTERLEAVED;
+	    interleave = new GWAVIInterleave(this->options.interleave_period,
+		    (size_t) this->options.interleave_buffer << 20);
+	}
 
 	/* this field gets updated when calling gwavi_close() */
 	avi_header.number_of_frames = 0;
@@ -102,90 +278,231 @@ GWAVI::GWAVI(const char *filename, unsigned width, unsigned height, unsigned bpp
 	avi_header.height = height;
 	avi_header.buffer_size = (width * height * bpp / 8);
 
-	/* set stream header */
-	(void) strcpy(stream_header_v.data_type, "vids");
-	(void) memcpy(stream_header_v.codec, fourcc, 4);
-	stream_header_v.time_scale = 1;
-	stream_header_v.data_rate = fps;
-	stream_header_v.buffer_size = (width * height * bpp / 8);
-	stream_header_v.data_length = 0;
-
-	/* set stream format */
-	stream_format_v.header_size = 40;
-	stream_format_v.width = width;
-	stream_format_v.height = height;
-	stream_format_v.num_planes = 1;
-	stream_format_v.bits_per_pixel = bpp;
-	stream_format_v.compression_type = ((unsigned int) fourcc[3] << 24) + ((unsigned int) fourcc[2] << 16)
-		+ ((unsigned int) fourcc[1] << 8) + ((unsigned int) fourcc[0]);
-	stream_format_v.image_size = width * height * 3;
-	stream_format_v.colors_used = 0;
-	stream_format_v.colors_important = 0;
-
-	stream_format_v.palette = NULL;
-	stream_format_v.palette_count = 0;
-
-	if (audio) {
-	    /* set stream header */
-	    memcpy(stream_header_a.data_type, "auds", 4);
-	    stream_header_a.codec[0] = 1;
-	    stream_header_a.codec[1] = 0;
-	    stream_header_a.codec[2] = 0;
-	    stream_header_a.codec[3] = 0;
-	    stream_header_a.time_scale = 1;
-	    stream_header_a.data_rate = audio->samples_per_second;
-	    stream_header_a.buffer_size = audio->channels * (audio->bits / 8) * audio->samples_per_second;
-	    /* when set to -1, drivers use default quality value */
-	    stream_header_a.audio_quality = -1;
-	    stream_header_a.sample_size = (audio->bits / 8) * audio->channels;
-
-	    /* set stream format */
-	    stream_format_a.format_type = 1;
-	    stream_format_a.channels = audio->channels;
-	    stream_format_a.sample_rate = audio->samples_per_second;
-	    stream_format_a.bytes_per_second = audio->channels * (audio->bits / 8) * audio->samples_per_second;
-	    stream_format_a.block_align = audio->channels * (audio->bits / 8);
-	    stream_format_a.bits_per_sample = audio->bits;
-	    stream_format_a.size = 0;
+	streams.resize(audio ? 2 : 1);
+	init_video_stream(&streams[0], width, height, bpp, fourcc, fps);
+	if (audio)
+	    init_audio_stream(&streams[1], audio);
+	for (i = 0; i < streams.size(); i++)
+	    number_stream(i);
+
+	/* raw video, frames go in as uncompressed bottom-up DIBs */
+	if (!memcmp(fourcc, "DIB ", 4)) {
+	    raw = true;
+	    if (bpp != 24 && bpp != 32) {
+		(void) fprintf(stderr, "WARNING: raw video needs 24 or 32 bpp, "
+			"using 24: %u\n", bpp);
+		streams[0].format_v.bits_per_pixel = 24;
+	    }
+	    streams[0].format_v.compression_type = 0; /* BI_RGB */
+	    streams[0].format_v.image_size = GWAVIConvert::DibStride(width, streams[0].format_v.bits_per_pixel) * height;
+	    avi_header.buffer_size = streams[0].format_v.image_size;
+	    streams[0].header.buffer_size = streams[0].format_v.image_size;
+	    strcpy(streams[0].chunk_id, "00db");
+	} else if (!memcmp(fourcc, "MRLE", 4)) {
+	    /* RLE8 over a palette, grey scale until SetPalette() */
+	    raw = true;
+	    rle = true;
+	    streams[0].format_v.bits_per_pixel = 8;
+	    streams[0].format_v.compression_type = BI_RLE8;
+	    streams[0].format_v.image_size = GWAVIConvert::DibStride(width, 8) * height;
+	    streams[0].format_v.palette = new unsigned int[256];
+	    streams[0].format_v.palette_count = 256;
+	    streams[0].format_v.colors_used = 256;
+	    for (i = 0; i < 256; i++)
+		streams[0].format_v.palette[i] = i * 0x010101;
+	    avi_header.buffer_size = streams[0].format_v.image_size;
+	    streams[0].header.buffer_size = streams[0].format_v.image_size;
+	} else if ((yuv = GWAVIConvert::YuvFormat(fourcc)) >= 0) {
+	    raw = true;
+	    if (width % 2 || (yuv != GWAVIConvert::YUV_YUY2 && height % 2))
+		(void) fprintf(stderr, "WARNING: %.4s needs an even frame size, "
+			"AddRawVideoFrame() will fail: %ux%u\n", fourcc, width, height);
+	    streams[0].format_v.bits_per_pixel = GWAVIConvert::YuvBpp(yuv);
+	    streams[0].format_v.image_size = GWAVIConvert::YuvSize(yuv, width, height);
+	    avi_header.buffer_size = streams[0].format_v.image_size;
+	    streams[0].header.buffer_size = streams[0].format_v.image_size;
 	}
 
-	write_chars_bin("RIFF", 4);
-	write_int(0);
-	write_chars_bin("AVI ", 4);
-
-	write_avi_header_chunk();
-
-	write_chars_bin("LIST", 4);
+	if (this->options.prealloc || this->options.expected_duration) {
+	    rate = this->options.expected_rate;
+	    if (rate == 0)
+		rate = (uint64_t) avi_header.buffer_size * fps + (audio ? streams[1].format_a.bytes_per_second : 0);
+	    out->SetPreallocation((uint64_t) this->options.prealloc << 20, rate * this->options.expected_duration);
+	}
 
-	marker = outFile.tellp();
+	/* started once, not for every frame */
+	if (raw && this->options.convert_threads > 1)
+	    convert_pool = new GWAVIConvert::Pool(this->options.convert_threads);
 
-	write_int(0);
-	write_chars_bin("movi", 4);
+	/* streaming, wait for AddVideoStream() and AddAudioStream() */
+	header_pending = this->options.streaming;
+	if (!header_pending)
+	    write_file_header();
 
-	offsets_len = 1024;
-	offsets = new unsigned int[offsets_len];
-	offsets_ptr = 0;
+	if (this->options.async_queue) {
+	    queue = new GWAVIQueue(this->options.async_queue);
+	    writer = std::thread(&GWAVI::writer_thread, this);
+	}
 
     } catch (...) {
-	if (outFile.is_open()) {
-	    outFile.close();
-	}
+	if (own_out)
+	    delete out;
+	delete interleave;
+	delete convert_pool;
+	free_streams();
 	throw;
     }
 }
 
 GWAVI::~GWAVI()
 {
-    if (outFile.is_open()) {
-	outFile.close();
+    stop_writer();
+    if (own_out)
+	delete out;
+    delete interleave;
+    delete convert_pool;
+    free_streams();
+}
+
+/**
+ * Set up a "vids" stream of compressed frames.
+ */
+void GWAVI::init_video_stream(struct gwavi_stream_t *stream, unsigned width, unsigned height, unsigned bpp,
+	const char *fourcc, unsigned fps)
+{
+    ZEROIZE(*stream);
+
+    /* set stream header */
+    (void) strcpy(stream->header.data_type, "vids");
+    (void) memcpy(stream->header.codec, fourcc, 4);
+    stream->header.time_scale = 1;
+    stream->header.data_rate = fps;
+    stream->header.buffer_size = (width * height * bpp / 8);
+    stream->header.data_length = 0;
+
+    /* set stream format */
+    stream->format_v.header_size = 40;
+    stream->format_v.width = width;
+    stream->format_v.height = height;
+    stream->format_v.num_planes = 1;
+    stream->format_v.bits_per_pixel = bpp;
+    stream->format_v.compression_type = ((unsigned int) fourcc[3] << 24) + ((unsigned int) fourcc[2] << 16)
+	    + ((unsigned int) fourcc[1] << 8) + ((unsigned int) fourcc[0]);
+    stream->format_v.image_size = width * height * 3;
+    stream->format_v.colors_used = 0;
+    stream->format_v.colors_important = 0;
+
+    stream->format_v.palette = NULL;
+    stream->format_v.palette_count = 0;
+}
+
+/**
+ * Set up an "auds" stream of PCM audio.
+ */
+void GWAVI::init_audio_stream(struct gwavi_stream_t *stream, gwavi_audio_t *audio)
+{
+    ZEROIZE(*stream);
+    stream->audio = true;
+
+    /* set stream header */
+    memcpy(stream->header.data_type, "auds", 4);
+    stream->header.codec[0] = 1;
+    stream->header.codec[1] = 0;
+    stream->header.codec[2] = 0;
+    stream->header.codec[3] = 0;
+    stream->header.time_scale = 1;
+    stream->header.data_rate = audio->samples_per_second;
+    stream->header.buffer_size = audio->channels * (audio->bits / 8) * audio->samples_per_second;
+    /* when set to -1, drivers use default quality value */
+    stream->header.audio_quality = -1;
+    stream->header.sample_size = (audio->bits / 8) * audio->channels;
+
+    /* set stream format */
+    stream->format_a.format_type = 1;
+    stream->format_a.channels = audio->channels;
+    stream->format_a.sample_rate = audio->samples_per_second;
+    stream->format_a.bytes_per_second = audio->channels * (audio->bits / 8) * audio->samples_per_second;
+    stream->format_a.block_align = audio->channels * (audio->bits / 8);
+    stream->format_a.bits_per_sample = audio->bits;
+    stream->format_a.size = 0;
+}
+
+/**
+ * Give stream n its chunk ids and, in OpenDML mode, its super index.
+ */
+void GWAVI::number_stream(unsigned int n)
+{
+    struct gwavi_stream_t *stream = &streams[n];
+
+    snprintf(stream->chunk_id, sizeof(stream->chunk_id), "%02u%s", n, stream->audio ? "wb" : "dc");
+    snprintf(stream->index_id, sizeof(stream->index_id), "ix%02u", n);
+    if (interleave && stream->audio)
+	interleave->AddAudioStream(stream->format_a.bytes_per_second, stream->format_a.block_align);
+    else if (interleave)
+	interleave->AddVideoStream(stream->header.time_scale, stream->header.data_rate);
+    if (options.odml) {
+	stream->super_index.entries = new gwavi_super_index_entry_t[options.super_index_entries];
+	memset(stream->super_index.entries, 0, options.super_index_entries * sizeof(gwavi_super_index_entry_t));
     }
+}
 
-    delete[] offsets;
+/**
+ * Add a stream after the constructor and rewrite the file header for it.
+ *
+ * @return the stream number, -1 on error.
+ */
+int GWAVI::append_stream(struct gwavi_stream_t *stream)
+{
+    if (stats.frames) {
+	fputs("streams must be added before the first frame\n", stderr);
+	return -1;
+    }
+    if (streams.size() >= MAX_STREAMS) {
+	fprintf(stderr, "an AVI file holds at most %d streams\n", MAX_STREAMS);
+	return -1;
+    }
+
+    try {
+	streams.push_back(*stream);
+	number_stream(streams.size() - 1);
+	if (!header_pending) {
+	    out->Seek(0);
+	    write_file_header();
+	}
+    } catch (std::system_error& e) {
+	std::cerr << e.code().message() << "\n";
+	return -1;
+    }
+    return streams.size() - 1;
+}
+
+void GWAVI::free_streams()
+{
+    for (gwavi_stream_t &stream : streams) {
+	delete[] stream.format_v.palette;
+	delete[] stream.super_index.entries;
+    }
+    streams.clear();
+}
+
+/**
+ * Number of the first audio stream, GetStreamCount() if there is none.
+ */
+unsigned int GWAVI::audio_stream()
+{
+    unsigned int i;
+
+    for (i = 0; i < streams.size() && !streams[i].audio; i++)
+	;
+    return i;
 }
 
 /**
  * This function allows you to add an encoded video frame to the AVI file.
  *
+ * In async mode the frame is copied to the writer queue and an error of the
+ * writer thread is reported by the next call.
+ *
  * @param gwavi Main gwavi structure initialized with gwavi_open()-
  * @param buffer Video buffer size.
  * @param len Video buffer length.
@@ -194,101 +511,598 @@ GWAVI::~GWAVI()
  */
 int GWAVI::AddVideoFrame(unsigned char *buffer, size_t len)
 {
-    int ret = 0;
-    size_t maxi_pad; /* if your frame is raggin, give it some paddin' */
-    size_t t;
+    return AddVideoFrame(buffer, len, NULL, NULL);
+}
 
-    if (!buffer) {
-	fputs("gwavi and/or buffer argument cannot be NULL", stderr);
+/**
+ * Add a video frame and take ownership of its buffer. The buffer is not
+ * copied, release(buffer, len, opaque) is called once its bytes have been
+ * handed to the kernel (or copied into the sink), or the frame was dropped
+ * or failed. The bytes may still be in the page cache then, they are on
+ * disk after the next checkpoint, see options.checkpoint_interval. In
+ * async mode this happens on the writer thread. GWAVI_OUTPUT_URING keeps
+ * the write of a large frame in flight, it is released by a later call or
+ * by Finalize().
+ *
+ * @param buffer Video buffer.
+ * @param len Video buffer length.
+ * @param release Called when the library is done with buffer. NULL means the
+ * caller keeps ownership, as AddVideoFrame(buffer, len).
+ * @param opaque Passed to release.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int GWAVI::AddVideoFrame(unsigned char *buffer, size_t len, gwavi_release_t release, void *opaque)
+{
+    return AddVideoFrame(buffer, len, true, release, opaque);
+}
+
+/**
+ * Add a video frame that is a key frame or depends on earlier frames. Only
+ * key frames get AVIIF_KEYFRAME in 'idx1', delta frames have bit 31 of their
+ * 'ix##' size set. The other AddVideoFrame() calls add key frames.
+ *
+ * @param keyframe The frame decodes on its own.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int GWAVI::AddVideoFrame(unsigned char *buffer, size_t len, bool keyframe)
+{
+    return AddVideoFrame(buffer, len, keyframe, NULL, NULL);
+}
+
+/**
+ * Add a key or delta video frame and take ownership of its buffer, see
+ * AddVideoFrame(buffer, len, release, opaque).
+ */
+int GWAVI::AddVideoFrame(unsigned char *buffer, size_t len, bool keyframe, gwavi_release_t release, void *opaque)
+{
+    GWAVIQueue::gwavi_frame_t f = { 0, buffer, len, release, opaque, !keyframe };
+
+    return add_video_frame(&f);
+}
+
+/**
+ * Add a video frame, moving the vector into the library.
+ */
+int GWAVI::AddVideoFrame(std::vector<uint8_t> &&buffer)
+{
+    std::vector<uint8_t> *v = new std::vector<uint8_t>(std::move(buffer));
+    GWAVIQueue::gwavi_frame_t f = { 0, v->data(), v->size(), release_vector, v, false };
+
+    return add_video_frame(&f);
+}
+
+/**
+ * Add a video frame, the buffer is freed with delete[] once it is handed to
+ * the kernel.
+ */
+int GWAVI::AddVideoFrame(std::unique_ptr<uint8_t[]> buffer, size_t len)
+{
+    GWAVIQueue::gwavi_frame_t f = { 0, buffer.release(), len, release_array, NULL, false };
+
+    return add_video_frame(&f);
+}
+
+/**
+ * Get memory for a video frame of up to len bytes that an encoder can
+ * write its output to. With GWAVI_OUTPUT_MMAP or a memory sink it is the
+ * place of the frame in the file, so the frame is never copied; otherwise,
+ * or with async_queue or interleave, a buffer that CommitVideoFrame()
+ * writes like AddVideoFrame(). Valid until CommitVideoFrame(), no other
+ * frame may be added in between.
+ *
+ * @param len Most bytes the frame can take.
+ *
+ * @return The memory, NULL on error.
+ */
+unsigned char *GWAVI::ReserveVideoFrame(size_t len)
+{
+    size_t pad = len % 4 ? 4 - len % 4 : 0;
+    uint64_t pos;
+
+    reserved = NULL;
+    if (!queue && !interleave) {
+	try {
+	    write_pending_header();
+	    /* the same RIFF and 'JUNK' as write_frame() will use */
+	    check_riff(len + pad + (options.align ? options.align + 8 : 0));
+	    pos = out->Tell();
+	    reserved = out->Map(pos + junk_size(pos) + 8, len + pad);
+	} catch (std::system_error& e) {
+	    std::cerr << e.code().message() << "\n";
+	    return NULL;
+	}
+    }
+    if (!reserved) {
+	reserve_buffer.resize(len);
+	reserved = reserve_buffer.data();
+    }
+    reserved_len = len;
+    return reserved;
+}
+
+/**
+ * Add the key frame filled in ReserveVideoFrame().
+ *
+ * @param len Bytes of it, not more than reserved.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int GWAVI::CommitVideoFrame(size_t len)
+{
+    return CommitVideoFrame(len, true);
+}
+
+/**
+ * Add the key or delta frame filled in ReserveVideoFrame().
+ */
+int GWAVI::CommitVideoFrame(size_t len, bool keyframe)
+{
+    GWAVIQueue::gwavi_frame_t f = { 0, reserved, len, NULL, NULL, !keyframe };
+
+    if (!reserved || len > reserved_len) {
+	fprintf(stderr, "%zu bytes of video frame are not reserved\n", len);
 	return -1;
     }
-    if (len < 256)
-	fprintf(stderr, "WARNING: specified buffer len seems rather small: %d. Are you sure about this?\n", (int) len);
-    try {
-	offset_count++;
-	stream_header_v.data_length++;
+    reserved = NULL;
+    return add_video_frame(&f);
+}
 
-	maxi_pad = len % 4;
-	if (maxi_pad > 0)
-	    maxi_pad = 4 - maxi_pad;
+/**
+ * Add a frame of packed pixels in raw video mode. With the "DIB " fourcc it
+ * is stored as a bottom-up BI_RGB DIB of the bpp given to the constructor,
+ * with YUY2, I420 (IYUV), YV12 or NV12 it is converted to that format. With
+ * MRLE it takes GWAVI_PIX_PAL8 frames and encodes them as RLE8, delta coded
+ * against the previous frame with a full frame every
+ * options.keyframe_interval frames.
+ *
+ * @param pixels Top-down frame of width x height pixels.
+ * @param stride Bytes between the starts of two rows, 0 for packed rows.
+ * @param format GWAVI_PIX_*.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int GWAVI::AddRawVideoFrame(const unsigned char *pixels, size_t stride, int format)
+{
+    size_t size = streams[0].format_v.image_size;
+    unsigned char *dib;
+    bool key = true;
+    int ret;
 
-	if (offset_count >= offsets_len) {
-	    offsets_len += 1024;
-	    delete[] offsets;
-	    offsets = new unsigned int[offsets_len];
+    if (!raw) {
+	fputs("raw frames need the \"DIB \", MRLE or a YUV fourcc\n", stderr);
+	return -1;
+    }
+    if (!pixels) {
+	fputs("buffer argument cannot be NULL\n", stderr);
+	return -1;
+    }
+    if (GWAVIConvert::PixelSize(format) == 0) {
+	fprintf(stderr, "unknown pixel format: %d\n", format);
+	return -1;
+    }
+    if (rle && format != GWAVI_PIX_PAL8) {
+	fputs("MRLE video takes GWAVI_PIX_PAL8 frames\n", stderr);
+	return -1;
+    }
+    if (!rle && format == GWAVI_PIX_PAL8) {
+	fputs("GWAVI_PIX_PAL8 frames need the MRLE fourcc\n", stderr);
+	return -1;
+    }
+    if (stride == 0)
+	stride = (size_t) streams[0].format_v.width * GWAVIConvert::PixelSize(format);
+    if (rle)
+	size = GWAVIConvert::Rle8Bound(streams[0].format_v.width, streams[0].format_v.height);
+
+    /* the writer thread gets a buffer of its own */
+    if (queue) {
+	dib = new unsigned char[size];
+    } else {
+	raw_buffer.resize(size);
+	dib = raw_buffer.data();
+    }
+    if (rle) {
+	size = rle_frame(pixels, stride, dib, &key);
+    } else if (yuv >= 0) {
+	if (GWAVIConvert::ToYuv(pixels, stride, format, streams[0].format_v.width, streams[0].format_v.height, dib, yuv,
+		convert_pool) < 0) {
+	    fputs("frame size does not fit the YUV format\n", stderr);
+	    if (queue)
+		delete[] dib;
+	    return -1;
 	}
+    } else {
+	GWAVIConvert::ToDib(pixels, stride, format, streams[0].format_v.width, streams[0].format_v.height, dib,
+		streams[0].format_v.bits_per_pixel, convert_pool);
+    }
 
-	offsets[offsets_ptr++] = (unsigned int) (len + maxi_pad);
+    if (queue)
+	ret = AddVideoFrame(dib, size, key, release_array, NULL);
+    else
+	ret = AddVideoFrame(dib, size, key);
+    /* a frame that is not in the file must not be the base of the next one */
+    if (rle && ret == 0)
+	rle_keep(pixels, stride);
+    return ret;
+}
 
-	write_chars_bin("00dc", 4);
+/**
+ * Encode a palette frame into dst, delta coded against the last frame
+ * rle_keep() took.
+ *
+ * @param key Set to whether the frame was encoded as a full frame.
+ *
+ * @return the encoded size.
+ */
+size_t GWAVI::rle_frame(const unsigned char *pixels, size_t stride, unsigned char *dst, bool *key)
+{
+    *key = rle_frames % options.keyframe_interval == 0;
+    return GWAVIConvert::ToRle8(pixels, stride, *key ? NULL : rle_prev.data(), streams[0].format_v.width,
+	    streams[0].format_v.height, dst, convert_pool);
+}
 
-	write_int((unsigned int) (len + maxi_pad));
+/**
+ * Keep a copy of a palette frame that was added, for the delta coding of
+ * the next one.
+ */
+void GWAVI::rle_keep(const unsigned char *pixels, size_t stride)
+{
+    unsigned int width = streams[0].format_v.width;
+    unsigned int height = streams[0].format_v.height;
+    unsigned int y;
+
+    rle_prev.resize((size_t) width * height);
+    for (y = 0; y < height; y++)
+	memcpy(rle_prev.data() + (size_t) y * width, pixels + y * stride, width);
+    rle_frames++;
+}
 
-	outFile.write((char *) buffer, len);
+/**
+ * Set the palette of MRLE video, colors as 0x00RRGGBB. It can be changed up
+ * to Finalize(), the last one set goes to the file.
+ *
+ * @return 0 on success, -1 if the video has no palette.
+ */
+int GWAVI::SetPalette(const unsigned int *colors, unsigned int count)
+{
+    if (!streams[0].format_v.palette) {
+	fputs("only MRLE video has a palette\n", stderr);
+	return -1;
+    }
+    if (count > streams[0].format_v.palette_count)
+	count = streams[0].format_v.palette_count;
+    memcpy(streams[0].format_v.palette, colors, count * sizeof(colors[0]));
+    return 0;
+}
+
+/**
+ * This function allows you to add the audio track to your AVI file.
+ *
+ * @param gwavi Main gwavi structure initialized with gwavi_open()-
+ * @param buffer Audio buffer size.
+ * @param len Audio buffer length.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int GWAVI::AddAudioFrame(unsigned char *buffer, size_t len)
+{
+    return AddAudioFrame(buffer, len, NULL, NULL);
+}
+
+/**
+ * Add audio and take ownership of its buffer, see AddVideoFrame(buffer, len,
+ * release, opaque).
+ */
+int GWAVI::AddAudioFrame(unsigned char *buffer, size_t len, gwavi_release_t release, void *opaque)
+{
+    GWAVIQueue::gwavi_frame_t f = { audio_stream(), buffer, len, release, opaque, false };
+
+    return add_audio_frame(&f);
+}
+
+int GWAVI::AddAudioFrame(std::vector<uint8_t> &&buffer)
+{
+    std::vector<uint8_t> *v = new std::vector<uint8_t>(std::move(buffer));
+    GWAVIQueue::gwavi_frame_t f = { audio_stream(), v->data(), v->size(), release_vector, v, false };
+
+    return add_audio_frame(&f);
+}
+
+int GWAVI::AddAudioFrame(std::unique_ptr<uint8_t[]> buffer, size_t len)
+{
+    GWAVIQueue::gwavi_frame_t f = { audio_stream(), buffer.release(), len, release_array, NULL, false };
+
+    return add_audio_frame(&f);
+}
+
+/**
+ * Add another video stream of compressed frames, see the constructor. All
+ * streams have to be added before the first frame.
+ *
+ * @return the stream number for AddFrame(), -1 on error.
+ */
+int GWAVI::AddVideoStream(unsigned width, unsigned height, unsigned bpp, const char *fourcc, unsigned fps)
+{
+    struct gwavi_stream_t stream;
+    int r;
+
+    r = check_fourcc(fourcc);
+    if (r < 0)
+	return -1;
+    if (r != 0)
+	(void) fprintf(stderr, "WARNING: given fourcc does not seem to "
+		"be valid: %s\n", fourcc);
+    if (fps < 1) {
+	fputs("fps must be > 0\n", stderr);
+	return -1;
+    }
+
+    init_video_stream(&stream, width, height, bpp, fourcc, fps);
+    return append_stream(&stream);
+}
+
+/**
+ * Add another audio stream. All streams have to be added before the first
+ * frame. AddAudioFrame() writes to the first audio stream.
+ *
+ * @return the stream number for AddFrame(), -1 on error.
+ */
+int GWAVI::AddAudioStream(gwavi_audio_t *audio)
+{
+    struct gwavi_stream_t stream;
+
+    if (!audio) {
+	fputs("audio argument cannot be NULL\n", stderr);
+	return -1;
+    }
+
+    init_audio_stream(&stream, audio);
+    return append_stream(&stream);
+}
+
+/**
+ * Add a frame to any stream. Streams are numbered in file order: 0 is the
+ * video stream of the constructor, 1 its audio stream if it has one, then
+ * the streams of AddVideoStream() and AddAudioStream().
+ *
+ * @return 0 on success, -1 on error.
+ */
+int GWAVI::AddFrame(unsigned int stream, unsigned char *buffer, size_t len)
+{
+    return AddFrame(stream, buffer, len, NULL, NULL);
+}
+
+/**
+ * Add a frame to any stream and take ownership of its buffer, see
+ * AddVideoFrame(buffer, len, release, opaque).
+ */
+int GWAVI::AddFrame(unsigned int stream, unsigned char *buffer, size_t len, gwavi_release_t release, void *opaque)
+{
+    return AddFrame(stream, buffer, len, true, release, opaque);
+}
+
+/**
+ * Add a key or delta frame to any stream, see AddVideoFrame(buffer, len,
+ * keyframe). Audio chunks are always key frames.
+ */
+int GWAVI::AddFrame(unsigned int stream, unsigned char *buffer, size_t len, bool keyframe, gwavi_release_t release,
+	void *opaque)
+{
+    GWAVIQueue::gwavi_frame_t f = { stream, buffer, len, release, opaque, !keyframe };
+
+    if (stream < streams.size() && streams[stream].audio)
+	return add_audio_frame(&f);
+    return add_video_frame(&f);
+}
+
+/**
+ * Add a batch of frames of any streams, e.g. a burst of small audio
+ * chunks. The chunk headers are built in one pass and the batch goes to
+ * the sink in a single WriteV(), split only where it starts a new RIFF.
+ * Counts as one call in GetStats(). With async_queue or interleave the
+ * frames are added one by one, as AddFrame() does, and still count once.
+ *
+ * @param frames In file order, the buffers are not kept.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int GWAVI::AddFrames(const gwavi_batch_frame_t *frames, size_t count)
+{
+    GWAVIQueue::gwavi_frame_t f;
+    struct gwavi_stream_t *s;
+    size_t i, pad, junk, len;
+    unsigned char *h;
+    uint64_t t0, pos;
+    int ret = 0;
+
+    if (count == 0)
+	return 0;
+    for (i = 0; i < count; i++)
+	if (frames[i].stream >= streams.size() || !frames[i].buffer) {
+	    fprintf(stderr, "frame %zu of the batch has no stream %u or no buffer\n", i, frames[i].stream);
+	    return -1;
+	}
+
+    t0 = clock_ns();
+    if (queue || interleave) {
+	for (i = 0; i < count; i++) {
+	    f = { frames[i].stream, (unsigned char *) frames[i].buffer, frames[i].len, NULL, NULL,
+		    frames[i].delta };
+	    if (interleave_frame(&f) == -1)
+		ret = -1;
+	}
+	record_latency(clock_ns() - t0);
+	return ret;
+    }
 
-	for (t = 0; t < maxi_pad; t++)
-	    outFile.write("\0", 1);
+    try {
+	write_pending_header();
+
+	batch_headers.resize(count * 16);
+	batch_iov.clear();
+	batch_chunks.clear();
+	h = batch_headers.data();
+	pos = out->Tell();
+	for (i = 0; i < count; i++, h += 16) {
+	    s = &streams[frames[i].stream];
+	    pad = frames[i].len % 4 ? 4 - frames[i].len % 4 : 0;
+	    len = frames[i].len + pad;
+
+	    /* the same RIFF split as write_frame(), behind the frames so far */
+	    if (!riff_fits(pos, len + (options.align ? options.align + 8 : 0), batch_chunks.size())) {
+		write_batch();
+		check_riff(len + (options.align ? options.align + 8 : 0));
+		pos = out->Tell();
+	    }
+
+	    junk = junk_size(pos);
+	    batch_chunks.push_back({ frames[i].stream, pos + junk, (unsigned int) len,
+		    !frames[i].delta || s->audio });
+	    if (junk) {
+		put_int(put_chars(h, "JUNK", 4), junk - 8);
+		batch_iov.push_back({ h, 8 });
+		batch_iov.push_back({ (void *) zero_pad, junk - 8 });
+	    }
+	    put_int(put_chars(h + 8, s->chunk_id, 4), len);
+	    batch_iov.push_back({ h + 8, 8 });
+	    batch_iov.push_back({ (void *) frames[i].buffer, frames[i].len });
+	    if (pad)
+		batch_iov.push_back({ (void *) zero_pad, pad });
+	    pos += junk + 8 + len;
+	}
+	write_batch();
 
+	maybe_checkpoint();
     } catch (std::system_error& e) {
 	std::cerr << e.code().message() << "\n";
 	ret = -1;
     }
+    record_latency(clock_ns() - t0);
 
     return ret;
 }
 
 /**
- * This function allows you to add the audio track to your AVI file.
+ * Write the chunks AddFrames() gathered, then index them. A write that
+ * fails leaves no index entries behind that point past the data.
+ */
+void GWAVI::write_batch()
+{
+    out->WriteV(batch_iov.data(), batch_iov.size());
+    batch_iov.clear();
+
+    for (const gwavi_chunk_t &c : batch_chunks) {
+	add_index_entry(c.stream, c.offset, c.size, !c.keyframe);
+	if (!streams[c.stream].audio)
+	    streams[c.stream].header.data_length++;
+	else
+	    streams[c.stream].header.data_length += c.size;
+    }
+    batch_chunks.clear();
+}
+
+/**
+ * Append chunks of another AVI file without passing them through memory.
+ * Chunks that lie back to back in the source go to the sink as one
+ * GWAVISink::CopyFrom(). A large run of them is put at the same offset
+ * modulo the block size as in the source, behind a 'JUNK' chunk, so that a
+ * filesystem with reflinks can share the whole blocks of the run instead of
+ * copying them; GetStats() counts the bytes shared.
  *
- * @param gwavi Main gwavi structure initialized with gwavi_open()-
- * @param buffer Audio buffer size.
- * @param len Audio buffer length.
+ * With options.align the data of every chunk is aligned like write_frame()
+ * does, a run only goes on while the chunks keep that alignment.
+ *
+ * The chunk headers are copied as they are, the source has to number its
+ * streams like this file. Not with async_queue or interleave. GetStats()
+ * takes the whole call as one latency sample, like AddFrames().
+ *
+ * @param fd Source file, open for reading.
+ * @param chunks In file order.
  *
  * @return 0 on success, -1 on error.
  */
-int GWAVI::AddAudioFrame(unsigned char *buffer, size_t len)
+int GWAVI::CopyChunks(int fd, const gwavi_chunk_t *chunks, size_t count)
 {
+    std::vector<unsigned char> zero;
+    uint64_t t0, pos, len;
+    size_t i, j, k, junk;
     int ret = 0;
-    size_t maxi_pad; /* in case audio bleeds over the 4 byte boundary  */
-    size_t t;
 
-    if (!buffer) {
-	(void) fputs("gwavi and/or buffer argument cannot be NULL", stderr);
+    if (queue || interleave) {
+	fputs("chunks cannot be copied with async_queue or interleave\n", stderr);
 	return -1;
     }
-    try {
-	offset_count++;
-
-	maxi_pad = len % 4;
-	if (maxi_pad > 0)
-	    maxi_pad = 4 - maxi_pad;
-
-	if (offset_count >= offsets_len) {
-	    offsets_len += 1024;
-	    delete[] offsets;
-	    offsets = new unsigned int[offsets_len];
+    if (count == 0)
+	return 0;
+    for (i = 0; i < count; i++)
+	if (chunks[i].stream >= streams.size()) {
+	    fprintf(stderr, "no stream %u to copy a chunk to\n", chunks[i].stream);
+	    return -1;
 	}
 
-	offsets[offsets_ptr++] = (unsigned int) ((len + maxi_pad) | 0x80000000);
-
-	write_chars_bin("01wb", 4);
-	write_int((unsigned int) (len + maxi_pad));
-
-	outFile.write((char *) buffer, len);
-
-	for (t = 0; t < maxi_pad; t++)
-	    outFile.write("\0", 1);
-
-	stream_header_a.data_length += (unsigned int) (len + maxi_pad);
-
+    t0 = clock_ns();
+    try {
+	write_pending_header();
+
+	for (i = 0; i < count; i = j) {
+	    check_riff(chunks[i].size + 8 + GWAVISink::CLONE_BLOCK + 8);
+	    pos = out->Tell();
+
+	    /* the run, as far as it fits in this RIFF with its index entries */
+	    len = chunks[i].size + 8;
+	    for (j = i + 1; j < count && chunks[j].offset == chunks[j - 1].offset + chunks[j - 1].size + 8; j++) {
+		if (options.align && (chunks[j].offset - chunks[i].offset) % options.align)
+		    break;
+		if (options.odml
+			&& pos + GWAVISink::CLONE_BLOCK + 8 + len + chunks[j].size + 8
+				+ (uint64_t) (index.Count() - segment_start + j - i + 1) * (16 + 8)
+				+ streams.size() * 32 - riff_start > riff_limit)
+		    break;
+		len += chunks[j].size + 8;
+	    }
+
+	    if (len >= CLONE_MIN && (!options.align || (chunks[i].offset + 8) % options.align == 0)) {
+		junk = (chunks[i].offset - pos) % GWAVISink::CLONE_BLOCK;
+		if (junk > 0 && junk < 8)
+		    junk += GWAVISink::CLONE_BLOCK;
+	    } else {
+		junk = junk_size(pos);
+	    }
+	    if (junk) {
+		zero.resize(junk - 8);
+		write_chunk("JUNK", zero.data(), junk - 8, 0, 0);
+		pos += junk;
+	    }
+
+	    stats.cloned += out->CopyFrom(fd, chunks[i].offset, len);
+
+	    /* only once copied, like write_batch() */
+	    for (k = i; k < j; k++) {
+		add_index_entry(chunks[k].stream, pos + chunks[k].offset - chunks[i].offset, chunks[k].size,
+			!chunks[k].keyframe && !streams[chunks[k].stream].audio);
+		if (!streams[chunks[k].stream].audio)
+		    streams[chunks[k].stream].header.data_length++;
+		else
+		    streams[chunks[k].stream].header.data_length += chunks[k].size;
+	    }
+
+	    maybe_checkpoint();
+	}
     } catch (std::system_error& e) {
 	std::cerr << e.code().message() << "\n";
 	ret = -1;
     }
+    record_latency(clock_ns() - t0);
 
     return ret;
 }
 
+unsigned int GWAVI::GetStreamCount()
+{
+    return streams.size();
+}
+
 /**
  * This function should be called when the program is done adding video and/or
  * audio frames to the AVI file. It frees memory allocated for gwavi_open() for
@@ -300,37 +1114,47 @@ int GWAVI::AddAudioFrame(unsigned char *buffer, size_t len)
  */
 int GWAVI::Finalize()
 {
+    GWAVIQueue::gwavi_frame_t f;
+    uint64_t t;
     int ret = 0;
-    long t;
-
-    try {
-	t = outFile.tellp();
-	outFile.seekp(marker, ios_base::beg);
-	write_int((unsigned int) (t - marker - 4));
-	outFile.seekp(t, ios_base::beg);
 
-	write_index(offset_count, offsets);
+    if (interleave)
+	while (interleave->Pop(&f, true))
+	    if (output_frame(&f) == -1)
+		ret = -1;
 
-	delete[] offsets;
-	offsets = NULL;
-
-	/* reset some avi header fields */
-	avi_header.number_of_frames = stream_header_v.data_length;
-
-	t = outFile.tellp();
-	outFile.seekp(12, ios_base::beg);
-	write_avi_header_chunk();
-	outFile.seekp(t, ios_base::beg);
+    stop_writer();
+    if (async_error)
+	ret = -1;
 
-	t = outFile.tellp();
-	outFile.seekp(4, ios_base::beg);
-	write_int((unsigned int) (t - 8));
-	outFile.seekp(t, ios_base::beg);
+    try {
+	if (options.streaming) {
+	    write_pending_header();
+	    t = out->Tell();
+	    write_index(index.Count());
+	    index.Clear();
+	    avi_header.number_of_frames = streams[0].header.data_length;
+	    if (options.streaming_trailer)
+		write_trailer(t);
+	} else {
+	    close_riff();
+
+	    index.Clear();
+
+	    /* reset some avi header fields */
+	    if (options.odml)
+		avi_header.number_of_frames = first_riff_frames;
+	    else
+		avi_header.number_of_frames = streams[0].header.data_length;
+
+	    build_hdrl();
+	    out->PWrite(hdrl.data(), hdrl.size(), 12);
+	}
 
-	if (stream_format_v.palette) // TODO check
-	    delete[] stream_format_v.palette;
+	delete[] streams[0].format_v.palette;
+	streams[0].format_v.palette = NULL;
 
-	outFile.close();
+	out->Close();
     } catch (std::system_error& e) {
 	std::cerr << e.code().message() << "\n";
 	ret = -1;
@@ -339,6 +1163,29 @@ int GWAVI::Finalize()
     return ret;
 }
 
+/**
+ * Get the Add*Frame() call statistics. Latencies are upper bounds of
+ * histogram buckets 1/4 of a power of two wide.
+ */
+void GWAVI::GetStats(gwavi_stats_t *stats)
+{
+    unsigned long long n = 0, p50, p99;
+    unsigned int i;
+
+    *stats = this->stats;
+    stats->p50_ns = 0;
+    stats->p99_ns = 0;
+    p50 = (this->stats.frames + 1) / 2;
+    p99 = this->stats.frames - this->stats.frames / 100;
+    for (i = 0; i < 256 && n < p99; i++) {
+	n += latency_hist[i];
+	if (!stats->p50_ns && n >= p50)
+	    stats->p50_ns = latency_bucket_max(i);
+	if (n >= p99)
+	    stats->p99_ns = latency_bucket_max(i);
+    }
+}
+
 /**
  * This function allows you to reset the framerate. In a standard use case, you
  * should not need to call it. However, if you need to, you can call it to reset
@@ -352,7 +1199,7 @@ int GWAVI::Finalize()
  */
 void GWAVI::SetFramerate(unsigned int fps)
 {
-    stream_header_v.data_rate = fps;
+    streams[0].header.data_rate = fps;
     avi_header.time_delay = (10000000 / fps);
 }
 
@@ -374,8 +1221,8 @@ void GWAVI::SetFourccCodec(const char *fourcc)
 		"be valid: %s\n", fourcc);
     }
 
-    memcpy(stream_header_v.codec, fourcc, 4);
-    stream_format_v.compression_type = ((unsigned int) fourcc[3] << 24) + ((unsigned int) fourcc[2] << 16)
+    memcpy(streams[0].header.codec, fourcc, 4);
+    streams[0].format_v.compression_type = ((unsigned int) fourcc[3] << 24) + ((unsigned int) fourcc[2] << 16)
 	    + ((unsigned int) fourcc[1] << 8) + ((unsigned int) fourcc[0]);
 }
 
@@ -395,211 +1242,742 @@ void GWAVI::SetVideoFrameSize(unsigned int width, unsigned int height)
 {
     unsigned int size = (width * height * 3);
 
+    if (yuv >= 0)
+	size = GWAVIConvert::YuvSize(yuv, width, height);
+    else if (raw)
+	size = GWAVIConvert::DibStride(width, streams[0].format_v.bits_per_pixel) * height;
     avi_header.data_rate = size;
     avi_header.width = width;
     avi_header.height = height;
     avi_header.buffer_size = size;
-    stream_header_v.buffer_size = size;
-    stream_format_v.width = width;
-    stream_format_v.height = height;
-    stream_format_v.image_size = size;
+    streams[0].header.buffer_size = size;
+    streams[0].format_v.width = width;
+    streams[0].format_v.height = height;
+    streams[0].format_v.image_size = size;
 
 }
 
-void GWAVI::write_avi_header(struct gwavi_header_t *avi_header)
+int GWAVI::add_video_frame(GWAVIQueue::gwavi_frame_t *frame)
 {
-    long marker, t;
+    if (frame->stream >= streams.size() || streams[frame->stream].audio) {
+	fprintf(stderr, "no video stream %u\n", frame->stream);
+	GWAVIQueue::Release(frame);
+	return -1;
+    }
+    if (!frame->data) {
+	fputs("gwavi and/or buffer argument cannot be NULL", stderr);
+	GWAVIQueue::Release(frame);
+	return -1;
+    }
+    if (frame->len < 256)
+	fprintf(stderr, "WARNING: specified buffer len seems rather small: %d. Are you sure about this?\n",
+		(int) frame->len);
 
-    write_chars_bin("avih", 4);
-    marker = outFile.tellp();
-    write_int(0);
+    return add_frame(frame);
+}
+
+int GWAVI::add_audio_frame(GWAVIQueue::gwavi_frame_t *frame)
+{
+    if (frame->stream >= streams.size()) {
+	fputs("no audio stream\n", stderr);
+	GWAVIQueue::Release(frame);
+	return -1;
+    }
+    if (!frame->data) {
+	(void) fputs("gwavi and/or buffer argument cannot be NULL", stderr);
+	GWAVIQueue::Release(frame);
+	return -1;
+    }
+
+    return add_frame(frame);
+}
+
+int GWAVI::add_frame(GWAVIQueue::gwavi_frame_t *frame)
+{
+    uint64_t t0;
+    int ret;
+
+    t0 = clock_ns();
+    ret = interleave_frame(frame);
+    record_latency(clock_ns() - t0);
+
+    return ret;
+}
+
+/**
+ * Pass the frame through the interleaver, if any, and output the frames
+ * that are due.
+ */
+int GWAVI::interleave_frame(GWAVIQueue::gwavi_frame_t *frame)
+{
+    int ret = 0;
+
+    if (!interleave)
+	return output_frame(frame);
+
+    interleave->Push(frame);
+    while (interleave->Pop(frame, false))
+	if (output_frame(frame) == -1)
+	    ret = -1;
+    return ret;
+}
+
+void GWAVI::record_latency(uint64_t ns)
+{
+    stats.frames++;
+    latency_hist[latency_bucket(ns)]++;
+    if (ns > stats.max_ns)
+	stats.max_ns = ns;
+}
+
+/**
+ * Write the frame, or hand it to the writer thread.
+ */
+int GWAVI::output_frame(GWAVIQueue::gwavi_frame_t *frame)
+{
+    int ret;
+
+    if (queue)
+	return queue_frame(frame);
+    ret = write_frame(frame);
+    GWAVIQueue::Release(frame);
+    return ret;
+}
+
+/**
+ * Write the frame. An owned buffer goes to the sink, which releases it once
+ * it is done with it; frame->release is cleared then.
+ */
+int GWAVI::write_frame(GWAVIQueue::gwavi_frame_t *frame)
+{
+    unsigned int stream = frame->stream;
+    size_t len = frame->len;
+    gwavi_release_t release;
+    int ret = 0;
+    size_t maxi_pad; /* if your frame is raggin, give it some paddin' */
+    size_t junk;
+    uint64_t pos;
+
+    try {
+	write_pending_header();
+
+	maxi_pad = len % 4;
+	if (maxi_pad > 0)
+	    maxi_pad = 4 - maxi_pad;
+
+	check_riff(len + maxi_pad + (options.align ? options.align + 8 : 0));
+	pos = out->Tell();
+	junk = junk_size(pos);
+
+	release = frame->release;
+	frame->release = NULL;
+	write_chunk(streams[stream].chunk_id, frame->data, len, maxi_pad, junk, release, frame->opaque);
+
+	/* only once written, like write_batch() */
+	add_index_entry(stream, pos + junk, (unsigned int) (len + maxi_pad), frame->delta && !streams[stream].audio);
+	if (!streams[stream].audio)
+	    streams[stream].header.data_length++;
+	else
+	    streams[stream].header.data_length += (unsigned int) (len + maxi_pad);
+
+	maybe_checkpoint();
+
+    } catch (std::system_error& e) {
+	std::cerr << e.code().message() << "\n";
+	ret = -1;
+    }
+
+    return ret;
+}
+
+/**
+ * Hand the frame to the writer thread. A borrowed buffer is copied first.
+ */
+int GWAVI::queue_frame(GWAVIQueue::gwavi_frame_t *frame)
+{
+    GWAVIQueue::gwavi_frame_t f = *frame, old;
+    unsigned int n;
+
+    if (async_error) {
+	GWAVIQueue::Release(frame);
+	return -1;
+    }
+
+    if (!f.release) {
+	f.data = new unsigned char[f.len];
+	memcpy(f.data, frame->data, f.len);
+	f.release = release_array;
+    }
+
+    while (!queue->Push(&f)) {
+	if (options.queue_full == GWAVI_QUEUE_ERROR) {
+	    GWAVIQueue::Release(&f);
+	    return -1;
+	} else if (options.queue_full == GWAVI_QUEUE_DROP_OLDEST) {
+	    if (queue->Pop(&old)) {
+		GWAVIQueue::Release(&old);
+		stats.dropped++;
+	    }
+	} else {
+	    std::unique_lock<std::mutex> lock(async_mutex);
+	    bool pushed;
+
+	    /*
+	     * Push again once the writer can see producers_waiting, a slot
+	     * it freed before is taken now, one freed after is notified.
+	     */
+	    producers_waiting++;
+	    std::atomic_thread_fence(std::memory_order_seq_cst);
+	    while (!(pushed = queue->Push(&f)) && !async_error)
+		space_cv.wait(lock);
+	    producers_waiting--;
+	    if (pushed)
+		break;
+	}
+	if (async_error) {
+	    GWAVIQueue::Release(&f);
+	    return -1;
+	}
+    }
 
-    write_int(avi_header->time_delay);
-    write_int(avi_header->data_rate);
-    write_int(avi_header->reserved);
+    n = queue->Size();
+    if (n > stats.queue_max)
+	stats.queue_max = n;
+
+    /* pairs with the fence after writer_idle is set */
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (writer_idle) {
+	std::lock_guard<std::mutex> lock(async_mutex);
+	data_cv.notify_one();
+    }
+
+    return 0;
+}
+
+void GWAVI::writer_thread()
+{
+    GWAVIQueue::gwavi_frame_t f;
+
+    for (;;) {
+	if (queue->Pop(&f)) {
+	    if (!async_error && write_frame(&f) == -1)
+		async_error = 1;
+	    GWAVIQueue::Release(&f);
+	    /* pairs with the fence after producers_waiting is raised */
+	    std::atomic_thread_fence(std::memory_order_seq_cst);
+	    if (producers_waiting) {
+		std::lock_guard<std::mutex> lock(async_mutex);
+		space_cv.notify_all();
+	    }
+	    continue;
+	}
+	if (async_stop)
+	    break;
+
+	/*
+	 * Look at the queue again once producers can see writer_idle, a frame
+	 * pushed before is found now, one pushed after is notified.
+	 */
+	std::unique_lock<std::mutex> lock(async_mutex);
+	writer_idle = true;
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	while (queue->Size() == 0 && !async_stop)
+	    data_cv.wait(lock);
+	writer_idle = false;
+    }
+}
+
+/**
+ * Drain the queue and join the writer thread.
+ */
+void GWAVI::stop_writer()
+{
+    if (!queue)
+	return;
+
+    {
+	std::lock_guard<std::mutex> lock(async_mutex);
+	async_stop = true;
+	data_cv.notify_one();
+    }
+    if (writer.joinable())
+	writer.join();
+    delete queue;
+    queue = NULL;
+}
+
+unsigned char *GWAVI::put_avi_header(unsigned char *p, struct gwavi_header_t *avi_header)
+{
+    p = put_chars(p, "avih", 4);
+    p = put_int(p, 56);
+
+    p = put_int(p, avi_header->time_delay);
+    p = put_int(p, avi_header->data_rate);
+    p = put_int(p, avi_header->reserved);
     /* dwFlags */
-    write_int(avi_header->flags);
+    p = put_int(p, avi_header->flags);
     /* dwTotalFrames */
-    write_int(avi_header->number_of_frames);
-    write_int(avi_header->initial_frames);
-    write_int(avi_header->data_streams);
-    write_int(avi_header->buffer_size);
-    write_int(avi_header->width);
-    write_int(avi_header->height);
-    write_int(avi_header->time_scale);
-    write_int(avi_header->playback_data_rate);
-    write_int(avi_header->starting_time);
-    write_int(avi_header->data_length);
+    p = put_int(p, avi_header->number_of_frames);
+    p = put_int(p, avi_header->initial_frames);
+    p = put_int(p, avi_header->data_streams);
+    p = put_int(p, avi_header->buffer_size);
+    p = put_int(p, avi_header->width);
+    p = put_int(p, avi_header->height);
+    p = put_int(p, avi_header->time_scale);
+    p = put_int(p, avi_header->playback_data_rate);
+    p = put_int(p, avi_header->starting_time);
+    p = put_int(p, avi_header->data_length);
+    return p;
+}
 
-    t = outFile.tellp();
-    outFile.seekp(marker, ios_base::beg);
-    write_int((unsigned int) (t - marker - 4));
-    outFile.seekp(t, ios_base::beg);
+unsigned char *GWAVI::put_stream_header(unsigned char *p, struct gwavi_stream_header_t *stream_header)
+{
+    p = put_chars(p, "strh", 4);
+    p = put_int(p, 56);
+
+    p = put_chars(p, stream_header->data_type, 4);
+    p = put_chars(p, stream_header->codec, 4);
+    p = put_int(p, stream_header->flags);
+    p = put_int(p, stream_header->priority);
+    p = put_int(p, stream_header->initial_frames);
+    p = put_int(p, stream_header->time_scale);
+    p = put_int(p, stream_header->data_rate);
+    p = put_int(p, stream_header->start_time);
+    p = put_int(p, stream_header->data_length);
+    p = put_int(p, stream_header->buffer_size);
+    p = put_int(p, stream_header->video_quality);
+    p = put_int(p, stream_header->sample_size);
+    p = put_int(p, 0);
+    p = put_int(p, 0);
+    return p;
 }
 
-void GWAVI::write_stream_header(struct gwavi_stream_header_t *stream_header)
+unsigned char *GWAVI::put_stream_format_v(unsigned char *p, struct gwavi_stream_format_v_t *stream_format_v)
 {
-    long marker, t;
+    unsigned int i;
 
-    write_chars_bin("strh", 4);
-    marker = outFile.tellp();
-    write_int(0);
+    p = put_chars(p, "strf", 4);
+    p = put_int(p, 40 + stream_format_v->colors_used * 4);
+    p = put_int(p, stream_format_v->header_size);
+    p = put_int(p, stream_format_v->width);
+    p = put_int(p, stream_format_v->height);
+    p = put_short(p, stream_format_v->num_planes);
+    p = put_short(p, stream_format_v->bits_per_pixel);
+    p = put_int(p, stream_format_v->compression_type);
+    p = put_int(p, stream_format_v->image_size);
+    p = put_int(p, stream_format_v->x_pels_per_meter);
+    p = put_int(p, stream_format_v->y_pels_per_meter);
+    p = put_int(p, stream_format_v->colors_used);
+    p = put_int(p, stream_format_v->colors_important);
+
+    for (i = 0; i < stream_format_v->colors_used; i++)
+	p = put_int(p, stream_format_v->palette[i] & 0xffffff);
+    return p;
+}
 
-    write_chars_bin(stream_header->data_type, 4);
-    write_chars_bin(stream_header->codec, 4);
-    write_int(stream_header->flags);
-    write_int(stream_header->priority);
-    write_int(stream_header->initial_frames);
-    write_int(stream_header->time_scale);
-    write_int(stream_header->data_rate);
-    write_int(stream_header->start_time);
-    write_int(stream_header->data_length);
-    write_int(stream_header->buffer_size);
-    write_int(stream_header->video_quality);
-    write_int(stream_header->sample_size);
-    write_int(0);
-    write_int(0);
+unsigned char *GWAVI::put_stream_format_a(unsigned char *p, struct gwavi_stream_format_a_t *stream_format_a)
+{
+    p = put_chars(p, "strf", 4);
+    p = put_int(p, 18);
+    p = put_short(p, stream_format_a->format_type);
+    p = put_short(p, stream_format_a->channels);
+    p = put_int(p, stream_format_a->sample_rate);
+    p = put_int(p, stream_format_a->bytes_per_second);
+    p = put_short(p, stream_format_a->block_align);
+    p = put_short(p, stream_format_a->bits_per_sample);
+    p = put_short(p, stream_format_a->size);
+    return p;
+}
 
-    t = outFile.tellp();
-    outFile.seekp(marker, ios_base::beg);
-    write_int((unsigned int) (t - marker - 4));
-    outFile.seekp(t, ios_base::beg);
+/**
+ * Size of the 'strl' LIST of a stream, not counting the LIST header.
+ */
+size_t GWAVI::strl_size(unsigned int stream)
+{
+    size_t n = 4 + 8 + 56 + 8;
+
+    if (!streams[stream].audio)
+	n += 40 + streams[stream].format_v.colors_used * 4;
+    else
+	n += 18;
+    if (options.odml)
+	n += 8 + 24 + options.super_index_entries * 16;
+    return n;
 }
 
-void GWAVI::write_stream_format_v(struct gwavi_stream_format_v_t *stream_format_v)
+/**
+ * Serialize the whole 'hdrl' LIST into hdrl. All sizes are known up front,
+ * so the result goes to the file with a single write.
+ */
+void GWAVI::build_hdrl()
 {
-    long marker, t;
+    unsigned char *p;
+    size_t size;
     unsigned int i;
 
-    write_chars_bin("strf", 4);
-    marker = outFile.tellp();
-    write_int(0);
-    write_int(stream_format_v->header_size);
-    write_int(stream_format_v->width);
-    write_int(stream_format_v->height);
-    write_short(stream_format_v->num_planes);
-    write_short(stream_format_v->bits_per_pixel);
-    write_int(stream_format_v->compression_type);
-    write_int(stream_format_v->image_size);
-    write_int(stream_format_v->x_pels_per_meter);
-    write_int(stream_format_v->y_pels_per_meter);
-    write_int(stream_format_v->colors_used);
-    write_int(stream_format_v->colors_important);
-
-    if (stream_format_v->colors_used != 0) {
-	for (i = 0; i < stream_format_v->colors_used; i++) {
-	    unsigned char c = stream_format_v->palette[i] & 255;
-	    outFile.write((char *) &c, 1);
-	    c = (stream_format_v->palette[i] >> 8) & 255;
-	    outFile.write((char *) &c, 1);
-	    c = (stream_format_v->palette[i] >> 16) & 255;
-	    outFile.write((char *) &c, 1);
-	    outFile.write("\0", 1);
-	}
+    avi_header.data_streams = streams.size();
+    size = 4 + 8 + 56;
+    for (i = 0; i < streams.size(); i++)
+	size += 8 + strl_size(i);
+    if (options.odml)
+	size += 8 + 4 + 8 + 248;
+
+    hdrl.resize(8 + size);
+    p = hdrl.data();
+    p = put_chars(p, "LIST", 4);
+    p = put_int(p, size);
+    p = put_chars(p, "hdrl", 4);
+    p = put_avi_header(p, &avi_header);
+
+    for (i = 0; i < streams.size(); i++) {
+	p = put_chars(p, "LIST", 4);
+	p = put_int(p, strl_size(i));
+	p = put_chars(p, "strl", 4);
+	p = put_stream_header(p, &streams[i].header);
+	if (streams[i].audio)
+	    p = put_stream_format_a(p, &streams[i].format_a);
+	else
+	    p = put_stream_format_v(p, &streams[i].format_v);
+	if (options.odml)
+	    p = put_super_index(p, &streams[i]);
     }
 
-    t = outFile.tellp();
-    outFile.seekp(marker, ios_base::beg);
-    write_int((unsigned int) (t - marker - 4));
-    outFile.seekp(t, ios_base::beg);
+    if (options.odml)
+	p = put_odml_header(p);
 }
 
-void GWAVI::write_stream_format_a(struct gwavi_stream_format_a_t *stream_format_a)
+/**
+ * Write everything in front of the first chunk: the RIFF header, 'hdrl' and
+ * the 'movi' LIST header.
+ */
+void GWAVI::write_file_header()
 {
-    long marker, t;
+    unsigned char riff[12];
+    unsigned char movi[12];
+    struct iovec iov[3];
 
-    write_chars_bin("strf", 4);
-    marker = outFile.tellp();
-    write_int(0);
-    write_short(stream_format_a->format_type);
-    write_short(stream_format_a->channels);
-    write_int(stream_format_a->sample_rate);
-    write_int(stream_format_a->bytes_per_second);
-    write_short(stream_format_a->block_align);
-    write_short(stream_format_a->bits_per_sample);
-    write_short(stream_format_a->size);
+    build_hdrl();
+
+    put_chars(put_int(put_chars(riff, "RIFF", 4), 0), "AVI ", 4);
+    put_chars(put_int(put_chars(movi, "LIST", 4), 0), "movi", 4);
 
-    t = outFile.tellp();
-    outFile.seekp(marker, ios_base::beg);
-    write_int((unsigned int) (t - marker - 4));
-    outFile.seekp(t, ios_base::beg);
+    iov[0].iov_base = riff;
+    iov[0].iov_len = sizeof(riff);
+    iov[1].iov_base = hdrl.data();
+    iov[1].iov_len = hdrl.size();
+    iov[2].iov_base = movi;
+    iov[2].iov_len = sizeof(movi);
+    out->WriteV(iov, 3);
+
+    marker = sizeof(riff) + hdrl.size() + 4;
 }
 
-void GWAVI::write_avi_header_chunk()
+void GWAVI::write_pending_header()
 {
-    long marker, t;
-    long sub_marker;
+    if (!header_pending)
+	return;
+    header_pending = false;
+    write_file_header();
+}
 
-    write_chars_bin("LIST", 4);
-    marker = outFile.tellp();
-    write_int(0);
-    write_chars_bin("hdrl", 4);
-    write_avi_header(&avi_header);
+/**
+ * End a streamed file with what Finalize() would have patched: a 'JUNK'
+ * chunk of "GWST", the 'movi' size, the 'hdrl' size, the 'hdrl' LIST, the
+ * size of the chunk data and "GWST" again, so that it can be found from
+ * the end of the file.
+ *
+ * @param movi_end Where the 'movi' LIST ends, 'idx1' starts.
+ */
+void GWAVI::write_trailer(uint64_t movi_end)
+{
+    std::vector<unsigned char> data;
+    unsigned char *p;
+
+    build_hdrl();
+    data.resize(4 + 4 + 4 + hdrl.size() + 4 + 4);
+    p = put_chars(data.data(), "GWST", 4);
+    p = put_int(p, (unsigned int) (movi_end - marker - 4));
+    p = put_int(p, hdrl.size());
+    memcpy(p, hdrl.data(), hdrl.size());
+    p += hdrl.size();
+    p = put_int(p, data.size());
+    put_chars(p, "GWST", 4);
+    write_chunk("JUNK", data.data(), data.size(), 0, 0);
+}
 
-    write_chars_bin("LIST", 4);
-    sub_marker = outFile.tellp();
-    write_int(0);
-    write_chars_bin("strl", 4);
-    write_stream_header(&stream_header_v);
-    write_stream_format_v(&stream_format_v);
+/**
+ * Write the legacy 'idx1' index of the first count chunks, encoded in blocks
+ * of INDEX_BLOCK bytes.
+ */
+void GWAVI::write_index(size_t count)
+{
+    std::vector<unsigned char> block(INDEX_BLOCK);
+    unsigned char *p = block.data();
+    unsigned char *end = p + block.size();
+    /* idx1 offsets are relative to the 'movi' fourcc */
+    uint64_t movi = this->marker + 4;
+    gwavi_index_entry_t e;
+    size_t i;
+
+    if (count > index.Count())
+	count = index.Count();
+
+    p = put_chars(p, "idx1", 4);
+    p = put_int(p, (unsigned int) (count * 16));
+
+    index.Seek(0);
+    for (i = 0; i < count && index.Next(&e); i++) {
+	if (end - p < 16) {
+	    out->Write(block.data(), p - block.data());
+	    p = block.data();
+	}
+	p = put_chars(p, streams[e.stream].chunk_id, 4);
+	p = put_int(p, e.delta ? 0 : AVIIF_KEYFRAME);
+	p = put_int(p, (unsigned int) (e.offset - movi));
+	p = put_int(p, e.size);
+    }
+    out->Write(block.data(), p - block.data());
+}
 
-    t = outFile.tellp();
+/**
+ * Serialize the 'indx' super index of a stream. The chunk always takes room
+ * for options.super_index_entries entries, so the header can be rewritten in
+ * place.
+ */
+unsigned char *GWAVI::put_super_index(unsigned char *p, struct gwavi_stream_t *stream)
+{
+    struct gwavi_super_index_t *super_index = &stream->super_index;
+    unsigned int i;
 
-    outFile.seekp(sub_marker, ios_base::beg);
-    write_int((unsigned int) (t - sub_marker - 4));
-    outFile.seekp(t, ios_base::beg);
+    p = put_chars(p, "indx", 4);
+    p = put_int(p, 24 + options.super_index_entries * 16);
+    p = put_short(p, 4); /* wLongsPerEntry */
+    p = put_short(p, AVI_INDEX_OF_INDEXES << 8); /* bIndexSubType, bIndexType */
+    p = put_int(p, super_index->count); /* nEntriesInUse */
+    p = put_chars(p, stream->chunk_id, 4); /* dwChunkId */
+    p = put_int(p, 0); /* dwReserved[3] */
+    p = put_int(p, 0);
+    p = put_int(p, 0);
+
+    for (i = 0; i < options.super_index_entries; i++) {
+	p = put_int64(p, super_index->entries[i].offset);
+	p = put_int(p, super_index->entries[i].size);
+	p = put_int(p, super_index->entries[i].duration);
+    }
+    return p;
+}
 
-    if (avi_header.data_streams == 2) {
-	write_chars_bin("LIST", 4);
-	sub_marker = outFile.tellp();
-	write_int(0);
-	write_chars_bin("strl", 4);
-	write_stream_header(&stream_header_a);
-	write_stream_format_a(&stream_format_a);
+unsigned char *GWAVI::put_odml_header(unsigned char *p)
+{
+    p = put_chars(p, "LIST", 4);
+    p = put_int(p, 4 + 8 + 248);
+    p = put_chars(p, "odml", 4);
+    p = put_chars(p, "dmlh", 4);
+    p = put_int(p, 248);
+    /* dwTotalFrames */
+    p = put_int(p, streams[0].header.data_length);
+    memset(p, 0, 244);
+    return p + 244;
+}
 
-	t = outFile.tellp();
-	outFile.seekp(sub_marker, ios_base::beg);
-	write_int((unsigned int) (t - sub_marker - 4));
-	outFile.seekp(t, ios_base::beg);
+/**
+ * Write the 'ix##' standard index of a stream for the chunks of the current
+ * RIFF segment and register it in the stream super index.
+ */
+void GWAVI::write_std_index(unsigned int stream)
+{
+    struct gwavi_stream_t *s = &streams[stream];
+    struct gwavi_super_index_t *si = &s->super_index;
+    unsigned int n = s->segment_entries;
+    std::vector<unsigned char> block;
+    unsigned char *p, *end;
+    unsigned int duration = 0;
+    gwavi_index_entry_t e;
+    uint64_t pos;
+    size_t t, count;
+
+    if (n == 0)
+	return;
+    if (si->count >= options.super_index_entries)
+	throw std::system_error(EFBIG, std::generic_category(), "OpenDML super index is full");
+
+    block.resize(INDEX_BLOCK);
+    p = block.data();
+    end = p + block.size();
+
+    pos = out->Tell();
+    p = put_chars(p, s->index_id, 4);
+    p = put_int(p, 24 + n * 8);
+    p = put_short(p, 2); /* wLongsPerEntry */
+    p = put_short(p, AVI_INDEX_OF_CHUNKS << 8); /* bIndexSubType, bIndexType */
+    p = put_int(p, n); /* nEntriesInUse */
+    p = put_chars(p, s->chunk_id, 4); /* dwChunkId */
+    p = put_int64(p, riff_start); /* qwBaseOffset */
+    p = put_int(p, 0); /* dwReserved3 */
+
+    count = index.Count();
+    index.Seek(segment_start);
+    for (t = segment_start; t < count && index.Next(&e); t++) {
+	if (e.stream != stream)
+	    continue;
+	if (end - p < 8) {
+	    out->Write(block.data(), p - block.data());
+	    p = block.data();
+	}
+	/* dwOffset points to the chunk data, dwSize bit 31 is set for delta frames */
+	p = put_int(p, (unsigned int) (e.offset + 8 - riff_start));
+	p = put_int(p, e.size | (e.delta ? 0x80000000u : 0));
+	if (!s->audio)
+	    duration++;
+	else if (s->format_a.block_align)
+	    duration += e.size / s->format_a.block_align;
     }
+    out->Write(block.data(), p - block.data());
+
+    si->entries[si->count].offset = pos;
+    si->entries[si->count].size = 8 + 24 + n * 8;
+    si->entries[si->count].duration = duration;
+    si->count++;
+}
 
-    t = outFile.tellp();
-    outFile.seekp(marker, ios_base::beg);
-    write_int((unsigned int) (t - marker - 4));
-    outFile.seekp(t, ios_base::beg);
+void GWAVI::add_index_entry(unsigned int stream, uint64_t offset, unsigned int size, bool delta)
+{
+    gwavi_index_entry_t e;
+
+    e.offset = offset;
+    e.size = size;
+    e.stream = stream;
+    e.delta = delta;
+    index.Add(&e);
+    streams[stream].segment_entries++;
+    if (delta && options.checkpoint_interval)
+	checkpoint_delta.push_back(offset);
 }
 
-void GWAVI::write_index(int count, unsigned int *offsets)
+/**
+ * Close the current RIFF chunk: write the standard indexes of the segment (in
+ * OpenDML mode), the legacy idx1 index (first RIFF only) and patch the
+ * 'movi' and RIFF sizes.
+ */
+void GWAVI::close_riff()
 {
-    long marker, t;
-    unsigned int offset = 4;
+    uint64_t t;
+    unsigned int i;
 
-    if (!offsets)
-	throw 1;
+    if (options.odml)
+	for (i = 0; i < streams.size(); i++)
+	    write_std_index(i);
 
-    write_chars_bin("idx1", 4);
-    marker = outFile.tellp();
-    write_int(0);
+    t = out->Tell();
+    patch_int(marker, (unsigned int) (t - marker - 4));
 
-    for (t = 0; t < count; t++) {
-	if ((offsets[t] & 0x80000000) == 0)
-	    write_chars("00dc");
-	else {
-	    write_chars("01wb");
-	    offsets[t] &= 0x7fffffff;
-	}
-	write_int(0x10);
-	write_int(offset);
-	write_int(offsets[t]);
+    if (riff_count == 0) {
+	write_index(index.Count());
+	first_riff_frames = streams[0].header.data_length;
+    }
+
+    t = out->Tell();
+    patch_int(riff_start + 4, (unsigned int) (t - riff_start - 8));
+}
+
+/**
+ * Write a checkpoint when options.checkpoint_interval has passed since the
+ * last one.
+ */
+void GWAVI::maybe_checkpoint()
+{
+    if (options.checkpoint_interval
+	    && clock_ns() - checkpoint_time >= (uint64_t) options.checkpoint_interval * 1000000)
+	checkpoint();
+}
 
-	offset = offset + offsets[t] + 8;
+/**
+ * Make the file playable up to here should the process die: the RIFF,
+ * 'movi' and header sizes are patched to cover the chunks written so far
+ * and the file is synced. A chunk scan recovers the index, except for the
+ * key frame flags. Those of the delta frames since the last checkpoint go
+ * into a 'JUNK' chunk, "GWCP", a count and the 64 bit chunk positions.
+ */
+void GWAVI::checkpoint()
+{
+    std::vector<unsigned char> junk;
+    unsigned char *p;
+    uint64_t t;
+
+    if (!checkpoint_delta.empty())
+	check_riff(8 + checkpoint_delta.size() * 8);
+    if (!checkpoint_delta.empty()) {
+	junk.resize(8 + checkpoint_delta.size() * 8);
+	p = put_chars(junk.data(), "GWCP", 4);
+	p = put_int(p, checkpoint_delta.size());
+	for (uint64_t offset : checkpoint_delta)
+	    p = put_int64(p, offset);
+	write_chunk("JUNK", junk.data(), junk.size(), 0, 0);
+	checkpoint_delta.clear();
     }
 
-    t = outFile.tellp();
-    outFile.seekp(marker, ios_base::beg);
-    write_int((unsigned int) (t - marker - 4));
-    outFile.seekp(t, ios_base::beg);
+    t = out->Tell();
+    patch_int(marker, (unsigned int) (t - marker - 4));
+    patch_int(riff_start + 4, (unsigned int) (t - riff_start - 8));
+
+    avi_header.number_of_frames = riff_count ? first_riff_frames : streams[0].header.data_length;
+    build_hdrl();
+    out->PWrite(hdrl.data(), hdrl.size(), 12);
+
+    out->Sync();
+    checkpoint_time = clock_ns();
+}
+
+/**
+ * A chunk of len bytes at pos, and the indexes of the segment with it, fit
+ * in the current RIFF chunk. Always so without OpenDML.
+ *
+ * @param pending Chunks before pos that are not in the index yet.
+ */
+bool GWAVI::riff_fits(uint64_t pos, size_t len, size_t pending)
+{
+    size_t entries = index.Count() + pending - segment_start;
+    uint64_t need;
+
+    if (!options.odml || entries == 0)
+	return true;
+    need = 8 + len + (uint64_t) (entries + 1) * (16 + 8) + streams.size() * 32;
+    return pos + need - riff_start <= riff_limit;
+}
+
+/**
+ * In OpenDML mode start a new 'RIFF AVIX' chunk when a chunk of len bytes
+ * (plus the indexes of the current segment) does not fit in the current one.
+ */
+void GWAVI::check_riff(size_t len)
+{
+    unsigned int i;
+
+    if (riff_fits(out->Tell(), len))
+	return;
+
+    /* one entry for this segment and one for the next */
+    for (i = 0; i < streams.size(); i++)
+	if (streams[i].super_index.count + 2 > options.super_index_entries)
+	    throw std::system_error(EFBIG, std::generic_category(), "OpenDML super index is full");
+
+    close_riff();
+
+    riff_start = out->Tell();
+    riff_count++;
+    segment_start = index.Count();
+    for (i = 0; i < streams.size(); i++)
+	streams[i].segment_entries = 0;
+    /* the 'ix##' indexes keep the flags now */
+    checkpoint_delta.clear();
 
+    write_chars_bin("RIFF", 4);
+    write_int(0);
+    write_chars_bin("AVIX", 4);
+    write_chars_bin("LIST", 4);
+    marker = out->Tell();
+    write_int(0);
+    write_chars_bin("movi", 4);
 }
 
 /**
@@ -623,7 +2001,7 @@ int GWAVI::check_fourcc(const char *fourcc)
 	    "GEOX GJPG GLZW GPEG GWLT"
 	    "H260 H261 H262 H263 H264 H265 H266 H267 H268 H269"
 	    "HDYC HFYU HMCR HMRR"
-	    "I263 ICLB IGOR IJPG ILVC ILVR IPDV IR21 IRAW ISME"
+	    "I263 I420 ICLB IGOR IJPG ILVC ILVR IPDV IR21 IRAW ISME IYUV"
 	    "IV30 IV31 IV32 IV33 IV34 IV35 IV36 IV37 IV38 IV39 IV40 IV41"
 	    "IV41 IV43 IV44 IV45 IV46 IV47 IV48 IV49 IV50"
 	    "JBYR JPEG JPGL"
@@ -636,7 +2014,7 @@ int GWAVI::check_fourcc(const char *fourcc)
 	    "MTX1 MTX2 MTX3 MTX4 MTX5 MTX6 MTX7 MTX8 MTX9"
 	    "MVI1 MVI2 MWV1"
 	    "NAVI NDSC NDSM NDSP NDSS NDXC NDXH NDXP NDXS NHVU NTN1 NTN2"
-	    "NVDS NVHS"
+	    "NV12 NVDS NVHS"
 	    "NVS0 NVS1 NVS2 NVS3 NVS4 NVS5"
 	    "NVT0 NVT1 NVT2 NVT3 NVT4 NVT5"
 	    "PDVC PGVV PHMO PIM1 PIM2 PIMJ PIXL PJPG PVEZ PVMM PVW2"
@@ -663,6 +2041,8 @@ int GWAVI::check_fourcc(const char *fourcc)
 	(void) fputs("fourcc cannot be NULL", stderr);
 	return -1;
     }
+    if (!strcmp(fourcc, "DIB "))
+	return 0;
     if (strchr(fourcc, ' ') || !strstr(valid_fourcc, fourcc))
 	ret = 1;
 
@@ -678,29 +2058,84 @@ void GWAVI::write_int(unsigned int n)
     buffer[2] = n >> 16;
     buffer[3] = n >> 24;
 
-    outFile.write((char *) buffer, 4);
+    out->Write(buffer, 4);
 }
 
-void GWAVI::write_short(unsigned int n)
+/**
+ * Size of the 'JUNK' chunk needed at offset to align the data of the next
+ * chunk to options.align, 0 if none.
+ */
+size_t GWAVI::junk_size(uint64_t offset)
 {
-    unsigned char buffer[2];
+    size_t r;
+
+    if (!options.align)
+	return 0;
+    r = (options.align - (offset + 8) % options.align) % options.align;
+    /* a JUNK chunk takes at least its 8 byte header */
+    if (r > 0 && r < 8)
+	r += options.align;
+    return r;
+}
 
-    buffer[0] = n;
-    buffer[1] = n >> 8;
+/**
+ * Write a chunk, behind a 'JUNK' chunk of junk bytes if not 0. With release
+ * the sink takes over buffer, see GWAVISink::WriteVOwned().
+ */
+void GWAVI::write_chunk(const char *id, const unsigned char *buffer, size_t len, size_t pad, size_t junk,
+	gwavi_release_t release, void *opaque)
+{
+    unsigned char junk_hdr[8];
+    unsigned char hdr[8];
+    struct iovec iov[5];
+    int n = 0;
+
+    if (junk) {
+	memcpy(junk_hdr, "JUNK", 4);
+	junk_hdr[4] = junk - 8;
+	junk_hdr[5] = (junk - 8) >> 8;
+	junk_hdr[6] = (junk - 8) >> 16;
+	junk_hdr[7] = (junk - 8) >> 24;
+	iov[n].iov_base = junk_hdr;
+	iov[n++].iov_len = 8;
+	iov[n].iov_base = (void *) zero_pad;
+	iov[n++].iov_len = junk - 8;
+    }
 
-    outFile.write((char *) buffer, 2);
+    memcpy(hdr, id, 4);
+    hdr[4] = len + pad;
+    hdr[5] = (len + pad) >> 8;
+    hdr[6] = (len + pad) >> 16;
+    hdr[7] = (len + pad) >> 24;
+
+    iov[n].iov_base = hdr;
+    iov[n++].iov_len = 8;
+    iov[n].iov_base = (void *) buffer;
+    iov[n++].iov_len = len;
+    if (pad) {
+	iov[n].iov_base = (void *) zero_pad;
+	iov[n++].iov_len = pad;
+    }
+    if (release)
+	out->WriteVOwned(iov, n, (unsigned char *) buffer, len, release, opaque);
+    else
+	out->WriteV(iov, n);
 }
 
-void GWAVI::write_chars(const char *s)
+void GWAVI::patch_int(uint64_t offset, unsigned int n)
 {
-    int count = strlen(s);
-    if (count > 255)
-	count = 255;
-    outFile.write(s, count);
+    unsigned char buffer[4];
+
+    buffer[0] = n;
+    buffer[1] = n >> 8;
+    buffer[2] = n >> 16;
+    buffer[3] = n >> 24;
+
+    out->PWrite(buffer, 4, offset);
 }
 
 void GWAVI::write_chars_bin(const char *s, int count)
 {
-    outFile.write(s, count);
+    out->Write(s, count);
 }
 
@@ -9,6 +9,19 @@
 #define GWAVI_H_
 
 #include <fstream>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "GWAVIConvert.h"
+#include "GWAVIIndex.h"
+#include "GWAVIInterleave.h"
+#include "GWAVIQueue.h"
+#include "GWAVISink.h"
 
 class GWAVI {
     struct gwavi_header_t {
@@ -70,6 +83,26 @@ class GWAVI {
 	unsigned int bits_per_sample;
 	unsigned short size;
     };
+    typedef GWAVIIndex::gwavi_index_entry_t gwavi_index_entry_t;
+    struct gwavi_super_index_entry_t {
+	uint64_t offset; /* qwOffset, file position of the ix## chunk */
+	unsigned int size; /* dwSize, size of the ix## chunk */
+	unsigned int duration; /* dwDuration */
+    };
+    struct gwavi_super_index_t {
+	struct gwavi_super_index_entry_t *entries;
+	unsigned int count; /* nEntriesInUse */
+    };
+    struct gwavi_stream_t {
+	bool audio; /* "auds", otherwise "vids" */
+	struct gwavi_stream_header_t header;
+	struct gwavi_stream_format_v_t format_v;
+	struct gwavi_stream_format_a_t format_a;
+	char chunk_id[5]; /* ##dc, ##db or ##wb */
+	char index_id[5]; /* ix## */
+	unsigned int segment_entries; /* chunks in the current RIFF */
+	struct gwavi_super_index_t super_index;
+    };
 public:
     typedef struct {
 	unsigned int channels;
@@ -77,42 +110,271 @@ public:
 	unsigned int samples_per_second;
     } gwavi_audio_t;
 
+    /**
+     * Gives a frame buffer back to its owner, see the Add*Frame() overloads
+     * taking ownership of the buffer. Called once the bytes are handed to
+     * the kernel, not once they are durable on disk.
+     */
+    typedef GWAVIQueue::gwavi_release_t gwavi_release_t;
+
+    enum {
+	GWAVI_OUTPUT_OFSTREAM = 0, /* std::ofstream */
+	GWAVI_OUTPUT_FD, /* POSIX fd, one writev() per chunk */
+	GWAVI_OUTPUT_URING, /* io_uring, falls back to GWAVI_OUTPUT_FD */
+	GWAVI_OUTPUT_DIRECT, /* O_DIRECT, bypasses the page cache */
+	GWAVI_OUTPUT_MMAP, /* mmap() of the file, frames can be filled in place */
+    };
+
+    enum {
+	GWAVI_PIX_RGB24 = GWAVIConvert::PIX_RGB24, /* raw frames for AddRawVideoFrame() */
+	GWAVI_PIX_BGR24 = GWAVIConvert::PIX_BGR24,
+	GWAVI_PIX_RGBA = GWAVIConvert::PIX_RGBA,
+	GWAVI_PIX_BGRA = GWAVIConvert::PIX_BGRA,
+	GWAVI_PIX_PAL8 = GWAVIConvert::PIX_PAL8, /* palette indexes, for MRLE */
+    };
+
+    enum {
+	GWAVI_QUEUE_BLOCK = 0, /* wait for the writer thread */
+	GWAVI_QUEUE_DROP_OLDEST, /* drop the oldest queued frame */
+	GWAVI_QUEUE_ERROR, /* return -1 */
+    };
+
+    typedef struct {
+	/**
+	 * Write an OpenDML (AVI 2.0) file: 'indx' super indexes, per segment
+	 * 'ix##' standard indexes and 'RIFF AVIX' extension chunks. Needed for
+	 * files larger than 1 GB.
+	 */
+	int odml;
+	unsigned int riff_size; /* max size of a RIFF segment in MB, 0 - 1024 */
+	unsigned int super_index_entries; /* 'indx' entries reserved per stream, 0 - 256 */
+	unsigned int index_ram; /* MB of chunk index kept in RAM, the rest goes to a temp file, 0 - 16 */
+	int output; /* GWAVI_OUTPUT_* */
+	/**
+	 * Frames queued for a dedicated writer thread, 0 - frames are
+	 * written by the caller of Add*Frame().
+	 */
+	unsigned int async_queue;
+	int queue_full; /* GWAVI_QUEUE_*, what Add*Frame() does when the queue is full */
+	/**
+	 * Align the data of every chunk to this many bytes (a power of two)
+	 * with 'JUNK' chunks, 0 - no alignment, 512 with GWAVI_OUTPUT_DIRECT.
+	 */
+	unsigned int align;
+	/**
+	 * Reserve disk space with fallocate() this many MB ahead of the write
+	 * position, the excess is released by Finalize(). Keeps the file in
+	 * few large extents when several files are written at once. 0 - off,
+	 * ignored by GWAVI_OUTPUT_OFSTREAM.
+	 */
+	unsigned int prealloc;
+	/**
+	 * Expected recording length in seconds, sizes the first allocation
+	 * as expected_duration * expected_rate bytes. 0 - unknown.
+	 */
+	unsigned int expected_duration;
+	/* bytes per second, 0 - uncompressed frame size * fps + audio rate */
+	unsigned long long expected_rate;
+	unsigned int convert_threads; /* threads converting an AddRawVideoFrame() frame, 0 - 1 */
+	unsigned int keyframe_interval; /* frames from one MRLE full frame to the next, 0 - 250 */
+	/**
+	 * Hold frames back and write all streams in time order, audio cut
+	 * into chunks of interleave_period. Marks the file
+	 * AVIF_ISINTERLEAVED.
+	 */
+	int interleave;
+	unsigned int interleave_period; /* us, 0 - one frame of video stream 0 */
+	unsigned int interleave_buffer; /* MB of frames held back at most, 0 - 64 */
+	/**
+	 * Every checkpoint_interval ms patch the RIFF, 'movi' and header
+	 * sizes to cover the chunks written so far and fdatasync() the
+	 * file, so that a crash leaves a file that plays up to the last
+	 * checkpoint. GWAVIRecover completes such a file. 0 - off.
+	 */
+	unsigned int checkpoint_interval;
+	/**
+	 * The output cannot seek, e.g. a pipe or a socket. The header goes
+	 * out in front of the first chunk with the sizes and lengths left
+	 * 0 (unknown), Finalize() appends 'idx1' and patches nothing. AVI
+	 * 1.0 only, odml and checkpoint_interval are not used, the output
+	 * is always GWAVI_OUTPUT_FD.
+	 */
+	int streaming;
+	/**
+	 * With streaming, end the file with a 'JUNK' chunk holding the final
+	 * header and 'movi' size. GWAVIRecover patches them in once the
+	 * stream is stored in a file.
+	 */
+	int streaming_trailer;
+    } gwavi_options_t;
+
+    typedef struct {
+	unsigned long long frames; /* Add*Frame(), AddFrames() and CopyChunks() calls */
+	unsigned long long dropped; /* frames dropped from a full queue */
+	unsigned long long p50_ns; /* latency of those calls */
+	unsigned long long p99_ns;
+	unsigned long long max_ns;
+	unsigned int queue_max; /* highest number of queued frames */
+	unsigned long long cloned; /* bytes of CopyChunks() shared with the source file */
+    } gwavi_stats_t;
+
+    /**
+     * A chunk of another AVI file for CopyChunks().
+     */
+    typedef struct {
+	unsigned int stream;
+	uint64_t offset; /* chunk header in the source file */
+	unsigned int size; /* chunk data, padded to an even size */
+	bool keyframe;
+    } gwavi_chunk_t;
+
+    /**
+     * A frame for AddFrames(), the buffer stays the caller's. Left zero,
+     * delta makes it a key frame, as AddVideoFrame(buffer, len) adds.
+     */
+    typedef struct {
+	unsigned int stream;
+	const unsigned char *buffer;
+	size_t len;
+	bool delta; /* not a key frame, video only */
+    } gwavi_batch_frame_t;
+
     GWAVI(const char *filename, unsigned width, unsigned height, unsigned bpp, const char *fourcc, unsigned fps,
-	    gwavi_audio_t *audio);
+	    gwavi_audio_t *audio, gwavi_options_t *options = NULL);
+    GWAVI(GWAVISink *sink, unsigned width, unsigned height, unsigned bpp, const char *fourcc, unsigned fps,
+	    gwavi_audio_t *audio, gwavi_options_t *options = NULL);
     virtual ~GWAVI();
 
     int AddVideoFrame(unsigned char *buffer, size_t len);
+    int AddVideoFrame(unsigned char *buffer, size_t len, gwavi_release_t release, void *opaque);
+    int AddVideoFrame(unsigned char *buffer, size_t len, bool keyframe);
+    int AddVideoFrame(unsigned char *buffer, size_t len, bool keyframe, gwavi_release_t release, void *opaque);
+    int AddVideoFrame(std::vector<uint8_t> &&buffer);
+    int AddVideoFrame(std::unique_ptr<uint8_t[]> buffer, size_t len);
+    unsigned char *ReserveVideoFrame(size_t len);
+    int CommitVideoFrame(size_t len);
+    int CommitVideoFrame(size_t len, bool keyframe);
+    int AddRawVideoFrame(const unsigned char *pixels, size_t stride, int format);
+    int SetPalette(const unsigned int *colors, unsigned int count);
     int AddAudioFrame(unsigned char *buffer, size_t len);
+    int AddAudioFrame(unsigned char *buffer, size_t len, gwavi_release_t release, void *opaque);
+    int AddAudioFrame(std::vector<uint8_t> &&buffer);
+    int AddAudioFrame(std::unique_ptr<uint8_t[]> buffer, size_t len);
+    int AddVideoStream(unsigned width, unsigned height, unsigned bpp, const char *fourcc, unsigned fps);
+    int AddAudioStream(gwavi_audio_t *audio);
+    int AddFrame(unsigned int stream, unsigned char *buffer, size_t len);
+    int AddFrame(unsigned int stream, unsigned char *buffer, size_t len, gwavi_release_t release, void *opaque);
+    int AddFrame(unsigned int stream, unsigned char *buffer, size_t len, bool keyframe, gwavi_release_t release,
+	    void *opaque);
+    int AddFrames(const gwavi_batch_frame_t *frames, size_t count);
+    int CopyChunks(int fd, const gwavi_chunk_t *chunks, size_t count);
+    unsigned int GetStreamCount();
     int Finalize();
     void SetFramerate(unsigned int fps);
     void SetFourccCodec(const char *fourcc);
     void SetVideoFrameSize(unsigned int width, unsigned int height);
+    void GetStats(gwavi_stats_t *stats);
 
 private:
-    std::ofstream outFile;
+    GWAVISink *out;
+    bool own_out; /* opened by the constructor */
     struct gwavi_header_t avi_header;
-    struct gwavi_stream_header_t stream_header_v;
-    struct gwavi_stream_format_v_t stream_format_v;
-    struct gwavi_stream_header_t stream_header_a;
-    struct gwavi_stream_format_a_t stream_format_a;
+    std::vector<gwavi_stream_t> streams; /* 0 - the video stream of the constructor */
+    gwavi_options_t options;
     long marker;
-    int offsets_ptr;
-    int offsets_len;
-    long offsets_start;
-    unsigned int *offsets;
-    int offset_count;
-
-    void write_avi_header(struct gwavi_header_t *avi_header);
-    void write_stream_header(struct gwavi_stream_header_t *stream_header);
-    void write_stream_format_v(struct gwavi_stream_format_v_t *stream_format_v);
-    void write_stream_format_a(struct gwavi_stream_format_a_t *stream_format_a);
-    void write_avi_header_chunk();
-    void write_index(int count, unsigned int *offsets);
+    std::vector<unsigned char> hdrl; /* serialized 'hdrl' LIST */
+    bool header_pending; /* streaming, the header is not written yet */
+    bool raw; /* "DIB " or YUV video fed through AddRawVideoFrame() */
+    int yuv; /* GWAVIConvert::YUV_* of raw video, -1 for DIB */
+    bool rle; /* MRLE video */
+    std::vector<unsigned char> rle_prev; /* last frame, to delta code the next */
+    unsigned long rle_frames;
+    std::vector<unsigned char> raw_buffer;
+    GWAVIConvert::Pool *convert_pool; /* options.convert_threads, raw video */
+    unsigned char *reserved; /* ReserveVideoFrame(), in the sink or reserve_buffer */
+    size_t reserved_len;
+    std::vector<unsigned char> reserve_buffer;
+    GWAVIIndex index;
+    std::vector<unsigned char> batch_headers; /* AddFrames(), 'JUNK' and chunk header per frame */
+    std::vector<struct iovec> batch_iov;
+    std::vector<gwavi_chunk_t> batch_chunks; /* AddFrames(), indexed once written */
+
+    /* OpenDML state */
+    uint64_t riff_start; /* position of the current RIFF chunk */
+    uint64_t riff_limit;
+    unsigned int riff_count;
+    size_t segment_start; /* first index entry of the current RIFF */
+    unsigned int first_riff_frames;
+
+    GWAVIInterleave *interleave;
+
+    /* crash checkpoints */
+    uint64_t checkpoint_time; /* clock_ns() of the last one */
+    std::vector<uint64_t> checkpoint_delta; /* delta frames since, chunk positions */
+
+    /* async writer */
+    GWAVIQueue *queue;
+    std::thread writer;
+    std::mutex async_mutex;
+    std::condition_variable data_cv;
+    std::condition_variable space_cv;
+    std::atomic<bool> async_stop;
+    std::atomic<bool> writer_idle;
+    std::atomic<unsigned int> producers_waiting; /* on space_cv */
+    std::atomic<int> async_error;
+
+    gwavi_stats_t stats;
+    unsigned long long latency_hist[256];
+
+    void init(const char *filename, GWAVISink *sink, unsigned width, unsigned height, unsigned bpp,
+	    const char *fourcc, unsigned fps, gwavi_audio_t *audio, gwavi_options_t *options);
+    unsigned char *put_avi_header(unsigned char *p, struct gwavi_header_t *avi_header);
+    unsigned char *put_stream_header(unsigned char *p, struct gwavi_stream_header_t *stream_header);
+    unsigned char *put_stream_format_v(unsigned char *p, struct gwavi_stream_format_v_t *stream_format_v);
+    unsigned char *put_stream_format_a(unsigned char *p, struct gwavi_stream_format_a_t *stream_format_a);
+    unsigned char *put_super_index(unsigned char *p, struct gwavi_stream_t *stream);
+    unsigned char *put_odml_header(unsigned char *p);
+    size_t strl_size(unsigned int stream);
+    void init_video_stream(struct gwavi_stream_t *stream, unsigned width, unsigned height, unsigned bpp,
+	    const char *fourcc, unsigned fps);
+    void init_audio_stream(struct gwavi_stream_t *stream, gwavi_audio_t *audio);
+    void number_stream(unsigned int n);
+    int append_stream(struct gwavi_stream_t *stream);
+    unsigned int audio_stream();
+    void free_streams();
+    void build_hdrl();
+    void write_file_header();
+    void write_pending_header();
+    void write_trailer(uint64_t movi_end);
+    void write_index(size_t count);
+    void write_batch();
+    void write_std_index(unsigned int stream);
+    void add_index_entry(unsigned int stream, uint64_t offset, unsigned int size, bool delta);
+    void close_riff();
+    void checkpoint();
+    void maybe_checkpoint();
+    bool riff_fits(uint64_t pos, size_t len, size_t pending = 0);
+    void check_riff(size_t len);
     int check_fourcc(const char *fourcc);
+    size_t rle_frame(const unsigned char *pixels, size_t stride, unsigned char *dst, bool *key);
+    void rle_keep(const unsigned char *pixels, size_t stride);
+
+    int add_frame(GWAVIQueue::gwavi_frame_t *frame);
+    int interleave_frame(GWAVIQueue::gwavi_frame_t *frame);
+    void record_latency(uint64_t ns);
+    int output_frame(GWAVIQueue::gwavi_frame_t *frame);
+    int add_video_frame(GWAVIQueue::gwavi_frame_t *frame);
+    int add_audio_frame(GWAVIQueue::gwavi_frame_t *frame);
+    int write_frame(GWAVIQueue::gwavi_frame_t *frame);
+    int queue_frame(GWAVIQueue::gwavi_frame_t *frame);
+    void writer_thread();
+    void stop_writer();
 
+    size_t junk_size(uint64_t offset);
+    void write_chunk(const char *id, const unsigned char *buffer, size_t len, size_t pad, size_t junk,
+	    gwavi_release_t release = NULL, void *opaque = NULL);
+    void patch_int(uint64_t offset, unsigned int n);
     void write_int(unsigned int n);
-    void write_short(unsigned int n);
-    void write_chars(const char *s);
     void write_chars_bin(const char *s, int count);
 
 };
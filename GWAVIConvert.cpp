@@ -0,0 +1,955 @@
+/*
+ * GWAVIConvert.cpp
+ *
+ *  Created on: 16 окт. 2026 г.
+ */
+
+#include "GWAVIConvert.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+/**
+ * Byte shuffle of one pixel: dst byte c is src byte map[c], or 0xff (opaque
+ * alpha) where map[c] is negative.
+ */
+struct swizzle_t {
+    unsigned int sbpp; /* bytes per source pixel */
+    unsigned int dbpp; /* bytes per destination pixel */
+    int map[4];
+};
+
+static int detected_simd()
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	return GWAVIConvert::SIMD_AVX2;
+    if (__builtin_cpu_supports("ssse3"))
+	return GWAVIConvert::SIMD_SSSE3;
+#endif
+    return GWAVIConvert::SIMD_NONE;
+}
+
+static int simd = detected_simd();
+
+/*
+ * Run fn(first, last) on bands of rows [0..height), one per thread of pool.
+ * Band boundaries are multiples of step.
+ */
+template<typename F>
+static void run_bands(unsigned int height, GWAVIConvert::Pool *pool, unsigned int step, F fn)
+{
+    unsigned int threads = pool ? pool->Size() : 1;
+    unsigned int rows;
+
+    rows = threads > 1 ? (height / step + threads - 1) / threads * step : 0;
+    if (rows == 0 || rows >= height) {
+	fn(0, height);
+	return;
+    }
+    /* a single reference keeps the std::function off the heap */
+    struct {
+	F *fn;
+	unsigned int rows, height;
+    } band = { &fn, rows, height };
+    pool->Run((height + rows - 1) / rows, [&band](unsigned int n) {
+	unsigned int first = n * band.rows;
+	(*band.fn)(first, first + band.rows < band.height ? first + band.rows : band.height);
+    });
+}
+
+/**
+ * Start threads - 1 workers, none for 0 or 1.
+ *
+ * @throw std::system_error if a thread cannot be started.
+ */
+GWAVIConvert::Pool::Pool(unsigned int threads)
+{
+    unsigned int i;
+
+    size = threads ? threads : 1;
+    job = NULL;
+    jobs = 0;
+    next_job = 0;
+    pending = 0;
+    stop = false;
+    try {
+	for (i = 1; i < size; i++)
+	    workers.emplace_back(&Pool::worker, this);
+    } catch (...) {
+	shutdown();
+	throw;
+    }
+}
+
+GWAVIConvert::Pool::~Pool()
+{
+    shutdown();
+}
+
+void GWAVIConvert::Pool::shutdown()
+{
+    {
+	std::lock_guard<std::mutex> lock(mutex);
+	stop = true;
+    }
+    work_cv.notify_all();
+    for (std::thread &t : workers)
+	t.join();
+    workers.clear();
+}
+
+void GWAVIConvert::Pool::worker()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    const std::function<void(unsigned int)> *fn;
+    unsigned int n;
+
+    for (;;) {
+	work_cv.wait(lock, [&] { return stop || next_job < jobs; });
+	if (stop)
+	    return;
+	n = next_job++;
+	fn = job;
+	lock.unlock();
+	(*fn)(n);
+	lock.lock();
+	if (--pending == 0)
+	    done_cv.notify_one();
+    }
+}
+
+/**
+ * Run fn(0) .. fn(jobs - 1) on the workers and the calling thread, return
+ * when all are done.
+ */
+void GWAVIConvert::Pool::Run(unsigned int jobs, const std::function<void(unsigned int)> &fn)
+{
+    std::lock_guard<std::mutex> run_lock(run_mutex);
+    std::unique_lock<std::mutex> lock(mutex);
+    unsigned int n;
+
+    job = &fn;
+    this->jobs = jobs;
+    next_job = 0;
+    pending = jobs;
+    if (!workers.empty())
+	work_cv.notify_all();
+    while (next_job < jobs) {
+	n = next_job++;
+	lock.unlock();
+	fn(n);
+	lock.lock();
+	pending--;
+    }
+    done_cv.wait(lock, [&] { return pending == 0; });
+    job = NULL;
+    this->jobs = 0;
+    next_job = 0;
+}
+
+/*
+ * BT.601 studio range. Chroma is taken from the sums of the channels of a 2x2
+ * block (a 2x1 pair counted twice for 4:2:2).
+ */
+static inline uint8_t luma(int b, int g, int r)
+{
+    return ((25 * b + 129 * g + 66 * r + 128) >> 8) + 16;
+}
+
+static inline uint8_t chroma_u(int b, int g, int r)
+{
+    return ((112 * b - 74 * g - 38 * r + 512) >> 10) + 128;
+}
+
+static inline uint8_t chroma_v(int b, int g, int r)
+{
+    return ((-18 * b - 94 * g + 112 * r + 512) >> 10) + 128;
+}
+
+static void luma_row_c(const uint8_t *p, uint8_t *y, unsigned int width, unsigned int x)
+{
+    for (; x < width; x++)
+	y[x] = luma(p[x * 4], p[x * 4 + 1], p[x * 4 + 2]);
+}
+
+/* from pixel x on, rows p0 and p1 of B, G, R, X pixels */
+static void chroma_row_c(const uint8_t *p0, const uint8_t *p1, uint8_t *u, uint8_t *v, unsigned int width,
+	unsigned int x)
+{
+    int b, g, r;
+
+    for (; x + 1 < width; x += 2) {
+	b = p0[x * 4] + p0[x * 4 + 4] + p1[x * 4] + p1[x * 4 + 4];
+	g = p0[x * 4 + 1] + p0[x * 4 + 5] + p1[x * 4 + 1] + p1[x * 4 + 5];
+	r = p0[x * 4 + 2] + p0[x * 4 + 6] + p1[x * 4 + 2] + p1[x * 4 + 6];
+	u[x / 2] = chroma_u(b, g, r);
+	v[x / 2] = chroma_v(b, g, r);
+    }
+}
+
+static void swizzle_row_c(const uint8_t *src, uint8_t *dst, unsigned int width, const swizzle_t *sw, unsigned int x)
+{
+    unsigned int c;
+
+    for (; x < width; x++) {
+	for (c = 0; c < sw->dbpp; c++)
+	    dst[x * sw->dbpp + c] = sw->map[c] < 0 ? 0xff : src[x * sw->sbpp + sw->map[c]];
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+
+/*
+ * A 16 byte register takes k whole pixels of both source and destination.
+ * Every step loads and stores 16 bytes but only advances k pixels, the
+ * extra bytes are overwritten by the next step.
+ */
+static unsigned int block_pixels(const swizzle_t *sw)
+{
+    unsigned int k = 16 / sw->sbpp;
+
+    if (16 / sw->dbpp < k)
+	k = 16 / sw->dbpp;
+    return k;
+}
+
+/*
+ * Pixels a 16 byte load or store must stay within, the row has to be at
+ * least this long from the current pixel.
+ */
+static unsigned int block_reach(const swizzle_t *sw)
+{
+    unsigned int s = (16 + sw->sbpp - 1) / sw->sbpp;
+    unsigned int d = (16 + sw->dbpp - 1) / sw->dbpp;
+
+    return s > d ? s : d;
+}
+
+static void block_masks(const swizzle_t *sw, unsigned int k, uint8_t *mask, uint8_t *fill)
+{
+    unsigned int p, c;
+
+    memset(mask, 0x80, 16);
+    memset(fill, 0, 16);
+    for (p = 0; p < k; p++) {
+	for (c = 0; c < sw->dbpp; c++) {
+	    if (sw->map[c] < 0)
+		fill[p * sw->dbpp + c] = 0xff;
+	    else
+		mask[p * sw->dbpp + c] = p * sw->sbpp + sw->map[c];
+	}
+    }
+}
+
+__attribute__((target("ssse3")))
+static unsigned int swizzle_row_ssse3(const uint8_t *src, uint8_t *dst, unsigned int width, const swizzle_t *sw)
+{
+    unsigned int k = block_pixels(sw);
+    unsigned int n = block_reach(sw);
+    uint8_t m[16], f[16];
+    __m128i mask, fill, v;
+    unsigned int x = 0;
+
+    block_masks(sw, k, m, f);
+    mask = _mm_loadu_si128((const __m128i *) m);
+    fill = _mm_loadu_si128((const __m128i *) f);
+
+    while (x + n <= width) {
+	v = _mm_loadu_si128((const __m128i *) (src + x * sw->sbpp));
+	v = _mm_or_si128(_mm_shuffle_epi8(v, mask), fill);
+	_mm_storeu_si128((__m128i *) (dst + x * sw->dbpp), v);
+	x += k;
+    }
+    return x;
+}
+
+__attribute__((target("avx2")))
+static unsigned int swizzle_row_avx2(const uint8_t *src, uint8_t *dst, unsigned int width, const swizzle_t *sw)
+{
+    unsigned int k = block_pixels(sw);
+    unsigned int n = block_reach(sw);
+    uint8_t m[16], f[16];
+    __m256i mask, fill, v;
+    unsigned int x = 0;
+
+    block_masks(sw, k, m, f);
+    mask = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) m));
+    fill = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) f));
+
+    /* two blocks of k pixels per step, one in each 128 bit lane */
+    while (x + k + n <= width) {
+	v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) (src + x * sw->sbpp))),
+		_mm_loadu_si128((const __m128i *) (src + (x + k) * sw->sbpp)), 1);
+	v = _mm256_or_si256(_mm256_shuffle_epi8(v, mask), fill);
+	_mm_storeu_si128((__m128i *) (dst + x * sw->dbpp), _mm256_castsi256_si128(v));
+	_mm_storeu_si128((__m128i *) (dst + (x + k) * sw->dbpp), _mm256_extracti128_si256(v, 1));
+	x += 2 * k;
+    }
+    return x;
+}
+
+/*
+ * Luma and chroma work on B, G, R, X pixels widened to 16 bit, where
+ * pmaddwd + phaddd give the weighted sum of a pixel in one 32 bit lane.
+ */
+__attribute__((target("ssse3")))
+static inline __m128i luma4_ssse3(__m128i px, __m128i cy)
+{
+    __m128i zero = _mm_setzero_si128();
+
+    return _mm_hadd_epi32(_mm_madd_epi16(_mm_unpacklo_epi8(px, zero), cy),
+	    _mm_madd_epi16(_mm_unpackhi_epi8(px, zero), cy));
+}
+
+__attribute__((target("ssse3")))
+static unsigned int luma_row_ssse3(const uint8_t *p, uint8_t *y, unsigned int width)
+{
+    __m128i cy = _mm_setr_epi16(25, 129, 66, 0, 25, 129, 66, 0);
+    __m128i round = _mm_set1_epi32(128);
+    __m128i offset = _mm_set1_epi16(16);
+    __m128i y0, y1, y2, y3;
+    unsigned int x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+	y0 = _mm_srai_epi32(_mm_add_epi32(luma4_ssse3(_mm_loadu_si128((const __m128i *) (p + x * 4)), cy), round), 8);
+	y1 = _mm_srai_epi32(_mm_add_epi32(luma4_ssse3(_mm_loadu_si128((const __m128i *) (p + x * 4 + 16)), cy), round),
+		8);
+	y2 = _mm_srai_epi32(_mm_add_epi32(luma4_ssse3(_mm_loadu_si128((const __m128i *) (p + x * 4 + 32)), cy), round),
+		8);
+	y3 = _mm_srai_epi32(_mm_add_epi32(luma4_ssse3(_mm_loadu_si128((const __m128i *) (p + x * 4 + 48)), cy), round),
+		8);
+	y0 = _mm_add_epi16(_mm_packs_epi32(y0, y1), offset);
+	y2 = _mm_add_epi16(_mm_packs_epi32(y2, y3), offset);
+	_mm_storeu_si128((__m128i *) (y + x), _mm_packus_epi16(y0, y2));
+    }
+    return x;
+}
+
+/* sums of the pixel pairs 0+1 and 2+3 of two rows, as B, G, R, X words */
+__attribute__((target("ssse3")))
+static inline __m128i pair_sums_ssse3(const uint8_t *p0, const uint8_t *p1)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i a = _mm_loadu_si128((const __m128i *) p0);
+    __m128i b = _mm_loadu_si128((const __m128i *) p1);
+    __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+    __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+
+    lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+    hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+    return _mm_unpacklo_epi64(lo, hi);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i chroma8_ssse3(__m128i s0, __m128i s1, __m128i s2, __m128i s3, __m128i c)
+{
+    __m128i round = _mm_set1_epi32(512);
+    __m128i a = _mm_hadd_epi32(_mm_madd_epi16(s0, c), _mm_madd_epi16(s1, c));
+    __m128i b = _mm_hadd_epi32(_mm_madd_epi16(s2, c), _mm_madd_epi16(s3, c));
+
+    a = _mm_srai_epi32(_mm_add_epi32(a, round), 10);
+    b = _mm_srai_epi32(_mm_add_epi32(b, round), 10);
+    a = _mm_add_epi16(_mm_packs_epi32(a, b), _mm_set1_epi16(128));
+    return _mm_packus_epi16(a, a);
+}
+
+__attribute__((target("ssse3")))
+static unsigned int chroma_row_ssse3(const uint8_t *p0, const uint8_t *p1, uint8_t *u, uint8_t *v,
+	unsigned int width)
+{
+    __m128i cu = _mm_setr_epi16(112, -74, -38, 0, 112, -74, -38, 0);
+    __m128i cv = _mm_setr_epi16(-18, -94, 112, 0, -18, -94, 112, 0);
+    __m128i s0, s1, s2, s3;
+    unsigned int x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+	s0 = pair_sums_ssse3(p0 + x * 4, p1 + x * 4);
+	s1 = pair_sums_ssse3(p0 + x * 4 + 16, p1 + x * 4 + 16);
+	s2 = pair_sums_ssse3(p0 + x * 4 + 32, p1 + x * 4 + 32);
+	s3 = pair_sums_ssse3(p0 + x * 4 + 48, p1 + x * 4 + 48);
+	_mm_storel_epi64((__m128i *) (u + x / 2), chroma8_ssse3(s0, s1, s2, s3, cu));
+	_mm_storel_epi64((__m128i *) (v + x / 2), chroma8_ssse3(s0, s1, s2, s3, cv));
+    }
+    return x;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i luma8_avx2(const uint8_t *p, __m256i cy, __m256i round)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i px = _mm256_loadu_si256((const __m256i *) p);
+
+    px = _mm256_hadd_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi8(px, zero), cy),
+	    _mm256_madd_epi16(_mm256_unpackhi_epi8(px, zero), cy));
+    return _mm256_srai_epi32(_mm256_add_epi32(px, round), 8);
+}
+
+__attribute__((target("avx2")))
+static unsigned int luma_row_avx2(const uint8_t *p, uint8_t *y, unsigned int width)
+{
+    __m256i cy = _mm256_setr_epi16(25, 129, 66, 0, 25, 129, 66, 0, 25, 129, 66, 0, 25, 129, 66, 0);
+    __m256i round = _mm256_set1_epi32(128);
+    __m256i offset = _mm256_set1_epi16(16);
+    /* packs work per 128 bit lane, this puts the 4 pixel groups back in order */
+    __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    __m256i y0, y1;
+    unsigned int x;
+
+    for (x = 0; x + 32 <= width; x += 32) {
+	y0 = _mm256_packs_epi32(luma8_avx2(p + x * 4, cy, round), luma8_avx2(p + x * 4 + 32, cy, round));
+	y1 = _mm256_packs_epi32(luma8_avx2(p + x * 4 + 64, cy, round), luma8_avx2(p + x * 4 + 96, cy, round));
+	y0 = _mm256_packus_epi16(_mm256_add_epi16(y0, offset), _mm256_add_epi16(y1, offset));
+	_mm256_storeu_si256((__m256i *) (y + x), _mm256_permutevar8x32_epi32(y0, order));
+    }
+    return x;
+}
+
+/* Y0 U0 Y1 V0 from 16 luma and 8 chroma samples per step */
+__attribute__((target("ssse3")))
+static unsigned int pack_yuy2_ssse3(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *d,
+	unsigned int width)
+{
+    __m128i l, c;
+    unsigned int x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+	l = _mm_loadu_si128((const __m128i *) (y + x));
+	c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (u + x / 2)),
+		_mm_loadl_epi64((const __m128i *) (v + x / 2)));
+	_mm_storeu_si128((__m128i *) (d + x * 2), _mm_unpacklo_epi8(l, c));
+	_mm_storeu_si128((__m128i *) (d + x * 2 + 16), _mm_unpackhi_epi8(l, c));
+    }
+    return x;
+}
+
+__attribute__((target("ssse3")))
+static unsigned int pack_uv_ssse3(const uint8_t *u, const uint8_t *v, uint8_t *d, unsigned int n)
+{
+    __m128i a, b;
+    unsigned int x;
+
+    for (x = 0; x + 16 <= n; x += 16) {
+	a = _mm_loadu_si128((const __m128i *) (u + x));
+	b = _mm_loadu_si128((const __m128i *) (v + x));
+	_mm_storeu_si128((__m128i *) (d + x * 2), _mm_unpacklo_epi8(a, b));
+	_mm_storeu_si128((__m128i *) (d + x * 2 + 16), _mm_unpackhi_epi8(a, b));
+    }
+    return x;
+}
+
+/*
+ * Length of the common prefix of a and b, up to n bytes. With b pointing to
+ * 16 (32) copies of a byte it measures a run.
+ */
+__attribute__((target("ssse3")))
+static unsigned int match_ssse3(const uint8_t *a, const uint8_t *b, unsigned int n, bool run)
+{
+    __m128i v = run ? _mm_set1_epi8(*b) : _mm_setzero_si128();
+    unsigned int x, m;
+
+    for (x = 0; x + 16 <= n; x += 16) {
+	if (!run)
+	    v = _mm_loadu_si128((const __m128i *) (b + x));
+	m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + x)), v));
+	if (m != 0xffff)
+	    return x + __builtin_ctz(~m);
+    }
+    return x;
+}
+
+__attribute__((target("avx2")))
+static unsigned int match_avx2(const uint8_t *a, const uint8_t *b, unsigned int n, bool run)
+{
+    __m256i v = run ? _mm256_set1_epi8(*b) : _mm256_setzero_si256();
+    unsigned int x, m;
+
+    for (x = 0; x + 32 <= n; x += 32) {
+	if (!run)
+	    v = _mm256_loadu_si256((const __m256i *) (b + x));
+	m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (a + x)), v));
+	if (m != 0xffffffff)
+	    return x + __builtin_ctz(~m);
+    }
+    return x;
+}
+
+#endif /* HAVE_X86_SIMD */
+
+static unsigned int match(const uint8_t *a, const uint8_t *b, unsigned int n, bool run)
+{
+    unsigned int x = 0;
+
+#ifdef HAVE_X86_SIMD
+    if (simd >= GWAVIConvert::SIMD_AVX2)
+	x = match_avx2(a, b, n, run);
+    else if (simd >= GWAVIConvert::SIMD_SSSE3)
+	x = match_ssse3(a, b, n, run);
+#endif
+    /* the tail, or nothing if the kernel stopped at a mismatch */
+    while (x < n && a[x] == b[run ? 0 : x])
+	x++;
+    return x;
+}
+
+/* bytes equal to p[0] from p on */
+static inline unsigned int run_length(const uint8_t *p, unsigned int n)
+{
+    return match(p, p, n, true);
+}
+
+/* bytes of the current row unchanged since the previous frame */
+static inline unsigned int same_length(const uint8_t *c, const uint8_t *p, unsigned int n)
+{
+    return match(c, p, n, false);
+}
+
+static void pack_yuy2(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *d, unsigned int width)
+{
+    unsigned int x = 0;
+
+#ifdef HAVE_X86_SIMD
+    if (simd >= GWAVIConvert::SIMD_SSSE3)
+	x = pack_yuy2_ssse3(y, u, v, d, width);
+#endif
+    for (; x < width; x += 2) {
+	d[x * 2] = y[x];
+	d[x * 2 + 1] = u[x / 2];
+	d[x * 2 + 2] = y[x + 1];
+	d[x * 2 + 3] = v[x / 2];
+    }
+}
+
+static void pack_uv(const uint8_t *u, const uint8_t *v, uint8_t *d, unsigned int n)
+{
+    unsigned int x = 0;
+
+#ifdef HAVE_X86_SIMD
+    if (simd >= GWAVIConvert::SIMD_SSSE3)
+	x = pack_uv_ssse3(u, v, d, n);
+#endif
+    for (; x < n; x++) {
+	d[x * 2] = u[x];
+	d[x * 2 + 1] = v[x];
+    }
+}
+
+static void luma_row(const uint8_t *p, uint8_t *y, unsigned int width)
+{
+    unsigned int x = 0;
+
+#ifdef HAVE_X86_SIMD
+    if (simd >= GWAVIConvert::SIMD_AVX2)
+	x = luma_row_avx2(p, y, width);
+    else if (simd >= GWAVIConvert::SIMD_SSSE3)
+	x = luma_row_ssse3(p, y, width);
+#endif
+    luma_row_c(p, y, width, x);
+}
+
+/* chroma is a quarter of the work, SSSE3 serves the AVX2 path as well */
+static void chroma_row(const uint8_t *p0, const uint8_t *p1, uint8_t *u, uint8_t *v, unsigned int width)
+{
+    unsigned int x = 0;
+
+#ifdef HAVE_X86_SIMD
+    if (simd >= GWAVIConvert::SIMD_SSSE3)
+	x = chroma_row_ssse3(p0, p1, u, v, width);
+#endif
+    chroma_row_c(p0, p1, u, v, width, x);
+}
+
+static void swizzle_row(const uint8_t *src, uint8_t *dst, unsigned int width, const swizzle_t *sw)
+{
+    unsigned int x = 0;
+
+#ifdef HAVE_X86_SIMD
+    if (simd >= GWAVIConvert::SIMD_AVX2)
+	x = swizzle_row_avx2(src, dst, width, sw);
+    else if (simd >= GWAVIConvert::SIMD_SSSE3)
+	x = swizzle_row_ssse3(src, dst, width, sw);
+#endif
+    swizzle_row_c(src, dst, width, sw, x);
+}
+
+/*
+ * Shuffle of a GWAVIConvert::PIX_* format into B, G, R pixels of dbpp bytes,
+ * a fourth byte is the source alpha or 0xff.
+ */
+static bool bgr_swizzle(int format, unsigned int dbpp, swizzle_t *sw)
+{
+    sw->sbpp = GWAVIConvert::PixelSize(format);
+    sw->dbpp = dbpp;
+    if (sw->sbpp < 3 || (dbpp != 3 && dbpp != 4))
+	return false;
+
+    /* offsets of B, G, R (and A) in the source pixel */
+    if (format == GWAVIConvert::PIX_RGB24 || format == GWAVIConvert::PIX_RGBA) {
+	sw->map[0] = 2;
+	sw->map[2] = 0;
+    } else {
+	sw->map[0] = 0;
+	sw->map[2] = 2;
+    }
+    sw->map[1] = 1;
+    sw->map[3] = sw->sbpp == 4 ? 3 : -1;
+    return true;
+}
+
+/**
+ * Bytes per pixel of a GWAVIConvert::PIX_* format, 0 if unknown.
+ */
+unsigned int GWAVIConvert::PixelSize(int format)
+{
+    switch (format) {
+    case PIX_RGB24:
+    case PIX_BGR24:
+	return 3;
+    case PIX_RGBA:
+    case PIX_BGRA:
+	return 4;
+    case PIX_PAL8:
+	return 1;
+    }
+    return 0;
+}
+
+/**
+ * Bytes per row of a DIB, rows are padded to 4 bytes.
+ */
+size_t GWAVIConvert::DibStride(unsigned int width, unsigned int bpp)
+{
+    return ((size_t) width * bpp / 8 + 3) & ~(size_t) 3;
+}
+
+/**
+ * As below, with threads started for this call only.
+ */
+int GWAVIConvert::ToDib(const unsigned char *src, size_t stride, int format, unsigned int width, unsigned int height,
+	unsigned char *dst, unsigned int bpp, unsigned int threads)
+{
+    Pool pool(threads);
+
+    return ToDib(src, stride, format, width, height, dst, bpp, &pool);
+}
+
+/**
+ * Convert a top-down frame of packed pixels into a bottom-up BI_RGB DIB of
+ * bpp 24 (B, G, R) or 32 (B, G, R, A) bits, DibStride(width, bpp) * height
+ * bytes.
+ *
+ * @param stride Bytes between the starts of two source rows.
+ * @param pool Threads converting bands of rows, NULL - the calling thread only.
+ *
+ * @return 0 on success, -1 if the conversion is not supported.
+ */
+int GWAVIConvert::ToDib(const unsigned char *src, size_t stride, int format, unsigned int width, unsigned int height,
+	unsigned char *dst, unsigned int bpp, Pool *pool)
+{
+    size_t dst_stride = DibStride(width, bpp);
+    size_t row = (size_t) width * bpp / 8;
+    swizzle_t sw;
+    bool copy;
+
+    if (!bgr_swizzle(format, bpp / 8, &sw) || bpp % 8)
+	return -1;
+    copy = sw.sbpp == sw.dbpp && sw.map[0] == 0;
+
+    run_bands(height, pool, 1, [&](unsigned int first, unsigned int last) {
+	const unsigned char *s;
+	unsigned char *d;
+	unsigned int y;
+
+	for (y = first; y < last; y++) {
+	    s = src + (size_t) (height - 1 - y) * stride;
+	    d = dst + y * dst_stride;
+	    if (copy)
+		memcpy(d, s, row);
+	    else
+		swizzle_row(s, d, width, &sw);
+	    memset(d + row, 0, dst_stride - row);
+	}
+    });
+    return 0;
+}
+
+/**
+ * GWAVIConvert::YUV_* format stored under a fourcc, -1 if none.
+ */
+int GWAVIConvert::YuvFormat(const char *fourcc)
+{
+    if (!memcmp(fourcc, "YUY2", 4))
+	return YUV_YUY2;
+    if (!memcmp(fourcc, "I420", 4) || !memcmp(fourcc, "IYUV", 4))
+	return YUV_I420;
+    if (!memcmp(fourcc, "YV12", 4))
+	return YUV_YV12;
+    if (!memcmp(fourcc, "NV12", 4))
+	return YUV_NV12;
+    return -1;
+}
+
+unsigned int GWAVIConvert::YuvBpp(int yuv)
+{
+    return yuv == YUV_YUY2 ? 16 : 12;
+}
+
+/**
+ * Bytes of a frame in a GWAVIConvert::YUV_* format.
+ */
+size_t GWAVIConvert::YuvSize(int yuv, unsigned int width, unsigned int height)
+{
+    if (yuv == YUV_YUY2)
+	return (size_t) width * height * 2;
+    return (size_t) width * height + 2 * (size_t) (width / 2) * (height / 2);
+}
+
+/**
+ * As below, with threads started for this call only.
+ */
+int GWAVIConvert::ToYuv(const unsigned char *src, size_t stride, int format, unsigned int width, unsigned int height,
+	unsigned char *dst, int yuv, unsigned int threads)
+{
+    Pool pool(threads);
+
+    return ToYuv(src, stride, format, width, height, dst, yuv, &pool);
+}
+
+/**
+ * Convert a frame of packed pixels into a top-down YUV frame, YuvSize()
+ * bytes. Width must be even, so must height for the 4:2:0 formats.
+ *
+ * @param stride Bytes between the starts of two source rows.
+ * @param yuv GWAVIConvert::YUV_*.
+ * @param pool Threads converting bands of rows, NULL - the calling thread only.
+ *
+ * @return 0 on success, -1 if the conversion is not supported.
+ */
+int GWAVIConvert::ToYuv(const unsigned char *src, size_t stride, int format, unsigned int width, unsigned int height,
+	unsigned char *dst, int yuv, Pool *pool)
+{
+    unsigned int step = yuv == YUV_YUY2 ? 1 : 2;
+    size_t luma_size = (size_t) width * height;
+    unsigned char *u_plane, *v_plane;
+    swizzle_t sw;
+
+    if (!bgr_swizzle(format, 4, &sw) || yuv < YUV_YUY2 || yuv > YUV_NV12 || width % 2 || height % step)
+	return -1;
+    u_plane = dst + luma_size;
+    v_plane = u_plane + luma_size / 4;
+    if (yuv == YUV_YV12) {
+	v_plane = u_plane;
+	u_plane = v_plane + luma_size / 4;
+    }
+
+    run_bands(height, pool, step, [&](unsigned int first, unsigned int last) {
+	std::vector<unsigned char> buf;
+	const unsigned char *p0, *p1;
+	unsigned char *yrow, *u, *v;
+	unsigned int y;
+
+	/* two rows of B, G, R, X pixels, a luma row and two chroma rows */
+	buf.resize((size_t) width * 8 + width * 2);
+	yrow = buf.data() + (size_t) width * 8;
+	u = yrow + width;
+	v = u + width / 2;
+
+	for (y = first; y < last; y += step) {
+	    if (format == PIX_BGRA) {
+		p0 = src + y * stride;
+		p1 = src + (y + step - 1) * stride;
+	    } else {
+		p0 = p1 = buf.data();
+		swizzle_row(src + y * stride, buf.data(), width, &sw);
+		if (step == 2) {
+		    p1 = buf.data() + (size_t) width * 4;
+		    swizzle_row(src + (y + 1) * stride, buf.data() + (size_t) width * 4, width, &sw);
+		}
+	    }
+
+	    switch (yuv) {
+	    case YUV_YUY2:
+		luma_row(p0, yrow, width);
+		chroma_row(p0, p0, u, v, width);
+		pack_yuy2(yrow, u, v, dst + (size_t) y * width * 2, width);
+		break;
+	    case YUV_I420:
+	    case YUV_YV12:
+		luma_row(p0, dst + (size_t) y * width, width);
+		luma_row(p1, dst + (size_t) (y + 1) * width, width);
+		chroma_row(p0, p1, u_plane + (size_t) y / 2 * width / 2, v_plane + (size_t) y / 2 * width / 2, width);
+		break;
+	    case YUV_NV12:
+		luma_row(p0, dst + (size_t) y * width, width);
+		luma_row(p1, dst + (size_t) (y + 1) * width, width);
+		chroma_row(p0, p1, u, v, width);
+		pack_uv(u, v, dst + luma_size + (size_t) y / 2 * width, width / 2);
+		break;
+	    }
+	}
+    });
+    return 0;
+}
+
+/*
+ * Encode a row of RLE8. With the previous frame's row p, unchanged spans of
+ * 4 pixels or more become delta skips and an unchanged end of the row is
+ * left to the end of line code.
+ */
+static uint8_t *rle8_row(const uint8_t *c, const uint8_t *p, unsigned int width, uint8_t *d)
+{
+    unsigned int x = 0, n, s, start;
+
+    while (x < width) {
+	if (p) {
+	    s = same_length(c + x, p + x, width - x);
+	    if (x + s == width)
+		break;
+	    if (s >= 4) {
+		x += s;
+		for (; s > 0; s -= n) {
+		    n = s > 255 ? 255 : s;
+		    *d++ = 0;
+		    *d++ = 2; /* delta */
+		    *d++ = n;
+		    *d++ = 0;
+		}
+		continue;
+	    }
+	}
+
+	n = run_length(c + x, width - x < 255 ? width - x : 255);
+	if (n >= 3) {
+	    *d++ = n;
+	    *d++ = c[x];
+	    x += n;
+	    continue;
+	}
+
+	/* literal pixels up to the next run or unchanged span */
+	start = x;
+	for (; x < width && x - start < 255; x++) {
+	    if (x + 2 < width && c[x] == c[x + 1] && c[x] == c[x + 2])
+		break;
+	    if (p && x + 8 <= width && !memcmp(c + x, p + x, 8))
+		break;
+	}
+	n = x - start;
+	if (n < 3) {
+	    /* absolute mode takes 3 pixels or more */
+	    for (; start < x; start++) {
+		*d++ = 1;
+		*d++ = c[start];
+	    }
+	} else {
+	    *d++ = 0;
+	    *d++ = n;
+	    memcpy(d, c + start, n);
+	    d += n;
+	    if (n & 1)
+		*d++ = 0;
+	}
+    }
+
+    *d++ = 0;
+    *d++ = 0; /* end of line */
+    return d;
+}
+
+/**
+ * Worst case size of a ToRle8() frame.
+ */
+size_t GWAVIConvert::Rle8Bound(unsigned int width, unsigned int height)
+{
+    /* a pixel takes at most 2 bytes (runs of 1), plus the end of line */
+    return (size_t) height * (2 * (size_t) width + 2) + 2;
+}
+
+/**
+ * As below, with threads started for this call only.
+ */
+size_t GWAVIConvert::ToRle8(const unsigned char *src, size_t stride, const unsigned char *prev, unsigned int width,
+	unsigned int height, unsigned char *dst, unsigned int threads)
+{
+    Pool pool(threads);
+
+    return ToRle8(src, stride, prev, width, height, dst, &pool);
+}
+
+/**
+ * Encode a top-down frame of palette indexes as a BI_RLE8 bitmap. Bands of
+ * rows are encoded independently, they only share end of line codes.
+ *
+ * @param prev The previous frame, width * height bytes, to delta code
+ * against, NULL for a key frame.
+ * @param dst Rle8Bound(width, height) bytes.
+ * @param pool Threads encoding bands of rows, NULL - the calling thread only.
+ *
+ * @return bytes written to dst.
+ */
+size_t GWAVIConvert::ToRle8(const unsigned char *src, size_t stride, const unsigned char *prev, unsigned int width,
+	unsigned int height, unsigned char *dst, Pool *pool)
+{
+    size_t row_max = 2 * (size_t) width + 2;
+    std::vector<size_t> band_end(height, 0);
+    size_t len = 0, n;
+    unsigned int r;
+
+    /* every band starts at its worst case offset and is moved down after */
+    run_bands(height, pool, 1, [&](unsigned int first, unsigned int last) {
+	unsigned char *d = dst + first * row_max;
+	unsigned int r, y;
+
+	for (r = first; r < last; r++) {
+	    /* RLE rows are bottom-up */
+	    y = height - 1 - r;
+	    d = rle8_row(src + y * stride, prev ? prev + (size_t) y * width : NULL, width, d);
+	}
+	band_end[first] = d - dst;
+    });
+
+    for (r = 0; r < height; r++) {
+	if (!band_end[r])
+	    continue;
+	n = band_end[r] - r * row_max;
+	memmove(dst + len, dst + r * row_max, n);
+	len += n;
+    }
+
+    /* the last end of line becomes end of bitmap */
+    if (len >= 2)
+	len -= 2;
+    dst[len++] = 0;
+    dst[len++] = 1;
+    return len;
+}
+
+/**
+ * Instruction set used by the kernels, GWAVIConvert::SIMD_*.
+ */
+int GWAVIConvert::GetSimd()
+{
+    return simd;
+}
+
+/**
+ * Limit the kernels to an instruction set (for benchmarks and testing), it is
+ * capped to what the CPU supports.
+ *
+ * @return the level in use.
+ */
+int GWAVIConvert::SetSimd(int level)
+{
+    int max = detected_simd();
+
+    simd = level < max ? level : max;
+    return simd;
+}
@@ -0,0 +1,103 @@
+/*
+ * GWAVIConvert.h
+ *
+ *  Created on: 16 окт. 2026 г.
+ */
+
+#ifndef GWAVICONVERT_H_
+#define GWAVICONVERT_H_
+
+#include <stddef.h>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Pixel conversion and encoding of raw frames into the layout stored in the
+ * AVI file. Kernels use SSSE3 or AVX2 when the CPU has them and plain C
+ * otherwise.
+ */
+class GWAVIConvert {
+public:
+    enum {
+	PIX_RGB24 = 0, /* R, G, B */
+	PIX_BGR24, /* B, G, R */
+	PIX_RGBA, /* R, G, B, A */
+	PIX_BGRA, /* B, G, R, A */
+	PIX_PAL8, /* palette index */
+    };
+
+    enum {
+	YUV_YUY2 = 0, /* packed 4:2:2, Y0 U Y1 V */
+	YUV_I420, /* planar 4:2:0, Y, U, V */
+	YUV_YV12, /* planar 4:2:0, Y, V, U */
+	YUV_NV12, /* Y plane, interleaved U V plane */
+    };
+
+    enum {
+	SIMD_NONE = 0,
+	SIMD_SSSE3,
+	SIMD_AVX2,
+    };
+
+    /**
+     * Worker threads converting the bands of rows of a frame, started once
+     * and kept for all frames. The calling thread converts a band too, so
+     * a pool of n threads starts n - 1.
+     */
+    class Pool {
+    public:
+	Pool(unsigned int threads);
+	virtual ~Pool();
+
+	unsigned int Size()
+	{
+	    return size;
+	}
+	void Run(unsigned int jobs, const std::function<void(unsigned int)> &fn);
+
+    private:
+	unsigned int size;
+	std::vector<std::thread> workers;
+	std::mutex run_mutex; /* one Run() at a time */
+	std::mutex mutex;
+	std::condition_variable work_cv;
+	std::condition_variable done_cv;
+	const std::function<void(unsigned int)> *job;
+	unsigned int jobs;
+	unsigned int next_job;
+	unsigned int pending;
+	bool stop;
+
+	void worker();
+	void shutdown();
+    };
+
+    static unsigned int PixelSize(int format);
+    static size_t DibStride(unsigned int width, unsigned int bpp);
+    static int ToDib(const unsigned char *src, size_t stride, int format, unsigned int width, unsigned int height,
+	    unsigned char *dst, unsigned int bpp, unsigned int threads = 1);
+    static int ToDib(const unsigned char *src, size_t stride, int format, unsigned int width, unsigned int height,
+	    unsigned char *dst, unsigned int bpp, Pool *pool);
+
+    static int YuvFormat(const char *fourcc);
+    static unsigned int YuvBpp(int yuv);
+    static size_t YuvSize(int yuv, unsigned int width, unsigned int height);
+    static int ToYuv(const unsigned char *src, size_t stride, int format, unsigned int width, unsigned int height,
+	    unsigned char *dst, int yuv, unsigned int threads = 1);
+    static int ToYuv(const unsigned char *src, size_t stride, int format, unsigned int width, unsigned int height,
+	    unsigned char *dst, int yuv, Pool *pool);
+
+    static size_t Rle8Bound(unsigned int width, unsigned int height);
+    static size_t ToRle8(const unsigned char *src, size_t stride, const unsigned char *prev, unsigned int width,
+	    unsigned int height, unsigned char *dst, unsigned int threads = 1);
+    static size_t ToRle8(const unsigned char *src, size_t stride, const unsigned char *prev, unsigned int width,
+	    unsigned int height, unsigned char *dst, Pool *pool);
+
+    static int GetSimd();
+    static int SetSimd(int level);
+};
+
+#endif /* GWAVICONVERT_H_ */
@@ -0,0 +1,279 @@
+/*
+ * GWAVIIndex.cpp
+ *
+ *  Created on: 16 окт. 2026 г.
+ */
+
+#include "GWAVIIndex.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <system_error>
+
+#define SEGMENT_SIZE 65536
+#define ENTRY_MAX_SIZE 32 /* worst case of an encoded entry */
+
+static inline unsigned char *put_varint(unsigned char *p, uint64_t n)
+{
+    while (n >= 0x80) {
+	*p++ = (unsigned char) (n | 0x80);
+	n >>= 7;
+    }
+    *p++ = (unsigned char) n;
+    return p;
+}
+
+static inline const unsigned char *get_varint(const unsigned char *p, uint64_t *n)
+{
+    uint64_t v = 0;
+    int shift = 0;
+
+    while (*p & 0x80) {
+	v |= (uint64_t) (*p++ & 0x7f) << shift;
+	shift += 7;
+    }
+    *n = v | ((uint64_t) *p++ << shift);
+    return p;
+}
+
+static inline uint64_t zigzag(int64_t n)
+{
+    return ((uint64_t) n << 1) ^ (uint64_t) (n >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t n)
+{
+    return (int64_t) (n >> 1) ^ -(int64_t) (n & 1);
+}
+
+GWAVIIndex::GWAVIIndex()
+{
+    count = 0;
+    ram_budget = 0;
+    ram_sealed = 0;
+    spill_next = 0;
+    spill_file = NULL;
+    next_offset = 0;
+    cur_segment = 0;
+    cur_entry = 0;
+    cur_pos = 0;
+    cur_data = NULL;
+    scratch = NULL;
+    cur_next_offset = 0;
+}
+
+GWAVIIndex::~GWAVIIndex()
+{
+    Clear();
+}
+
+/**
+ * Limit the memory used by sealed segments, 0 keeps everything in RAM.
+ */
+void GWAVIIndex::SetRamBudget(size_t bytes)
+{
+    ram_budget = bytes;
+}
+
+void GWAVIIndex::Clear()
+{
+    size_t i;
+
+    for (i = 0; i < segments.size(); i++)
+	delete[] segments[i].data;
+    segments.clear();
+    delete[] scratch;
+    scratch = NULL;
+    if (spill_file) {
+	fclose(spill_file);
+	spill_file = NULL;
+    }
+    count = 0;
+    ram_sealed = 0;
+    spill_next = 0;
+    cur_data = NULL;
+}
+
+size_t GWAVIIndex::RamUsage() const
+{
+    return (segments.size() - spill_next) * SEGMENT_SIZE + segments.capacity() * sizeof(segment_t);
+}
+
+void GWAVIIndex::new_segment(uint64_t offset)
+{
+    segment_t s;
+
+    s.first = count;
+    s.count = 0;
+    s.offset = offset;
+    s.data = new unsigned char[SEGMENT_SIZE];
+    s.len = 0;
+    s.spill_pos = -1;
+    segments.push_back(s);
+
+    next_offset = offset;
+    last_size.assign(last_size.size(), 0);
+}
+
+void GWAVIIndex::seal_segment()
+{
+    ram_sealed += SEGMENT_SIZE;
+    if (ram_budget && ram_sealed > ram_budget)
+	spill();
+}
+
+/**
+ * Move the oldest sealed segments to the temporary file until the sealed
+ * segments kept in RAM fit the budget again.
+ */
+void GWAVIIndex::spill()
+{
+    segment_t *s;
+    ssize_t r;
+
+    if (!spill_file) {
+	spill_file = tmpfile();
+	if (!spill_file)
+	    throw std::system_error(errno, std::generic_category(), "index spill file");
+    }
+
+    while (ram_sealed > ram_budget && spill_next + 1 < segments.size()) {
+	s = &segments[spill_next];
+	s->spill_pos = lseek(fileno(spill_file), 0, SEEK_END);
+	r = pwrite(fileno(spill_file), s->data, s->len, s->spill_pos);
+	if (r != (ssize_t) s->len)
+	    throw std::system_error(r < 0 ? errno : ENOSPC, std::generic_category(), "index spill file");
+	delete[] s->data;
+	s->data = NULL;
+	ram_sealed -= SEGMENT_SIZE;
+	spill_next++;
+    }
+}
+
+/**
+ * Append an entry. Entries must be added in file order.
+ */
+void GWAVIIndex::Add(const gwavi_index_entry_t *entry)
+{
+    segment_t *s;
+    unsigned char *p;
+    uint64_t gap;
+
+    if (segments.empty() || segments.back().len + ENTRY_MAX_SIZE > SEGMENT_SIZE) {
+	if (!segments.empty())
+	    seal_segment();
+	new_segment(entry->offset);
+    }
+    s = &segments.back();
+
+    if (entry->stream >= last_size.size())
+	last_size.resize(entry->stream + 1, 0);
+
+    gap = entry->offset - next_offset;
+    p = s->data + s->len;
+    p = put_varint(p, ((uint64_t) entry->stream << 2) | (entry->delta ? 2 : 0) | (gap ? 1 : 0));
+    p = put_varint(p, zigzag((int64_t) entry->size - (int64_t) last_size[entry->stream]));
+    if (gap)
+	p = put_varint(p, gap);
+    s->len = p - s->data;
+    s->count++;
+    count++;
+
+    last_size[entry->stream] = entry->size;
+    next_offset = entry->offset + 8 + entry->size;
+}
+
+void GWAVIIndex::load_segment(size_t n)
+{
+    segment_t *s = &segments[n];
+    ssize_t r;
+
+    cur_segment = n;
+    cur_pos = 0;
+    cur_next_offset = s->offset;
+    cur_last_size.assign(cur_last_size.size(), 0);
+
+    if (s->data) {
+	cur_data = s->data;
+	return;
+    }
+
+    if (!scratch)
+	scratch = new unsigned char[SEGMENT_SIZE];
+    r = pread(fileno(spill_file), scratch, s->len, s->spill_pos);
+    if (r != (ssize_t) s->len)
+	throw std::system_error(r < 0 ? errno : EIO, std::generic_category(), "index spill file");
+    cur_data = scratch;
+}
+
+/**
+ * Position the cursor on the entry number n.
+ */
+void GWAVIIndex::Seek(size_t n)
+{
+    gwavi_index_entry_t e;
+    size_t lo, hi, mid;
+
+    cur_entry = n;
+    cur_data = NULL;
+    if (n >= count)
+	return;
+
+    /* last segment with first <= n */
+    lo = 0;
+    hi = segments.size();
+    while (hi - lo > 1) {
+	mid = (lo + hi) / 2;
+	if (segments[mid].first <= n)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+    load_segment(lo);
+
+    cur_entry = segments[lo].first;
+    while (cur_entry < n)
+	Next(&e);
+}
+
+/**
+ * Read the entry under the cursor and advance it.
+ *
+ * @return 1 if an entry was read, 0 at the end of the index.
+ */
+int GWAVIIndex::Next(gwavi_index_entry_t *entry)
+{
+    const unsigned char *p;
+    uint64_t v, gap = 0;
+    int64_t size;
+    int has_gap;
+
+    if (cur_entry >= count)
+	return 0;
+    if (!cur_data)
+	load_segment(0);
+    else if (cur_entry >= segments[cur_segment].first + segments[cur_segment].count)
+	load_segment(cur_segment + 1);
+
+    p = cur_data + cur_pos;
+    p = get_varint(p, &v);
+    entry->stream = (unsigned int) (v >> 2);
+    entry->delta = (v & 2) != 0;
+    if (entry->stream >= cur_last_size.size())
+	cur_last_size.resize(entry->stream + 1, 0);
+    has_gap = v & 1;
+    p = get_varint(p, &v);
+    size = unzigzag(v);
+    if (has_gap)
+	p = get_varint(p, &gap);
+    entry->size = (unsigned int) (cur_last_size[entry->stream] + size);
+    entry->offset = cur_next_offset + gap;
+    cur_pos = p - cur_data;
+
+    cur_last_size[entry->stream] = entry->size;
+    cur_next_offset = entry->offset + 8 + entry->size;
+    cur_entry++;
+
+    return 1;
+}
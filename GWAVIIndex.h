@@ -0,0 +1,80 @@
+/*
+ * GWAVIIndex.h
+ *
+ *  Created on: 16 окт. 2026 г.
+ */
+
+#ifndef GWAVIINDEX_H_
+#define GWAVIINDEX_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Append only store of the chunk index. Entries are varint encoded (stream
+ * number and key frame flag, size delta against the previous chunk of the
+ * same stream and the gap from the end of the previous chunk) into fixed size
+ * segments, so adding an entry never moves the existing ones. Sealed segments
+ * above the RAM budget are spilled to a temporary file.
+ */
+class GWAVIIndex {
+public:
+    struct gwavi_index_entry_t {
+	uint64_t offset; /* file position of the chunk header */
+	unsigned int size; /* chunk payload size, with padding */
+	unsigned int stream;
+	bool delta; /* not a key frame */
+    };
+
+    GWAVIIndex();
+    virtual ~GWAVIIndex();
+
+    void SetRamBudget(size_t bytes);
+    void Add(const gwavi_index_entry_t *entry);
+    size_t Count() const
+    {
+	return count;
+    }
+    size_t RamUsage() const;
+
+    void Seek(size_t n);
+    int Next(gwavi_index_entry_t *entry);
+    void Clear();
+
+private:
+    struct segment_t {
+	size_t first; /* number of the first entry */
+	size_t count;
+	uint64_t offset; /* position of the first chunk */
+	unsigned char *data; /* NULL once spilled */
+	unsigned int len;
+	off_t spill_pos;
+    };
+    std::vector<segment_t> segments;
+    size_t count;
+    size_t ram_budget;
+    size_t ram_sealed;
+    size_t spill_next; /* first sealed segment still in RAM */
+    FILE *spill_file;
+
+    /* encoder state */
+    uint64_t next_offset;
+    std::vector<unsigned int> last_size;
+
+    /* cursor state */
+    size_t cur_segment;
+    size_t cur_entry;
+    unsigned int cur_pos;
+    const unsigned char *cur_data;
+    unsigned char *scratch;
+    uint64_t cur_next_offset;
+    std::vector<unsigned int> cur_last_size;
+
+    void new_segment(uint64_t offset);
+    void seal_segment();
+    void spill();
+    void load_segment(size_t n);
+};
+
+#endif /* GWAVIINDEX_H_ */
@@ -0,0 +1,174 @@
+/*
+ * GWAVIInterleave.cpp
+ *
+ *  Created on: 16 окт. 2026 г.
+ */
+
+#include "GWAVIInterleave.h"
+
+#include <string.h>
+
+using namespace std;
+
+static void release_array(unsigned char *data, size_t /* len */, void * /* opaque */)
+{
+    delete[] data;
+}
+
+/**
+ * @param period_us Length of an audio chunk.
+ * @param max_bytes Frames held back at most, beyond that the earliest one
+ * goes out even if a stream is behind.
+ */
+GWAVIInterleave::GWAVIInterleave(unsigned int period_us, size_t max_bytes)
+{
+    period = period_us;
+    this->max_bytes = max_bytes;
+    bytes = 0;
+}
+
+GWAVIInterleave::~GWAVIInterleave()
+{
+    for (stream_t &s : streams)
+	for (chunk_t &c : s.chunks)
+	    GWAVIQueue::Release(&c.frame);
+}
+
+/**
+ * Add the next stream, a frame lasts scale / rate seconds.
+ */
+void GWAVIInterleave::AddVideoStream(unsigned int scale, unsigned int rate)
+{
+    stream_t s;
+
+    s.audio = false;
+    s.scale = scale ? scale : 1;
+    s.rate = rate ? rate : 1;
+    s.bytes_per_second = 0;
+    s.chunk_size = 0;
+    s.count = 0;
+    streams.push_back(s);
+}
+
+/**
+ * Add the next stream, audio is cut into chunks of one period rounded down
+ * to whole blocks.
+ */
+void GWAVIInterleave::AddAudioStream(unsigned int bytes_per_second, unsigned int block_align)
+{
+    stream_t s;
+
+    if (block_align == 0)
+	block_align = 1;
+    s.audio = true;
+    s.scale = 0;
+    s.rate = 0;
+    s.bytes_per_second = bytes_per_second ? bytes_per_second : 1;
+    s.chunk_size = (uint64_t) period * s.bytes_per_second / 1000000 / block_align * block_align;
+    if (s.chunk_size < block_align)
+	s.chunk_size = block_align;
+    s.count = 0;
+    streams.push_back(s);
+}
+
+/*
+ * Time of the next chunk of the stream, no later chunk can be earlier.
+ */
+uint64_t GWAVIInterleave::next_time(const stream_t *s) const
+{
+    if (s->audio)
+	return s->count * 1000000 / s->bytes_per_second;
+    return s->count * s->scale * 1000000 / s->rate;
+}
+
+/*
+ * Turn buffered audio into chunks, all of it including a short last chunk
+ * when all is set.
+ */
+void GWAVIInterleave::cut(stream_t *s, unsigned int stream, bool all)
+{
+    size_t off = 0, n;
+    chunk_t c;
+
+    while (s->partial.size() - off >= s->chunk_size || (all && off < s->partial.size())) {
+	n = s->partial.size() - off;
+	if (n > s->chunk_size)
+	    n = s->chunk_size;
+	c.time = next_time(s);
+	c.frame.stream = stream;
+	c.frame.data = new unsigned char[n];
+	c.frame.len = n;
+	c.frame.release = release_array;
+	c.frame.opaque = NULL;
+	c.frame.delta = false;
+	memcpy(c.frame.data, s->partial.data() + off, n);
+	s->chunks.push_back(c);
+	s->count += n;
+	off += n;
+    }
+    s->partial.erase(s->partial.begin(), s->partial.begin() + off);
+}
+
+/**
+ * Take a frame. A borrowed buffer is copied, audio is always copied and
+ * released right away.
+ */
+void GWAVIInterleave::Push(gwavi_frame_t *frame)
+{
+    stream_t *s = &streams[frame->stream];
+    chunk_t c;
+
+    bytes += frame->len;
+    if (s->audio) {
+	s->partial.insert(s->partial.end(), frame->data, frame->data + frame->len);
+	GWAVIQueue::Release(frame);
+	cut(s, frame->stream, false);
+	return;
+    }
+
+    c.time = next_time(s);
+    c.frame = *frame;
+    if (!c.frame.release) {
+	c.frame.data = new unsigned char[frame->len];
+	memcpy(c.frame.data, frame->data, frame->len);
+	c.frame.release = release_array;
+	c.frame.opaque = NULL;
+    }
+    s->chunks.push_back(c);
+    s->count++;
+}
+
+/**
+ * Get the earliest frame if it may be written now.
+ *
+ * @param flush Hand out everything, at the end of the file.
+ *
+ * @return false if there is nothing to write yet.
+ */
+bool GWAVIInterleave::Pop(gwavi_frame_t *frame, bool flush)
+{
+    stream_t *first = NULL;
+    size_t i;
+
+    if (flush)
+	for (i = 0; i < streams.size(); i++)
+	    if (streams[i].audio)
+		cut(&streams[i], i, true);
+
+    for (stream_t &s : streams)
+	if (!s.chunks.empty() && (!first || s.chunks.front().time < first->chunks.front().time))
+	    first = &s;
+    if (!first)
+	return false;
+
+    /* a stream with nothing buffered may still deliver an earlier chunk */
+    if (!flush && bytes <= max_bytes)
+	for (stream_t &s : streams)
+	    if (s.chunks.empty() && next_time(&s) < first->chunks.front().time)
+		return false;
+
+    *frame = first->chunks.front().frame;
+    first->chunks.pop_front();
+    bytes -= frame->len;
+    return true;
+}
@@ -0,0 +1,65 @@
+/*
+ * GWAVIInterleave.h
+ *
+ *  Created on: 16 окт. 2026 г.
+ */
+
+#ifndef GWAVIINTERLEAVE_H_
+#define GWAVIINTERLEAVE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <vector>
+
+#include "GWAVIQueue.h"
+
+/**
+ * Holds frames back and hands them out in presentation time order, so
+ * that audio delivered in bursts ends up next to the video it belongs to.
+ * Audio is cut into chunks of one interleave period. A chunk goes out once
+ * no other stream can still deliver an earlier one, or when more than
+ * max_bytes are held back.
+ */
+class GWAVIInterleave {
+public:
+    typedef GWAVIQueue::gwavi_frame_t gwavi_frame_t;
+
+    GWAVIInterleave(unsigned int period_us, size_t max_bytes);
+    virtual ~GWAVIInterleave();
+
+    void AddVideoStream(unsigned int scale, unsigned int rate);
+    void AddAudioStream(unsigned int bytes_per_second, unsigned int block_align);
+    void Push(gwavi_frame_t *frame);
+    bool Pop(gwavi_frame_t *frame, bool flush);
+    size_t Buffered() const
+    {
+	return bytes;
+    }
+
+private:
+    struct chunk_t {
+	uint64_t time; /* us */
+	gwavi_frame_t frame;
+    };
+    struct stream_t {
+	bool audio;
+	unsigned int scale; /* video, frame duration scale / rate s */
+	unsigned int rate;
+	unsigned int bytes_per_second; /* audio */
+	size_t chunk_size;
+	uint64_t count; /* frames, or audio bytes cut into chunks */
+	std::vector<unsigned char> partial; /* audio not filling a chunk yet */
+	std::deque<chunk_t> chunks;
+    };
+
+    std::vector<stream_t> streams;
+    unsigned int period;
+    size_t max_bytes;
+    size_t bytes;
+
+    uint64_t next_time(const stream_t *s) const;
+    void cut(stream_t *s, unsigned int stream, bool all);
+};
+
+#endif /* GWAVIINTERLEAVE_H_ */
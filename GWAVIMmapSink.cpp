@@ -0,0 +1,185 @@
+/*
+ * GWAVIMmapSink.cpp
+ *
+ *  Created on: 16 окт. 2026 г.
+ */
+
+#include "GWAVISink.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <system_error>
+
+using namespace std;
+
+GWAVIMmapSink::GWAVIMmapSink(const char *filename)
+{
+    map = NULL;
+    mapped = 0;
+    populated = 0;
+    size = 0;
+    pos = 0;
+    fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+	throw system_error(errno, generic_category(), filename);
+}
+
+GWAVIMmapSink::~GWAVIMmapSink()
+{
+    if (fd >= 0) {
+	try {
+	    Close();
+	} catch (...) {
+	}
+    }
+}
+
+/**
+ * Extend the file and the mapping to cover end. The blocks are allocated
+ * before they are mapped, a store to a hole the disk has no room for would
+ * kill the process.
+ */
+void GWAVIMmapSink::grow(uint64_t end)
+{
+    uint64_t n, step;
+    void *p;
+
+    if (end <= mapped)
+	return;
+
+    step = prealloc_increment > WINDOW ? prealloc_increment : (uint64_t) WINDOW;
+    n = mapped + step;
+    if (mapped == 0 && prealloc_initial > n)
+	n = prealloc_initial;
+    if (n < end)
+	n = (end + step - 1) / step * step;
+
+    if (fallocate(fd, 0, mapped, n - mapped) < 0) {
+	/* no fallocate() on this filesystem, the file gets holes */
+	if (errno != EOPNOTSUPP || ftruncate(fd, n) < 0)
+	    throw system_error(errno, generic_category(), "fallocate");
+    }
+
+    if (map)
+	p = mremap(map, mapped, n, MREMAP_MAYMOVE);
+    else
+	p = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+	throw system_error(errno, generic_category(), "mmap");
+    map = (unsigned char *) p;
+    mapped = n;
+}
+
+/**
+ * Fault in the pages up to a step past end in one go, instead of one
+ * fault per page as the stores reach them.
+ */
+void GWAVIMmapSink::populate(uint64_t end)
+{
+    uint64_t n;
+
+    if (end <= populated)
+	return;
+    n = (end + POPULATE_STEP - 1) / POPULATE_STEP * POPULATE_STEP;
+    if (n > mapped)
+	n = mapped;
+#ifdef MADV_POPULATE_WRITE
+    (void) madvise(map + populated, n - populated, MADV_POPULATE_WRITE);
+#endif
+    populated = n;
+}
+
+void GWAVIMmapSink::Write(const void *buf, size_t len)
+{
+    PWrite(buf, len, pos);
+    pos += len;
+}
+
+void GWAVIMmapSink::PWrite(const void *buf, size_t len, uint64_t offset)
+{
+    /* filled in place through Map(), grow() could move it */
+    if (map && buf == map + offset && offset + len <= mapped) {
+	if (offset + len > size)
+	    size = offset + len;
+	return;
+    }
+    grow(offset + len);
+    populate(offset + len);
+    memcpy(map + offset, buf, len);
+    if (offset + len > size)
+	size = offset + len;
+}
+
+void GWAVIMmapSink::Seek(uint64_t offset)
+{
+    pos = offset;
+}
+
+uint64_t GWAVIMmapSink::Tell()
+{
+    return pos;
+}
+
+void GWAVIMmapSink::Sync()
+{
+    if (map && msync(map, size, MS_SYNC) < 0)
+	throw system_error(errno, generic_category(), "msync");
+}
+
+/**
+ * Read the range straight into the mapping.
+ */
+uint64_t GWAVIMmapSink::CopyFrom(int src, uint64_t offset, uint64_t len)
+{
+    ssize_t r;
+
+    grow(pos + len);
+    populate(pos + len);
+    while (len > 0) {
+	r = pread(src, map + pos, len, offset);
+	if (r < 0 && errno == EINTR)
+	    continue;
+	if (r < 0)
+	    throw system_error(errno, generic_category(), "pread");
+	if (r == 0)
+	    throw system_error(EIO, generic_category(), "pread past the end of the source");
+	offset += r;
+	len -= r;
+	pos += r;
+    }
+    if (pos > size)
+	size = pos;
+    return 0;
+}
+
+unsigned char *GWAVIMmapSink::Map(uint64_t offset, size_t len)
+{
+    grow(offset + len);
+    populate(offset + len);
+    return map + offset;
+}
+
+void GWAVIMmapSink::Close()
+{
+    int r;
+
+    if (fd < 0)
+	return;
+    if (map) {
+	munmap(map, mapped);
+	map = NULL;
+    }
+    if (ftruncate(fd, size) < 0) {
+	r = errno;
+	close(fd);
+	fd = -1;
+	throw system_error(r, generic_category(), "ftruncate");
+    }
+    r = close(fd);
+    fd = -1;
+    if (r < 0)
+	throw system_error(errno, generic_category(), "close");
+}
@@ -0,0 +1,364 @@
+/*
+ * GWAVIPipeline.cpp
+ *
+ *  Created on: 16 окт. 2026 г.
+ */
+
+#include "GWAVIPipeline.h"
+
+#include <stdio.h>
+#include <chrono>
+
+static inline uint64_t clock_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+	    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void account(std::atomic<unsigned long long> &frames, std::atomic<unsigned long long> &total,
+	std::atomic<unsigned long long> &max, uint64_t ns)
+{
+    unsigned long long m = max.load(std::memory_order_relaxed);
+
+    frames.fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(ns, std::memory_order_relaxed);
+    while (ns > m && !max.compare_exchange_weak(m, ns, std::memory_order_relaxed))
+	;
+}
+
+/**
+ * @param avi Output file, the pipeline adds all frames to it.
+ * @param threads Worker threads, 0 - one per CPU.
+ * @param max_inflight How far ahead of the next frame to write a frame may
+ * be submitted, 0 - 4 per thread.
+ */
+GWAVIPipeline::GWAVIPipeline(GWAVI *avi, unsigned int threads, unsigned int max_inflight)
+{
+    unsigned int i;
+
+    if (threads == 0)
+	threads = std::thread::hardware_concurrency();
+    if (threads == 0)
+	threads = 1;
+    if (max_inflight == 0)
+	max_inflight = 4 * threads;
+
+    this->avi = avi;
+    this->max_inflight = max_inflight;
+    mux.name = "write";
+    mux.fn = NULL;
+    mux.opaque = NULL;
+    mux.frames = 0;
+    mux.total_ns = 0;
+    mux.max_ns = 0;
+    next_worker = 0;
+    queued = 0;
+    sleeping = 0;
+    stop = false;
+    next = 0;
+    submitted = 0;
+    writing = false;
+    reorder_max = 0;
+    error = 0;
+
+    for (i = 0; i < threads; i++)
+	workers.push_back(new worker_t);
+    for (i = 0; i < threads; i++)
+	workers[i]->thread = std::thread(&GWAVIPipeline::worker_thread, this, i);
+}
+
+/**
+ * Stops the workers, frames not written yet are lost. Call Flush() first.
+ */
+GWAVIPipeline::~GWAVIPipeline()
+{
+    gwavi_job_t *job;
+    worker_t *w;
+
+    {
+	std::lock_guard<std::mutex> lock(pool_mutex);
+	stop = true;
+    }
+    pool_cv.notify_all();
+
+    for (size_t i = 0; i < workers.size(); i++)
+	workers[i]->thread.join();
+
+    while (!workers.empty()) {
+	w = workers.back();
+	workers.pop_back();
+	while (!w->jobs.empty()) {
+	    job = w->jobs.front();
+	    w->jobs.pop_front();
+	    GWAVIQueue::gwavi_frame_t f = { job->stream, job->data, job->len, job->release, job->opaque, job->delta };
+	    GWAVIQueue::Release(&f);
+	    delete job;
+	}
+	delete w;
+    }
+    while (!ready.empty()) {
+	job = ready.begin()->second;
+	ready.erase(ready.begin());
+	GWAVIQueue::gwavi_frame_t f = { job->stream, job->data, job->len, job->release, job->opaque, job->delta };
+	GWAVIQueue::Release(&f);
+	delete job;
+    }
+    for (stage_t *s : stages)
+	delete s;
+}
+
+/**
+ * Append a transform stage. Stages run in the order they were added, all
+ * of them have to be added before the first Submit().
+ *
+ * @return 0 on success, -1 once frames were submitted.
+ */
+int GWAVIPipeline::AddStage(const char *name, gwavi_stage_t stage, void *opaque)
+{
+    stage_t *s;
+
+    {
+	std::lock_guard<std::mutex> lock(reorder_mutex);
+	if (submitted) {
+	    fputs("pipeline stages must be added before the first frame\n", stderr);
+	    return -1;
+	}
+    }
+
+    s = new stage_t;
+    s->name = name;
+    s->fn = stage;
+    s->opaque = opaque;
+    s->frames = 0;
+    s->total_ns = 0;
+    s->max_ns = 0;
+    stages.push_back(s);
+    return 0;
+}
+
+/**
+ * Queue a frame. The pipeline takes ownership of data when release is set,
+ * a borrowed buffer has to stay valid until Flush().
+ *
+ * @param seq Frame number, counting from 0 without gaps over all streams.
+ *
+ * @return 0 on success, -1 on error or if seq was submitted already.
+ */
+int GWAVIPipeline::Submit(unsigned long long seq, unsigned int stream, unsigned char *data, size_t len,
+	GWAVI::gwavi_release_t release, void *opaque)
+{
+    gwavi_job_t *job;
+    worker_t *w;
+
+    if (!data || stream >= avi->GetStreamCount()) {
+	GWAVIQueue::gwavi_frame_t f = { stream, data, len, release, opaque, false };
+	GWAVIQueue::Release(&f);
+	fputs("pipeline frame must have data and a stream of the file\n", stderr);
+	return -1;
+    }
+
+    {
+	std::unique_lock<std::mutex> lock(reorder_mutex);
+	/* backpressure, the next frame to write always gets in */
+	space_cv.wait(lock, [&] { return seq < next + max_inflight; });
+	if (seq < next || !inflight.insert(seq).second) {
+	    lock.unlock();
+	    GWAVIQueue::gwavi_frame_t f = { stream, data, len, release, opaque, false };
+	    GWAVIQueue::Release(&f);
+	    fprintf(stderr, "pipeline frame %llu was submitted already\n", seq);
+	    return -1;
+	}
+	submitted++;
+    }
+
+    job = new gwavi_job_t;
+    job->seq = seq;
+    job->stream = stream;
+    job->data = data;
+    job->len = len;
+    job->release = release;
+    job->opaque = opaque;
+    job->delta = false;
+
+    w = workers[next_worker++ % workers.size()];
+    {
+	/* counted with the queue, a frame is in queued as long as it is queued */
+	std::lock_guard<std::mutex> lock(w->mutex);
+	w->jobs.push_back(job);
+	queued++;
+    }
+    /* pairs with the fence after sleeping is raised */
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping) {
+	std::lock_guard<std::mutex> lock(pool_mutex);
+	pool_cv.notify_one();
+    }
+    return 0;
+}
+
+/**
+ * Wait until every submitted frame is written.
+ *
+ * @return 0 on success, -1 if a stage or a write failed since the last
+ * Flush().
+ */
+int GWAVIPipeline::Flush()
+{
+    std::unique_lock<std::mutex> lock(reorder_mutex);
+    int ret;
+
+    space_cv.wait(lock, [&] { return next >= submitted && !writing; });
+    ret = error ? -1 : 0;
+    error = 0;
+    return ret;
+}
+
+/**
+ * Number of entries GetStageStats() reports: the stages plus "write".
+ */
+unsigned int GWAVIPipeline::GetStageCount()
+{
+    return stages.size() + 1;
+}
+
+void GWAVIPipeline::GetStageStats(unsigned int stage, gwavi_stage_stats_t *stats)
+{
+    stage_t *s = stage < stages.size() ? stages[stage] : &mux;
+
+    stats->name = s->name.c_str();
+    stats->frames = s->frames;
+    stats->total_ns = s->total_ns;
+    stats->max_ns = s->max_ns;
+}
+
+/**
+ * Most frames that waited in the reorder buffer at once.
+ */
+unsigned int GWAVIPipeline::GetReorderMax()
+{
+    std::lock_guard<std::mutex> lock(reorder_mutex);
+
+    return reorder_max;
+}
+
+/**
+ * Replace the data of a frame from a stage, the old buffer is released.
+ */
+void GWAVIPipeline::SetData(gwavi_job_t *job, unsigned char *data, size_t len, GWAVI::gwavi_release_t release,
+	void *opaque)
+{
+    GWAVIQueue::gwavi_frame_t f = { job->stream, job->data, job->len, job->release, job->opaque, job->delta };
+
+    GWAVIQueue::Release(&f);
+    job->data = data;
+    job->len = len;
+    job->release = release;
+    job->opaque = opaque;
+}
+
+/*
+ * Oldest frame of the own queue first, then steal the oldest frame of
+ * another worker. Taking frames in order keeps the reorder buffer short.
+ * Only the lock of the queue looked at is held.
+ */
+GWAVIPipeline::gwavi_job_t *GWAVIPipeline::take(unsigned int id)
+{
+    gwavi_job_t *job = NULL;
+    worker_t *w;
+    size_t i;
+
+    for (i = 0; i < workers.size() && !job; i++) {
+	w = workers[(id + i) % workers.size()];
+	std::lock_guard<std::mutex> lock(w->mutex);
+	if (w->jobs.empty())
+	    continue;
+	job = w->jobs.front();
+	w->jobs.pop_front();
+	queued--;
+    }
+    return job;
+}
+
+void GWAVIPipeline::worker_thread(unsigned int id)
+{
+    gwavi_job_t *job;
+
+    while (!stop) {
+	job = take(id);
+	if (job) {
+	    run_stages(job);
+	    complete(job);
+	    continue;
+	}
+
+	/*
+	 * Look at queued again once Submit() can see sleeping, a frame
+	 * queued before is found now, one queued after is notified. A
+	 * frame stolen in between only costs another take().
+	 */
+	std::unique_lock<std::mutex> lock(pool_mutex);
+	sleeping++;
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	while (!stop && queued == 0)
+	    pool_cv.wait(lock);
+	sleeping--;
+    }
+}
+
+void GWAVIPipeline::run_stages(gwavi_job_t *job)
+{
+    uint64_t t0, t1;
+
+    for (stage_t *s : stages) {
+	t0 = clock_ns();
+	if (s->fn(job, s->opaque) < 0) {
+	    GWAVIPipeline::SetData(job, NULL, 0, NULL, NULL);
+	    return;
+	}
+	t1 = clock_ns();
+	account(s->frames, s->total_ns, s->max_ns, t1 - t0);
+    }
+}
+
+/*
+ * Put a finished frame into the reorder buffer. The worker that completes
+ * the next frame to write writes it and all following ready ones, the
+ * others go back to work.
+ */
+void GWAVIPipeline::complete(gwavi_job_t *job)
+{
+    std::unique_lock<std::mutex> lock(reorder_mutex);
+    uint64_t t0;
+    int r;
+
+    ready[job->seq] = job;
+    if (ready.size() > reorder_max)
+	reorder_max = ready.size();
+    if (writing)
+	return;
+
+    writing = true;
+    while (!ready.empty() && ready.begin()->first == next) {
+	job = ready.begin()->second;
+	ready.erase(ready.begin());
+	lock.unlock();
+
+	if (!job->data) {
+	    r = -1;
+	} else {
+	    t0 = clock_ns();
+	    r = avi->AddFrame(job->stream, job->data, job->len, !job->delta, job->release, job->opaque);
+	    account(mux.frames, mux.total_ns, mux.max_ns, clock_ns() - t0);
+	}
+	delete job;
+
+	lock.lock();
+	if (r < 0)
+	    error = -1;
+	inflight.erase(next);
+	next++;
+	space_cv.notify_all();
+    }
+    writing = false;
+    space_cv.notify_all();
+}
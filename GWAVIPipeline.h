@@ -0,0 +1,119 @@
+/*
+ * GWAVIPipeline.h
+ *
+ *  Created on: 16 окт. 2026 г.
+ */
+
+#ifndef GWAVIPIPELINE_H_
+#define GWAVIPIPELINE_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "GWAVI.h"
+
+/**
+ * Runs CPU work on frames (conversion, compression, checksums) on a pool of
+ * threads and adds the results to a GWAVI in submission order.
+ *
+ * Frames are numbered by the caller from 0 without gaps. Every frame goes
+ * through all stages on one worker, idle workers steal queued frames from
+ * the others. Finished frames wait in a reorder buffer until all earlier
+ * ones are written. Submit() blocks while the frame is max_inflight or more
+ * ahead of the next one to write.
+ */
+class GWAVIPipeline {
+public:
+    struct gwavi_job_t {
+	unsigned long long seq;
+	unsigned int stream; /* GWAVI::AddFrame() stream */
+	unsigned char *data;
+	size_t len;
+	GWAVI::gwavi_release_t release; /* NULL if borrowed */
+	void *opaque;
+	bool delta; /* not a key frame, set by a stage that encodes one */
+    };
+
+    /**
+     * A transform stage. It may replace the frame data with SetData(), the
+     * frame is dropped when it returns -1.
+     */
+    typedef int (*gwavi_stage_t)(gwavi_job_t *job, void *opaque);
+
+    typedef struct {
+	const char *name;
+	unsigned long long frames;
+	unsigned long long total_ns;
+	unsigned long long max_ns;
+    } gwavi_stage_stats_t;
+
+    GWAVIPipeline(GWAVI *avi, unsigned int threads, unsigned int max_inflight);
+    virtual ~GWAVIPipeline();
+
+    int AddStage(const char *name, gwavi_stage_t stage, void *opaque);
+    int Submit(unsigned long long seq, unsigned int stream, unsigned char *data, size_t len,
+	    GWAVI::gwavi_release_t release, void *opaque);
+    int Flush();
+    unsigned int GetStageCount();
+    void GetStageStats(unsigned int stage, gwavi_stage_stats_t *stats);
+    unsigned int GetReorderMax();
+
+    static void SetData(gwavi_job_t *job, unsigned char *data, size_t len, GWAVI::gwavi_release_t release,
+	    void *opaque);
+
+private:
+    struct stage_t {
+	std::string name;
+	gwavi_stage_t fn;
+	void *opaque;
+	std::atomic<unsigned long long> frames;
+	std::atomic<unsigned long long> total_ns;
+	std::atomic<unsigned long long> max_ns;
+    };
+
+    struct worker_t {
+	std::mutex mutex;
+	std::deque<gwavi_job_t *> jobs;
+	std::thread thread;
+    };
+
+    GWAVI *avi;
+    unsigned int max_inflight;
+    std::vector<stage_t *> stages;
+    stage_t mux; /* GWAVI::Add*Frame() */
+    std::vector<worker_t *> workers;
+    std::atomic<unsigned int> next_worker;
+
+    /* idle workers, pool_mutex only guards the sleep on pool_cv */
+    std::mutex pool_mutex;
+    std::condition_variable pool_cv;
+    std::atomic<size_t> queued; /* frames in the worker queues */
+    std::atomic<unsigned int> sleeping; /* workers on pool_cv */
+    std::atomic<bool> stop;
+
+    /* reorder buffer, next is the next frame to write */
+    std::mutex reorder_mutex;
+    std::condition_variable space_cv;
+    std::map<unsigned long long, gwavi_job_t *> ready;
+    std::set<unsigned long long> inflight; /* submitted, not written yet */
+    unsigned long long next;
+    unsigned long long submitted;
+    bool writing;
+    unsigned int reorder_max;
+    int error;
+
+    void worker_thread(unsigned int id);
+    gwavi_job_t *take(unsigned int id);
+    void run_stages(gwavi_job_t *job);
+    void complete(gwavi_job_t *job);
+};
+
+#endif /* GWAVIPIPELINE_H_ */
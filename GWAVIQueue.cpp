@@ -0,0 +1,94 @@
+/*
+ * GWAVIQueue.cpp
+ *
+ *  Created on: 16 окт. 2026 г.
+ */
+
+#include "GWAVIQueue.h"
+
+#include <stdint.h>
+
+using namespace std;
+
+/**
+ * @param capacity Number of frames, rounded up to a power of two.
+ */
+GWAVIQueue::GWAVIQueue(size_t capacity)
+{
+    size_t i, n = 2;
+
+    while (n < capacity)
+	n <<= 1;
+    mask = n - 1;
+    slots = new slot_t[n];
+    for (i = 0; i < n; i++)
+	slots[i].seq.store(i, memory_order_relaxed);
+    head.store(0, memory_order_relaxed);
+    tail.store(0, memory_order_relaxed);
+}
+
+GWAVIQueue::~GWAVIQueue()
+{
+    gwavi_frame_t f;
+
+    while (Pop(&f))
+	Release(&f);
+    delete[] slots;
+}
+
+/**
+ * @return false if the queue is full.
+ */
+bool GWAVIQueue::Push(const gwavi_frame_t *frame)
+{
+    size_t pos = tail.load(memory_order_relaxed);
+    slot_t *slot;
+    intptr_t diff;
+
+    for (;;) {
+	slot = &slots[pos & mask];
+	diff = (intptr_t) slot->seq.load(memory_order_acquire) - (intptr_t) pos;
+	if (diff == 0) {
+	    if (tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+		break;
+	} else if (diff < 0)
+	    return false;
+	else
+	    pos = tail.load(memory_order_relaxed);
+    }
+
+    slot->frame = *frame;
+    slot->seq.store(pos + 1, memory_order_release);
+    return true;
+}
+
+/**
+ * @return false if the queue is empty.
+ */
+bool GWAVIQueue::Pop(gwavi_frame_t *frame)
+{
+    size_t pos = head.load(memory_order_relaxed);
+    slot_t *slot;
+    intptr_t diff;
+
+    for (;;) {
+	slot = &slots[pos & mask];
+	diff = (intptr_t) slot->seq.load(memory_order_acquire) - (intptr_t) (pos + 1);
+	if (diff == 0) {
+	    if (head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+		break;
+	} else if (diff < 0)
+	    return false;
+	else
+	    pos = head.load(memory_order_relaxed);
+    }
+
+    *frame = slot->frame;
+    slot->seq.store(pos + mask + 1, memory_order_release);
+    return true;
+}
+
+size_t GWAVIQueue::Size() const
+{
+    return tail.load(memory_order_relaxed) - head.load(memory_order_relaxed);
+}
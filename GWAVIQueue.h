@@ -0,0 +1,60 @@
+/*
+ * GWAVIQueue.h
+ *
+ *  Created on: 16 окт. 2026 г.
+ */
+
+#ifndef GWAVIQUEUE_H_
+#define GWAVIQUEUE_H_
+
+#include <stddef.h>
+#include <atomic>
+
+/**
+ * Bounded lock-free queue of frames waiting for the writer thread. Every
+ * slot carries a sequence number (D. Vyukov's bounded MPMC queue), so a
+ * producer may also pop to drop the oldest frame.
+ */
+class GWAVIQueue {
+public:
+    typedef void (*gwavi_release_t)(unsigned char *data, size_t len, void *opaque);
+
+    struct gwavi_frame_t {
+	unsigned int stream;
+	unsigned char *data;
+	size_t len;
+	gwavi_release_t release; /* called once data is handed to the kernel or dropped, NULL if borrowed */
+	void *opaque;
+	bool delta; /* not a key frame */
+    };
+
+    static void Release(gwavi_frame_t *frame)
+    {
+	if (frame->release)
+	    frame->release(frame->data, frame->len, frame->opaque);
+	frame->release = NULL;
+    }
+
+    GWAVIQueue(size_t capacity);
+    virtual ~GWAVIQueue();
+
+    bool Push(const gwavi_frame_t *frame);
+    bool Pop(gwavi_frame_t *frame);
+    size_t Size() const;
+    size_t Capacity() const
+    {
+	return mask + 1;
+    }
+
+private:
+    struct slot_t {
+	std::atomic<size_t> seq;
+	gwavi_frame_t frame;
+    };
+    slot_t *slots;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+};
+
+#endif /* GWAVIQUEUE_H_ */
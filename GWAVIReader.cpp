@@ -0,0 +1,510 @@
+/*
+ * GWAVIReader.cpp
+ *
+ *  Created on: 16 окт. 2026 г.
+ */
+
+#include "GWAVIReader.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <system_error>
+
+#define AVIIF_KEYFRAME 0x10
+#define AVI_INDEX_OF_INDEXES 0x00
+#define AVI_INDEX_OF_CHUNKS 0x01
+
+using namespace std;
+
+static inline unsigned int get_int(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24;
+}
+
+static inline unsigned int get_short(const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static inline uint64_t get_int64(const unsigned char *p)
+{
+    return get_int(p) | (uint64_t) get_int(p + 4) << 32;
+}
+
+/*
+ * Stream number of a ##dc, ##db or ##wb chunk id, -1 for other chunks.
+ */
+static int stream_number(const unsigned char *id)
+{
+    if (id[0] < '0' || id[0] > '9' || id[1] < '0' || id[1] > '9')
+	return -1;
+    if (memcmp(id + 2, "dc", 2) && memcmp(id + 2, "db", 2) && memcmp(id + 2, "wb", 2))
+	return -1;
+    return (id[0] - '0') * 10 + id[1] - '0';
+}
+
+/**
+ * Map the file and load its index.
+ *
+ * @throw std::system_error if the file cannot be mapped or is not an AVI
+ * file.
+ */
+GWAVIReader::GWAVIReader(const char *filename)
+{
+    struct stat st;
+    uint64_t pos, end;
+    unsigned int i;
+    void *m;
+    int fd, err;
+
+    map = NULL;
+    size = 0;
+    total_frames = 0;
+    index_type = GWAVI_INDEX_SCAN;
+    movi = 0;
+    idx1 = 0;
+    idx1_size = 0;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+	throw system_error(errno, generic_category(), filename);
+    if (fstat(fd, &st) < 0) {
+	err = errno;
+	close(fd);
+	throw system_error(err, generic_category(), filename);
+    }
+    if (st.st_size < 12) {
+	close(fd);
+	throw system_error(EINVAL, generic_category(), "not an AVI file");
+    }
+    size = st.st_size;
+    m = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    err = errno;
+    close(fd);
+    if (m == MAP_FAILED)
+	throw system_error(err, generic_category(), "mmap");
+    map = (const unsigned char *) m;
+
+    try {
+	if (memcmp(map, "RIFF", 4) || memcmp(map + 8, "AVI ", 4))
+	    throw system_error(EINVAL, generic_category(), "not an AVI file");
+
+	/* RIFF 'AVI ' and the OpenDML RIFF 'AVIX' chunks after it */
+	for (pos = 0; pos + 12 <= size && !memcmp(map + pos, "RIFF", 4); pos = end) {
+	    end = chunk_end(pos, size);
+	    /* size 0: the file was not finalized */
+	    if (get_int(map + pos + 4) == 0)
+		end = size;
+	    parse_riff(pos + 12, end);
+	}
+	if (streams.empty())
+	    throw system_error(EINVAL, generic_category(), "AVI file without streams");
+
+	if (load_odml()) {
+	    index_type = GWAVI_INDEX_ODML;
+	} else if (load_idx1()) {
+	    index_type = GWAVI_INDEX_IDX1;
+	} else {
+	    index_type = GWAVI_INDEX_SCAN;
+	    for (i = 0; i + 1 < movi_lists.size(); i += 2)
+		scan_movi(movi_lists[i], movi_lists[i + 1]);
+	}
+	for (stream_t &s : streams) {
+	    s.info.frames = s.frames.size();
+	    build_keyframes(&s);
+	}
+    } catch (...) {
+	munmap((void *) map, size);
+	throw;
+    }
+}
+
+GWAVIReader::~GWAVIReader()
+{
+    munmap((void *) map, size);
+}
+
+unsigned int GWAVIReader::GetStreamCount()
+{
+    return streams.size();
+}
+
+/**
+ * @return 0 on success, -1 if there is no such stream.
+ */
+int GWAVIReader::GetStreamInfo(unsigned int stream, gwavi_stream_info_t *info)
+{
+    if (stream >= streams.size())
+	return -1;
+    *info = streams[stream].info;
+    return 0;
+}
+
+size_t GWAVIReader::GetFrameCount(unsigned int stream)
+{
+    if (stream >= streams.size())
+	return 0;
+    return streams[stream].frames.size();
+}
+
+/**
+ * Payload of a chunk, valid as long as the reader.
+ *
+ * @param len Set to the payload size.
+ *
+ * @return pointer into the mapped file, NULL if there is no such frame.
+ */
+const unsigned char *GWAVIReader::GetFrame(unsigned int stream, size_t frame, size_t *len)
+{
+    const entry_t *e;
+
+    if (stream >= streams.size() || frame >= streams[stream].frames.size())
+	return NULL;
+    e = &streams[stream].frames[frame];
+    *len = e->size;
+    return map + e->offset;
+}
+
+/**
+ * File offset of the payload of a chunk, 0 if there is no such frame.
+ */
+uint64_t GWAVIReader::GetFrameOffset(unsigned int stream, size_t frame)
+{
+    if (stream >= streams.size() || frame >= streams[stream].frames.size())
+	return 0;
+    return streams[stream].frames[frame].offset;
+}
+
+bool GWAVIReader::IsKeyframe(unsigned int stream, size_t frame)
+{
+    if (stream >= streams.size() || frame >= streams[stream].frames.size())
+	return false;
+    return streams[stream].frames[frame].flags & AVIIF_KEYFRAME;
+}
+
+/**
+ * Last key frame at or before frame, where decoding has to start to show
+ * it. A frame past the end is taken as the last one.
+ *
+ * @return the key frame number, -1 if there is none.
+ */
+long GWAVIReader::FindKeyframe(unsigned int stream, size_t frame)
+{
+    stream_t *s;
+    std::vector<uint32_t>::const_iterator k;
+
+    if (stream >= streams.size() || streams[stream].frames.empty())
+	return -1;
+    s = &streams[stream];
+    if (frame >= s->frames.size())
+	frame = s->frames.size() - 1;
+    if (s->all_keys)
+	return frame;
+
+    k = std::upper_bound(s->keyframes.begin(), s->keyframes.end(), frame);
+    if (k == s->keyframes.begin())
+	return -1;
+    return *(k - 1);
+}
+
+/**
+ * Key frame to start decoding from to show the video at the given time,
+ * frames last scale / rate seconds.
+ *
+ * @return the key frame number, -1 if there is none.
+ */
+long GWAVIReader::FindKeyframeAt(unsigned int stream, double seconds)
+{
+    const gwavi_stream_info_t *info;
+
+    if (stream >= streams.size())
+	return -1;
+    info = &streams[stream].info;
+    if (seconds < 0 || info->rate == 0)
+	seconds = 0;
+    else
+	seconds = seconds * info->rate / (info->scale ? info->scale : 1);
+    return FindKeyframe(stream, seconds < (double) SIZE_MAX ? (size_t) seconds : SIZE_MAX);
+}
+
+/**
+ * Where the frame table came from, GWAVI_INDEX_*.
+ */
+int GWAVIReader::GetIndexType()
+{
+    return index_type;
+}
+
+/**
+ * Video frames of the whole file by the main or OpenDML header.
+ */
+unsigned int GWAVIReader::GetTotalFrames()
+{
+    return total_frames;
+}
+
+/*
+ * Collect the key frame numbers for FindKeyframe(), 4 bytes per key frame.
+ * Streams of key frames only, like audio and intra only video, need none.
+ */
+void GWAVIReader::build_keyframes(stream_t *s)
+{
+    size_t i;
+
+    s->all_keys = true;
+    for (i = 0; i < s->frames.size() && s->all_keys; i++)
+	s->all_keys = s->frames[i].flags & AVIIF_KEYFRAME;
+    if (s->all_keys)
+	return;
+
+    for (i = 0; i < s->frames.size(); i++)
+	if (s->frames[i].flags & AVIIF_KEYFRAME)
+	    s->keyframes.push_back((uint32_t) i);
+    s->keyframes.shrink_to_fit();
+}
+
+/*
+ * End of the chunk at pos including its pad byte, cut at end.
+ */
+uint64_t GWAVIReader::chunk_end(uint64_t pos, uint64_t end)
+{
+    uint64_t n = get_int(map + pos + 4);
+
+    n = pos + 8 + n + (n & 1);
+    return n > end ? end : n;
+}
+
+void GWAVIReader::parse_riff(uint64_t pos, uint64_t end)
+{
+    uint64_t next;
+
+    while (pos + 8 <= end) {
+	next = chunk_end(pos, end);
+	if (!memcmp(map + pos, "LIST", 4) && pos + 12 <= end) {
+	    if (!memcmp(map + pos + 8, "hdrl", 4)) {
+		parse_hdrl(pos + 12, next);
+	    } else if (!memcmp(map + pos + 8, "movi", 4)) {
+		if (get_int(map + pos + 4) == 0)
+		    next = end;
+		if (!movi)
+		    movi = pos + 8;
+		movi_lists.push_back(pos + 12);
+		movi_lists.push_back(next);
+	    }
+	} else if (!memcmp(map + pos, "idx1", 4) && !idx1) {
+	    idx1 = pos + 8;
+	    idx1_size = next - idx1;
+	}
+	pos = next;
+    }
+}
+
+void GWAVIReader::parse_hdrl(uint64_t pos, uint64_t end)
+{
+    uint64_t next, p;
+
+    while (pos + 8 <= end) {
+	next = chunk_end(pos, end);
+	if (!memcmp(map + pos, "avih", 4) && next - pos >= 8 + 20) {
+	    if (!total_frames)
+		total_frames = get_int(map + pos + 8 + 16);
+	} else if (!memcmp(map + pos, "LIST", 4) && pos + 12 <= end) {
+	    if (!memcmp(map + pos + 8, "strl", 4)) {
+		parse_strl(pos + 12, next);
+	    } else if (!memcmp(map + pos + 8, "odml", 4)) {
+		for (p = pos + 12; p + 8 <= next; p = chunk_end(p, next))
+		    if (!memcmp(map + p, "dmlh", 4) && chunk_end(p, next) - p >= 8 + 4)
+			total_frames = get_int(map + p + 8);
+	    }
+	}
+	pos = next;
+    }
+}
+
+void GWAVIReader::parse_strl(uint64_t pos, uint64_t end)
+{
+    const unsigned char *d;
+    uint64_t next, len;
+    stream_t s;
+
+    memset(&s.info, 0, sizeof(s.info));
+    s.indx = 0;
+    s.indx_size = 0;
+    s.all_keys = true;
+
+    while (pos + 8 <= end) {
+	next = chunk_end(pos, end);
+	d = map + pos + 8;
+	len = next - pos - 8;
+	if (!memcmp(map + pos, "strh", 4) && len >= 48) {
+	    memcpy(s.info.type, d, 4);
+	    memcpy(s.info.codec, d + 4, 4);
+	    s.info.scale = get_int(d + 20);
+	    s.info.rate = get_int(d + 24);
+	    s.info.length = get_int(d + 32);
+	    s.info.sample_size = get_int(d + 44);
+	} else if (!memcmp(map + pos, "strf", 4)) {
+	    if (!memcmp(s.info.type, "vids", 4) && len >= 20) {
+		s.info.width = get_int(d + 4);
+		s.info.height = get_int(d + 8);
+		s.info.bpp = get_short(d + 14);
+		s.info.compression = get_int(d + 16);
+	    } else if (!memcmp(s.info.type, "auds", 4) && len >= 16) {
+		s.info.format = get_short(d);
+		s.info.channels = get_short(d + 2);
+		s.info.samples_per_second = get_int(d + 4);
+		s.info.bytes_per_second = get_int(d + 8);
+		s.info.block_align = get_short(d + 12);
+		s.info.bits = get_short(d + 14);
+	    }
+	} else if (!memcmp(map + pos, "indx", 4) && len >= 24) {
+	    s.indx = pos + 8;
+	    s.indx_size = len;
+	}
+	pos = next;
+    }
+    streams.push_back(s);
+}
+
+void GWAVIReader::add_frame(unsigned int stream, uint64_t offset, unsigned int size, unsigned int flags)
+{
+    entry_t e;
+
+    /* entries past the end of a truncated file are dropped */
+    if (stream >= streams.size() || offset > this->size || size > this->size - offset)
+	return;
+    e.offset = offset;
+    e.size = size;
+    e.flags = flags;
+    streams[stream].frames.push_back(e);
+}
+
+/*
+ * Load an 'ix##' standard index chunk at pos.
+ */
+bool GWAVIReader::load_std_index(unsigned int stream, uint64_t pos)
+{
+    const unsigned char *d, *e;
+    uint64_t base, end, off;
+    unsigned int n, i, sz;
+
+    /* pos comes from the file, pos + 32 could wrap */
+    if (pos > size || size - pos < 8 + 24)
+	return false;
+    end = chunk_end(pos, size);
+    if (end < pos + 8 + 24)
+	return false;
+    d = map + pos + 8;
+    if (get_short(d) != 2 || d[3] != AVI_INDEX_OF_CHUNKS)
+	return false;
+    n = get_int(d + 4);
+    if (n > (end - pos - 8 - 24) / 8)
+	n = (end - pos - 8 - 24) / 8;
+    base = get_int64(d + 12);
+
+    streams[stream].frames.reserve(streams[stream].frames.size() + n);
+    for (i = 0, e = d + 24; i < n; i++, e += 8) {
+	/* bit 31 of dwSize marks a delta frame */
+	sz = get_int(e + 4);
+	off = base + get_int(e);
+	if (off < base)
+	    continue;
+	add_frame(stream, off, sz & 0x7fffffff, sz & 0x80000000 ? 0 : AVIIF_KEYFRAME);
+    }
+    return true;
+}
+
+/*
+ * Load the OpenDML indexes, every stream needs an 'indx' chunk.
+ */
+bool GWAVIReader::load_odml()
+{
+    const unsigned char *d;
+    unsigned int i, n, used = 0;
+    size_t t;
+
+    for (stream_t &s : streams)
+	if (!s.indx)
+	    return false;
+
+    for (t = 0; t < streams.size(); t++) {
+	d = map + streams[t].indx;
+	if (d[3] == AVI_INDEX_OF_CHUNKS) {
+	    /* a standard index in place of the super index */
+	    if (load_std_index(t, streams[t].indx - 8))
+		used++;
+	    continue;
+	}
+	if (d[3] != AVI_INDEX_OF_INDEXES || get_short(d) != 4)
+	    return false;
+	n = get_int(d + 4);
+	if (n > (streams[t].indx_size - 24) / 16)
+	    n = (streams[t].indx_size - 24) / 16;
+	for (i = 0; i < n; i++)
+	    if (load_std_index(t, get_int64(d + 24 + i * 16)))
+		used++;
+    }
+    if (used)
+	return true;
+
+    /* no index was written, e.g. the file was not finalized */
+    for (stream_t &s : streams)
+	s.frames.clear();
+    return false;
+}
+
+bool GWAVIReader::load_idx1()
+{
+    const unsigned char *e;
+    uint64_t base, off;
+    unsigned int i, n;
+    int stream;
+
+    if (!idx1 || idx1_size < 16)
+	return false;
+    n = idx1_size / 16;
+    e = map + idx1;
+
+    /* offsets count from the 'movi' fourcc, some writers use file positions */
+    off = get_int(e + 8);
+    base = movi;
+    if (!(movi + off + 4 <= size && !memcmp(map + movi + off, e, 4)) && off + 4 <= size
+	    && !memcmp(map + off, e, 4))
+	base = 0;
+
+    for (stream_t &s : streams)
+	s.frames.reserve(n / streams.size());
+    for (i = 0; i < n; i++, e += 16) {
+	stream = stream_number(e);
+	if (stream < 0)
+	    continue;
+	add_frame(stream, base + get_int(e + 8) + 8, get_int(e + 12), get_int(e + 4) & AVIIF_KEYFRAME);
+    }
+    return true;
+}
+
+/*
+ * Walk the chunks of a 'movi' LIST, every chunk counts as a key frame.
+ */
+void GWAVIReader::scan_movi(uint64_t pos, uint64_t end)
+{
+    uint64_t next;
+    int stream;
+
+    while (pos + 8 <= end) {
+	next = chunk_end(pos, end);
+	if (!memcmp(map + pos, "LIST", 4) && pos + 12 <= end && !memcmp(map + pos + 8, "rec ", 4)) {
+	    scan_movi(pos + 12, next);
+	} else {
+	    stream = stream_number(map + pos);
+	    if (stream >= 0)
+		add_frame(stream, pos + 8, get_int(map + pos + 4), AVIIF_KEYFRAME);
+	}
+	pos = next;
+    }
+}
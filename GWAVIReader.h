@@ -0,0 +1,101 @@
+/*
+ * GWAVIReader.h
+ *
+ *  Created on: 16 окт. 2026 г.
+ */
+
+#ifndef GWAVIREADER_H_
+#define GWAVIREADER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Reads AVI files back through a read only mapping of the whole file. The
+ * OpenDML 'indx'/'ix##' indexes, or else 'idx1', or else a scan of the
+ * 'movi' chunks are loaded into one table per stream, frames are returned
+ * as pointers into the mapping.
+ */
+class GWAVIReader {
+public:
+    enum {
+	GWAVI_INDEX_ODML = 0, /* 'indx' super indexes and 'ix##' chunks */
+	GWAVI_INDEX_IDX1, /* legacy 'idx1' */
+	GWAVI_INDEX_SCAN, /* no index, 'movi' chunks walked */
+    };
+
+    typedef struct {
+	char type[5]; /* fccType, "vids" or "auds" */
+	char codec[5]; /* fccHandler */
+	unsigned int scale; /* dwScale, rate / scale frames or samples per second */
+	unsigned int rate; /* dwRate */
+	unsigned int length; /* dwLength */
+	unsigned int sample_size; /* dwSampleSize */
+	/* video, BITMAPINFOHEADER */
+	unsigned int width;
+	unsigned int height;
+	unsigned int bpp;
+	unsigned int compression;
+	/* audio, WAVEFORMATEX */
+	unsigned int format;
+	unsigned int channels;
+	unsigned int samples_per_second;
+	unsigned int bytes_per_second;
+	unsigned int block_align;
+	unsigned int bits;
+	size_t frames; /* chunks in the index */
+    } gwavi_stream_info_t;
+
+    GWAVIReader(const char *filename);
+    virtual ~GWAVIReader();
+
+    unsigned int GetStreamCount();
+    int GetStreamInfo(unsigned int stream, gwavi_stream_info_t *info);
+    size_t GetFrameCount(unsigned int stream);
+    const unsigned char *GetFrame(unsigned int stream, size_t frame, size_t *len);
+    uint64_t GetFrameOffset(unsigned int stream, size_t frame);
+    bool IsKeyframe(unsigned int stream, size_t frame);
+    long FindKeyframe(unsigned int stream, size_t frame);
+    long FindKeyframeAt(unsigned int stream, double seconds);
+    int GetIndexType();
+    unsigned int GetTotalFrames();
+
+private:
+    struct entry_t {
+	uint64_t offset; /* chunk data */
+	unsigned int size;
+	unsigned int flags; /* AVIIF_KEYFRAME */
+    };
+    struct stream_t {
+	gwavi_stream_info_t info;
+	uint64_t indx; /* 'indx' chunk data, 0 if none */
+	unsigned int indx_size;
+	std::vector<entry_t> frames;
+	bool all_keys;
+	std::vector<uint32_t> keyframes; /* frame numbers of the key frames, empty if all_keys */
+    };
+
+    const unsigned char *map;
+    uint64_t size;
+    std::vector<stream_t> streams;
+    unsigned int total_frames;
+    int index_type;
+    uint64_t movi; /* 'movi' fourcc of the first RIFF, idx1 offsets count from it */
+    uint64_t idx1; /* 'idx1' chunk data */
+    unsigned int idx1_size;
+    std::vector<uint64_t> movi_lists; /* [start, end) of every 'movi' LIST */
+
+    void parse_riff(uint64_t pos, uint64_t end);
+    void parse_hdrl(uint64_t pos, uint64_t end);
+    void parse_strl(uint64_t pos, uint64_t end);
+    bool load_odml();
+    bool load_std_index(unsigned int stream, uint64_t pos);
+    bool load_idx1();
+    void scan_movi(uint64_t pos, uint64_t end);
+    void add_frame(unsigned int stream, uint64_t offset, unsigned int size, unsigned int flags);
+    void build_keyframes(stream_t *s);
+    uint64_t chunk_end(uint64_t pos, uint64_t end);
+};
+
+#endif /* GWAVIREADER_H_ */
@@ -0,0 +1,569 @@
+/*
+ * GWAVIRecover.cpp
+ *
+ *  Created on: 16 окт. 2026 г.
+ */
+
+#include "GWAVIRecover.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <iostream>
+#include <system_error>
+
+#define AVIIF_KEYFRAME 0x10
+#define AVI_INDEX_OF_CHUNKS 0x01
+
+using namespace std;
+
+static inline unsigned int get_int(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24;
+}
+
+static inline unsigned char *put_int(unsigned char *p, unsigned int n)
+{
+    *p++ = n;
+    *p++ = n >> 8;
+    *p++ = n >> 16;
+    *p++ = n >> 24;
+    return p;
+}
+
+static inline unsigned char *put_int64(unsigned char *p, uint64_t n)
+{
+    p = put_int(p, (unsigned int) n);
+    return put_int(p, (unsigned int) (n >> 32));
+}
+
+static inline unsigned char *put_short(unsigned char *p, unsigned int n)
+{
+    *p++ = n;
+    *p++ = n >> 8;
+    return p;
+}
+
+static void pwrite_all(int fd, const unsigned char *data, size_t len, uint64_t offset)
+{
+    ssize_t r;
+
+    while (len > 0) {
+	r = pwrite(fd, data, len, offset);
+	if (r < 0) {
+	    if (errno == EINTR)
+		continue;
+	    throw system_error(errno, generic_category(), "pwrite");
+	}
+	data += r;
+	len -= r;
+	offset += r;
+    }
+}
+
+/*
+ * Stream number of a ##dc, ##db or ##wb chunk id, -1 for other chunks.
+ */
+static int stream_number(const unsigned char *id)
+{
+    if (id[0] < '0' || id[0] > '9' || id[1] < '0' || id[1] > '9')
+	return -1;
+    if (memcmp(id + 2, "dc", 2) && memcmp(id + 2, "db", 2) && memcmp(id + 2, "wb", 2))
+	return -1;
+    return (id[0] - '0') * 10 + id[1] - '0';
+}
+
+/*
+ * Stream number of an ix## chunk id, -1 for other chunks.
+ */
+static int index_number(const unsigned char *id)
+{
+    if (memcmp(id, "ix", 2) || id[2] < '0' || id[2] > '9' || id[3] < '0' || id[3] > '9')
+	return -1;
+    return (id[2] - '0') * 10 + id[3] - '0';
+}
+
+/*
+ * End of the chunk at pos including its pad byte, cut at end.
+ */
+static uint64_t chunk_end(const unsigned char *map, uint64_t pos, uint64_t end)
+{
+    uint64_t n = get_int(map + pos + 4);
+
+    n = pos + 8 + n + (n & 1);
+    return n > end ? end : n;
+}
+
+/**
+ * Open the file for writing and map it.
+ *
+ * @throw std::system_error if the file cannot be opened or has no AVI
+ * header.
+ */
+GWAVIRecover::GWAVIRecover(const char *filename)
+{
+    struct stat st;
+    uint64_t pos, end;
+    void *m;
+    int err;
+
+    map = NULL;
+    size = 0;
+    avih = 0;
+    dmlh = 0;
+    chunks = 0;
+    changed = false;
+
+    fd = open(filename, O_RDWR);
+    if (fd < 0)
+	throw system_error(errno, generic_category(), filename);
+    if (fstat(fd, &st) < 0) {
+	err = errno;
+	close(fd);
+	throw system_error(err, generic_category(), filename);
+    }
+    if (st.st_size < 12) {
+	close(fd);
+	throw system_error(EINVAL, generic_category(), "not an AVI file");
+    }
+    size = st.st_size;
+    m = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+	err = errno;
+	close(fd);
+	throw system_error(err, generic_category(), "mmap");
+    }
+    map = (const unsigned char *) m;
+    /* one pass from the start to the end, let the kernel read ahead */
+    (void) madvise(m, size, MADV_SEQUENTIAL);
+
+    try {
+	if (memcmp(map, "RIFF", 4) || memcmp(map + 8, "AVI ", 4))
+	    throw system_error(EINVAL, generic_category(), "not an AVI file");
+	for (pos = 12; pos + 12 <= size; pos = end) {
+	    end = chunk_end(map, pos, size);
+	    if (!memcmp(map + pos, "LIST", 4) && !memcmp(map + pos + 8, "hdrl", 4)) {
+		parse_hdrl(pos + 12, end);
+		break;
+	    }
+	}
+	if (!avih || streams.empty())
+	    throw system_error(EINVAL, generic_category(), "AVI file without header");
+    } catch (...) {
+	munmap((void *) map, size);
+	close(fd);
+	throw;
+    }
+}
+
+GWAVIRecover::~GWAVIRecover()
+{
+    if (map)
+	munmap((void *) map, size);
+    if (fd >= 0)
+	close(fd);
+}
+
+void GWAVIRecover::parse_hdrl(uint64_t pos, uint64_t end)
+{
+    uint64_t next, p;
+
+    while (pos + 8 <= end) {
+	next = chunk_end(map, pos, end);
+	if (!memcmp(map + pos, "avih", 4) && next - pos >= 8 + 20) {
+	    avih = pos + 8;
+	} else if (!memcmp(map + pos, "LIST", 4) && pos + 12 <= end) {
+	    if (!memcmp(map + pos + 8, "strl", 4)) {
+		parse_strl(pos + 12, next);
+	    } else if (!memcmp(map + pos + 8, "odml", 4)) {
+		for (p = pos + 12; p + 8 <= next; p = chunk_end(map, p, next))
+		    if (!memcmp(map + p, "dmlh", 4) && chunk_end(map, p, next) - p >= 8 + 4)
+			dmlh = p + 8;
+	    }
+	}
+	pos = next;
+    }
+}
+
+void GWAVIRecover::parse_strl(uint64_t pos, uint64_t end)
+{
+    uint64_t next, len;
+    stream_t s;
+
+    s.audio = false;
+    s.block_align = 0;
+    s.strh = 0;
+    s.indx = 0;
+    s.indx_entries = 0;
+    s.length = 0;
+
+    while (pos + 8 <= end) {
+	next = chunk_end(map, pos, end);
+	len = next - pos - 8;
+	if (!memcmp(map + pos, "strh", 4) && len >= 36) {
+	    s.strh = pos + 8;
+	    s.audio = !memcmp(map + pos + 8, "auds", 4);
+	} else if (!memcmp(map + pos, "strf", 4) && len >= 14) {
+	    s.block_align = get_int(map + pos + 8 + 12) & 0xffff;
+	} else if (!memcmp(map + pos, "indx", 4) && len >= 24) {
+	    s.indx = pos + 8;
+	    s.indx_entries = (len - 24) / 16;
+	}
+	pos = next;
+    }
+    if (!s.strh)
+	throw system_error(EINVAL, generic_category(), "stream without header");
+    streams.push_back(s);
+}
+
+/*
+ * Position of the 'movi' LIST among the chunks of a RIFF, 0 if its header
+ * is not in the file.
+ */
+uint64_t GWAVIRecover::find_movi(uint64_t pos, uint64_t end)
+{
+    while (pos + 12 <= end) {
+	if (!memcmp(map + pos, "LIST", 4) && !memcmp(map + pos + 8, "movi", 4))
+	    return pos;
+	pos = chunk_end(map, pos, end);
+    }
+    return 0;
+}
+
+/*
+ * Walk the chunks of a 'movi' LIST, counting the stream chunks and
+ * collecting the 'ix##' indexes. The walk of the last one goes past its
+ * size, which may be stale, and stops at the first chunk that is not
+ * complete or not a 'movi' chunk. Its stream chunks and the delta frames
+ * of its checkpoints are returned.
+ *
+ * @param indexed Set if the LIST has 'ix##' indexes.
+ * @param frames Chunks of stream 0 are added.
+ *
+ * @return where the walk stopped.
+ */
+uint64_t GWAVIRecover::walk_movi(uint64_t pos, uint64_t end, bool last, std::vector<entry_t> *entries,
+	std::vector<uint64_t> *delta, bool *indexed, unsigned int *frames)
+{
+    const unsigned char *d;
+    uint64_t next, n;
+    unsigned int i, count, duration;
+    entry_t e;
+    int s;
+
+    *indexed = false;
+    while (pos + 8 <= end) {
+	n = get_int(map + pos + 4);
+	next = pos + 8 + n + (n & 1);
+	if (next > size)
+	    break;
+	d = map + pos + 8;
+
+	if ((s = stream_number(map + pos)) >= 0) {
+	    if ((unsigned int) s >= streams.size())
+		break;
+	    streams[s].length += streams[s].audio ? n : 1;
+	    chunks++;
+	    if (s == 0)
+		(*frames)++;
+	    if (last) {
+		e.offset = pos;
+		e.size = n;
+		e.stream = s;
+		entries->push_back(e);
+	    }
+	} else if ((s = index_number(map + pos)) >= 0) {
+	    if ((unsigned int) s >= streams.size() || n < 24)
+		break;
+	    count = get_int(d + 4);
+	    if (count > (n - 24) / 8)
+		count = (n - 24) / 8;
+	    duration = count;
+	    if (streams[s].audio) {
+		duration = 0;
+		for (i = 0; i < count && streams[s].block_align; i++)
+		    duration += (get_int(d + 24 + i * 8 + 4) & 0x7fffffff) / streams[s].block_align;
+	    }
+	    streams[s].super_index.push_back( { pos, (unsigned int) (8 + n), duration });
+	    *indexed = true;
+	} else if (!memcmp(map + pos, "JUNK", 4)) {
+	    /* checkpoint, "GWCP", count, chunk positions of delta frames */
+	    if (last && n >= 8 && !memcmp(d, "GWCP", 4)) {
+		count = get_int(d + 4);
+		for (i = 0; i < count && 8 + (uint64_t) i * 8 + 8 <= n; i++)
+		    delta->push_back(get_int(d + 8 + i * 8) | (uint64_t) get_int(d + 8 + i * 8 + 4) << 32);
+	    }
+	} else if (memcmp(map + pos, "LIST", 4)) {
+	    break;
+	}
+	pos = next;
+    }
+    return pos;
+}
+
+/*
+ * Append the 'ix##' index of a stream for the chunks of the last RIFF at pos
+ * and register it in the super index.
+ *
+ * @return the end of the index.
+ */
+uint64_t GWAVIRecover::write_std_index(unsigned int stream, const std::vector<entry_t> &entries,
+	const std::vector<uint64_t> &delta, uint64_t riff, uint64_t pos)
+{
+    stream_t *s = &streams[stream];
+    std::vector<unsigned char> block;
+    unsigned char *p;
+    unsigned int n = 0, duration = 0;
+    char id[5];
+
+    for (const entry_t &e : entries)
+	if (e.stream == stream)
+	    n++;
+    if (n == 0)
+	return pos;
+
+    block.resize(8 + 24 + (size_t) n * 8);
+    snprintf(id, sizeof(id), "ix%02u", stream);
+    p = block.data();
+    memcpy(p, id, 4);
+    p = put_int(p + 4, 24 + n * 8);
+    p = put_short(p, 2); /* wLongsPerEntry */
+    p = put_short(p, AVI_INDEX_OF_CHUNKS << 8); /* bIndexSubType, bIndexType */
+    p = put_int(p, n); /* nEntriesInUse */
+    for (const entry_t &e : entries)
+	if (e.stream == stream) {
+	    memcpy(p, map + e.offset, 4); /* dwChunkId */
+	    break;
+	}
+    p = put_int64(p + 4, riff); /* qwBaseOffset */
+    p = put_int(p, 0); /* dwReserved3 */
+
+    for (const entry_t &e : entries) {
+	if (e.stream != stream)
+	    continue;
+	p = put_int(p, (unsigned int) (e.offset + 8 - riff));
+	p = put_int(p, e.size | (binary_search(delta.begin(), delta.end(), e.offset) ? 0x80000000u : 0));
+	if (!s->audio)
+	    duration++;
+	else if (s->block_align)
+	    duration += e.size / s->block_align;
+    }
+    pwrite_all(fd, block.data(), block.size(), pos);
+
+    s->super_index.push_back( { pos, (unsigned int) block.size(), duration });
+    return pos + block.size();
+}
+
+/*
+ * Append the 'idx1' index of the first RIFF at pos.
+ *
+ * @return the end of the index.
+ */
+uint64_t GWAVIRecover::write_idx1(const std::vector<entry_t> &entries, const std::vector<uint64_t> &delta,
+	uint64_t movi, uint64_t pos)
+{
+    std::vector<unsigned char> block(8 + entries.size() * 16);
+    unsigned char *p = block.data();
+
+    memcpy(p, "idx1", 4);
+    p = put_int(p + 4, (unsigned int) (entries.size() * 16));
+    for (const entry_t &e : entries) {
+	memcpy(p, map + e.offset, 4);
+	p = put_int(p + 4, binary_search(delta.begin(), delta.end(), e.offset) ? 0 : AVIIF_KEYFRAME);
+	/* relative to the 'movi' fourcc */
+	p = put_int(p, (unsigned int) (e.offset - movi - 8));
+	p = put_int(p, e.size);
+    }
+    pwrite_all(fd, block.data(), block.size(), pos);
+    return pos + block.size();
+}
+
+/*
+ * Write a header field unless it has the value already.
+ */
+void GWAVIRecover::patch_int(uint64_t offset, unsigned int n)
+{
+    unsigned char buffer[4];
+
+    if (get_int(map + offset) == n)
+	return;
+    put_int(buffer, n);
+    pwrite_all(fd, buffer, 4, offset);
+    changed = true;
+}
+
+/*
+ * Stream lengths, total frames and the super indexes.
+ */
+void GWAVIRecover::patch_header(unsigned int first_riff_frames)
+{
+    unsigned char buffer[16];
+    unsigned int i;
+    size_t n;
+
+    for (stream_t &s : streams) {
+	patch_int(s.strh + 32, (unsigned int) s.length); /* dwLength */
+	if (!s.indx)
+	    continue;
+
+	n = s.super_index.size();
+	if (n > s.indx_entries) {
+	    (void) fprintf(stderr, "WARNING: super index has room for %u of %zu "
+		    "indexes, the rest of the stream is not indexed\n", s.indx_entries, n);
+	    n = s.indx_entries;
+	}
+	patch_int(s.indx + 4, (unsigned int) n); /* nEntriesInUse */
+	for (i = 0; i < n; i++) {
+	    put_int(put_int(put_int64(buffer, s.super_index[i].offset), s.super_index[i].size),
+		    s.super_index[i].duration);
+	    if (memcmp(map + s.indx + 24 + i * 16, buffer, 16)) {
+		pwrite_all(fd, buffer, 16, s.indx + 24 + i * 16);
+		changed = true;
+	    }
+	}
+    }
+
+    /* dwTotalFrames, of the first RIFF in OpenDML files */
+    patch_int(avih + 16, dmlh ? first_riff_frames : (unsigned int) streams[0].length);
+    if (dmlh)
+	patch_int(dmlh, (unsigned int) streams[0].length);
+}
+
+/*
+ * A streamed file ends with a 'JUNK' chunk of "GWST", the 'movi' size, the
+ * 'hdrl' size, the 'hdrl' LIST, the chunk data size and "GWST". Write the
+ * 'hdrl' and 'movi' size in place and let the RIFF end with 'idx1'.
+ *
+ * @return true if the file has a trailer.
+ */
+bool GWAVIRecover::apply_trailer()
+{
+    const unsigned char *d;
+    uint64_t n, hdrl_size, movi, end;
+
+    if (size < 12 + 8 + 20 || memcmp(map + size - 4, "GWST", 4))
+	return false;
+    n = get_int(map + size - 8);
+    if (n < 20 || n + 8 > size - 12)
+	return false;
+    d = map + size - n;
+    if (memcmp(d - 8, "JUNK", 4) || get_int(d - 4) != n || memcmp(d, "GWST", 4))
+	return false;
+    hdrl_size = get_int(d + 8);
+    if (hdrl_size + 20 != n || memcmp(map + 12, "LIST", 4) || get_int(map + 16) + 8 != hdrl_size)
+	return false;
+    movi = 12 + hdrl_size;
+    if (memcmp(map + movi, "LIST", 4) || memcmp(map + movi + 8, "movi", 4))
+	return false;
+    end = movi + 8 + get_int(d + 4);
+    if (end + 8 > size - n - 8 || memcmp(map + end, "idx1", 4))
+	return false;
+    end += 8 + get_int(map + end + 4);
+    if (end > size - n - 8)
+	return false;
+
+    pwrite_all(fd, d + 12, hdrl_size, 12);
+    patch_int(movi + 4, get_int(d + 4));
+    patch_int(4, (unsigned int) (end - 8));
+    changed = true;
+    return true;
+}
+
+/**
+ * Complete the file. A file that was finalized is left alone, frames that
+ * are not completely in the file are dropped.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int GWAVIRecover::Recover(gwavi_recover_stats_t *stats)
+{
+    std::vector<riff_t> riffs;
+    std::vector<entry_t> entries;
+    std::vector<uint64_t> delta;
+    unsigned int first_riff_frames = 0, frames;
+    uint64_t pos, end, riff_end, t = 0;
+    bool indexed = false, closed;
+    riff_t r;
+    size_t i;
+
+    memset(stats, 0, sizeof(*stats));
+    try {
+	/* the trailer makes a streamed file complete, it is cut off below */
+	(void) apply_trailer();
+
+	/* RIFF 'AVI ' and the 'AVIX' after it, a torn one is dropped */
+	for (pos = 0; pos + 12 <= size && !memcmp(map + pos, "RIFF", 4); pos = end) {
+	    end = get_int(map + pos + 4) ? chunk_end(map, pos, size) : size;
+	    r.pos = pos;
+	    r.movi = find_movi(pos + 12, end);
+	    if (!r.movi) {
+		if (pos == 0)
+		    throw system_error(EINVAL, generic_category(), "AVI file without 'movi' LIST");
+		break;
+	    }
+	    riffs.push_back(r);
+	}
+	stats->riffs = riffs.size();
+
+	for (i = 0; i < riffs.size(); i++) {
+	    frames = 0;
+	    end = i + 1 < riffs.size() ? chunk_end(map, riffs[i].movi, size) : size;
+	    t = walk_movi(riffs[i].movi + 12, end, i + 1 == riffs.size(), &entries, &delta, &indexed, &frames);
+	    if (i == 0)
+		first_riff_frames = frames;
+	}
+
+	/*
+	 * The last RIFF was closed if the walk ended at the 'movi' end with
+	 * the 'ix##' indexes of its chunks in it and, in the first RIFF,
+	 * 'idx1' after it.
+	 */
+	r = riffs.back();
+	riff_end = r.pos + 8 + get_int(map + r.pos + 4);
+	closed = t == r.movi + 8 + get_int(map + r.movi + 4) && riff_end <= size
+		&& (indexed || !dmlh || entries.empty());
+	if (closed && riffs.size() == 1)
+	    closed = t + 8 <= size && !memcmp(map + t, "idx1", 4) && t + 8 + get_int(map + t + 4) == riff_end;
+
+	if (closed) {
+	    entries.clear();
+	    end = riff_end;
+	} else {
+	    /* indexes of a close that did not finish are replaced */
+	    for (stream_t &s : streams)
+		while (!s.super_index.empty() && s.super_index.back().offset > r.movi)
+		    s.super_index.pop_back();
+	    sort(delta.begin(), delta.end());
+	    end = t;
+	    if (dmlh)
+		for (i = 0; i < streams.size(); i++)
+		    end = write_std_index(i, entries, delta, r.pos, end);
+	    patch_int(r.movi + 4, (unsigned int) (end - r.movi - 8));
+	    if (riffs.size() == 1)
+		end = write_idx1(entries, delta, r.movi, end);
+	    patch_int(r.pos + 4, (unsigned int) (end - r.pos - 8));
+	    changed = true;
+	}
+	patch_header(first_riff_frames);
+
+	if (changed || end != size) {
+	    if (ftruncate(fd, end) < 0)
+		throw system_error(errno, generic_category(), "ftruncate");
+	    if (fdatasync(fd) < 0)
+		throw system_error(errno, generic_category(), "fdatasync");
+	}
+	stats->chunks = chunks;
+	stats->indexed = entries.size();
+	stats->truncated = size > (closed ? riff_end : t) ? size - (closed ? riff_end : t) : 0;
+	stats->size = end;
+	stats->finalized = !changed && end == size;
+    } catch (std::system_error& e) {
+	std::cerr << e.code().message() << "\n";
+	return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,90 @@
+/*
+ * GWAVIRecover.h
+ *
+ *  Created on: 16 окт. 2026 г.
+ */
+
+#ifndef GWAVIRECOVER_H_
+#define GWAVIRECOVER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Completes an AVI file that was not finalized, e.g. because the writer
+ * crashed. The 'movi' chunk headers are walked in one sequential pass over
+ * a read only mapping, a torn chunk at the end is cut off, the missing
+ * 'ix##' and 'idx1' indexes are appended and the RIFF, 'movi', super index
+ * and header sizes are rewritten in place. Key frame flags come from the
+ * checkpoint chunks of GWAVI::gwavi_options_t::checkpoint_interval, chunks
+ * after the last checkpoint count as key frames.
+ *
+ * A stored stream of GWAVI::gwavi_options_t::streaming gets its header and
+ * sizes from its trailer, if it has one.
+ */
+class GWAVIRecover {
+public:
+    typedef struct {
+	unsigned int riffs; /* RIFF chunks kept */
+	unsigned long long chunks; /* stream chunks in the file */
+	unsigned long long indexed; /* chunks added to the rebuilt indexes */
+	unsigned long long truncated; /* bytes cut off the end */
+	unsigned long long size; /* file size after recovery */
+	bool finalized; /* the file was complete, nothing changed */
+    } gwavi_recover_stats_t;
+
+    GWAVIRecover(const char *filename);
+    virtual ~GWAVIRecover();
+
+    int Recover(gwavi_recover_stats_t *stats);
+
+private:
+    struct super_entry_t {
+	uint64_t offset; /* 'ix##' chunk */
+	unsigned int size;
+	unsigned int duration;
+    };
+    struct stream_t {
+	bool audio;
+	unsigned int block_align;
+	uint64_t strh; /* 'strh' chunk data */
+	uint64_t indx; /* 'indx' chunk data, 0 if none */
+	unsigned int indx_entries; /* room in the super index */
+	uint64_t length; /* frames, or audio bytes */
+	std::vector<super_entry_t> super_index;
+    };
+    struct entry_t {
+	uint64_t offset; /* chunk header */
+	unsigned int size;
+	unsigned int stream;
+    };
+    struct riff_t {
+	uint64_t pos;
+	uint64_t movi; /* 'movi' LIST header */
+    };
+
+    int fd;
+    const unsigned char *map;
+    uint64_t size;
+    std::vector<stream_t> streams;
+    uint64_t avih; /* 'avih' chunk data */
+    uint64_t dmlh; /* 'dmlh' chunk data, 0 if none */
+    unsigned long long chunks;
+    bool changed;
+
+    void parse_hdrl(uint64_t pos, uint64_t end);
+    void parse_strl(uint64_t pos, uint64_t end);
+    uint64_t find_movi(uint64_t pos, uint64_t end);
+    uint64_t walk_movi(uint64_t pos, uint64_t end, bool last, std::vector<entry_t> *entries,
+	    std::vector<uint64_t> *delta, bool *indexed, unsigned int *frames);
+    uint64_t write_std_index(unsigned int stream, const std::vector<entry_t> &entries,
+	    const std::vector<uint64_t> &delta, uint64_t riff, uint64_t pos);
+    uint64_t write_idx1(const std::vector<entry_t> &entries, const std::vector<uint64_t> &delta, uint64_t movi,
+	    uint64_t pos);
+    bool apply_trailer();
+    void patch_int(uint64_t offset, unsigned int n);
+    void patch_header(unsigned int first_riff_frames);
+};
+
+#endif /* GWAVIRECOVER_H_ */
@@ -0,0 +1,286 @@
+/*
+ * GWAVIRemux.cpp
+ *
+ *  Created on: 16 окт. 2026 г.
+ */
+
+#include "GWAVIRemux.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <system_error>
+
+#define BI_RLE8 1
+#define WAVE_FORMAT_PCM 1
+
+/**
+ * The output file is created with the streams of the first input.
+ *
+ * @param options Passed to GWAVI, async_queue and interleave are not used.
+ * NULL - OpenDML with GWAVI_OUTPUT_FD, which copies with
+ * copy_file_range().
+ */
+GWAVIRemux::GWAVIRemux(const char *filename, GWAVI::gwavi_options_t *options)
+{
+    this->filename = filename;
+    memset(&this->options, 0, sizeof(this->options));
+    if (options) {
+	this->options = *options;
+    } else {
+	this->options.odml = 1;
+	this->options.output = GWAVI::GWAVI_OUTPUT_FD;
+    }
+    this->options.async_queue = 0;
+    this->options.interleave = 0;
+    avi = NULL;
+    memset(&stats, 0, sizeof(stats));
+    finalized = false;
+}
+
+/**
+ * Finalizes the output if Finalize() was not called.
+ */
+GWAVIRemux::~GWAVIRemux()
+{
+    if (avi)
+	Finalize();
+}
+
+/*
+ * Create the output with the streams of reader, in the order GWAVI gives
+ * them: video, the audio of the constructor if any, then the others.
+ */
+int GWAVIRemux::open_output(GWAVIReader *reader)
+{
+    GWAVIReader::gwavi_stream_info_t info;
+    GWAVI::gwavi_audio_t audio;
+    unsigned int i, first;
+    int r;
+
+    streams.clear();
+    for (i = 0; i < reader->GetStreamCount(); i++) {
+	reader->GetStreamInfo(i, &info);
+	if (!memcmp(info.type, "vids", 4)) {
+	    if (info.scale == 0 || info.rate == 0 || info.rate % info.scale) {
+		fprintf(stderr, "stream %u: frame rate %u/%u is not a whole number\n", i, info.rate, info.scale);
+		return -1;
+	    }
+	    if (info.compression == BI_RLE8) {
+		fprintf(stderr, "stream %u: MRLE palettes are not copied\n", i);
+		return -1;
+	    }
+	} else if (!memcmp(info.type, "auds", 4)) {
+	    if (info.format != WAVE_FORMAT_PCM) {
+		fprintf(stderr, "stream %u: audio format %#x is not PCM\n", i, info.format);
+		return -1;
+	    }
+	} else {
+	    fprintf(stderr, "stream %u: unknown stream type %s\n", i, info.type);
+	    return -1;
+	}
+	streams.push_back(info);
+    }
+    if (streams.empty()) {
+	fputs("no streams, the file has no 'strl' list\n", stderr);
+	return -1;
+    }
+    if (memcmp(streams[0].type, "vids", 4)) {
+	fputs("stream 0 is not video\n", stderr);
+	return -1;
+    }
+
+    first = streams.size() > 1 && !memcmp(streams[1].type, "auds", 4) ? 2 : 1;
+    if (first == 2) {
+	audio.channels = streams[1].channels;
+	audio.bits = streams[1].bits;
+	audio.samples_per_second = streams[1].samples_per_second;
+    }
+    try {
+	avi = new GWAVI(filename.c_str(), streams[0].width, streams[0].height, streams[0].bpp, streams[0].codec,
+		streams[0].rate / streams[0].scale, first == 2 ? &audio : NULL, &options);
+    } catch (std::system_error& e) {
+	fprintf(stderr, "%s: %s\n", filename.c_str(), e.code().message().c_str());
+	return -1;
+    }
+
+    for (i = first; i < streams.size(); i++) {
+	if (!memcmp(streams[i].type, "vids", 4)) {
+	    r = avi->AddVideoStream(streams[i].width, streams[i].height, streams[i].bpp, streams[i].codec,
+		    streams[i].rate / streams[i].scale);
+	} else {
+	    audio.channels = streams[i].channels;
+	    audio.bits = streams[i].bits;
+	    audio.samples_per_second = streams[i].samples_per_second;
+	    r = avi->AddAudioStream(&audio);
+	}
+	if (r != (int) i) {
+	    delete avi;
+	    avi = NULL;
+	    unlink(filename.c_str());
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+/*
+ * The chunks of reader can go into the output as they are.
+ */
+bool GWAVIRemux::compatible(GWAVIReader *reader, const char *name)
+{
+    GWAVIReader::gwavi_stream_info_t info, *s;
+    unsigned int i;
+
+    if (reader->GetStreamCount() != streams.size()) {
+	fprintf(stderr, "%s: %u streams, not %zu\n", name, reader->GetStreamCount(), streams.size());
+	return false;
+    }
+    for (i = 0; i < streams.size(); i++) {
+	reader->GetStreamInfo(i, &info);
+	s = &streams[i];
+	if (memcmp(info.type, s->type, 4) || memcmp(info.codec, s->codec, 4) || info.scale != s->scale
+		|| info.rate != s->rate || info.width != s->width || info.height != s->height
+		|| info.bpp != s->bpp || info.compression != s->compression || info.format != s->format
+		|| info.channels != s->channels || info.samples_per_second != s->samples_per_second
+		|| info.bits != s->bits) {
+	    fprintf(stderr, "%s: stream %u differs from the first input\n", name, i);
+	    return false;
+	}
+    }
+    return true;
+}
+
+/**
+ * Append a whole file.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int GWAVIRemux::AddInput(const char *filename)
+{
+    return AddInput(filename, 0, -1);
+}
+
+/**
+ * Append the part of a file from start to end seconds of video stream 0.
+ * The part starts at the key frame at or before start, so that it decodes
+ * on its own, and ends before the first frame at or after end. Chunks of
+ * the other streams come along as they lie between those frames in the
+ * file.
+ *
+ * @param end -1 - to the end of the file.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int GWAVIRemux::AddInput(const char *filename, double start, double end)
+{
+    std::vector<GWAVI::gwavi_chunk_t> chunks;
+    GWAVIReader::gwavi_stream_info_t info;
+    GWAVI::gwavi_stats_t s;
+    GWAVI::gwavi_chunk_t c;
+    uint64_t first, last;
+    size_t frames, from, to, f, len, video = 0;
+    uint64_t bytes = 0;
+    unsigned int i;
+    double fps;
+    long key;
+    int fd, ret;
+
+    if (finalized) {
+	fputs("remux is finalized\n", stderr);
+	return -1;
+    }
+
+    try {
+	GWAVIReader reader(filename);
+
+	if (!avi) {
+	    if (open_output(&reader) == -1)
+		return -1;
+	} else if (!compatible(&reader, filename)) {
+	    return -1;
+	}
+
+	/* the range of the file to copy */
+	reader.GetStreamInfo(0, &info);
+	frames = info.frames;
+	fps = (double) info.rate / info.scale;
+	from = start > 0 ? (size_t) (start * fps) : 0;
+	to = end < 0 || end * fps >= frames ? frames : (size_t) ceil(end * fps);
+	if (from >= to) {
+	    fprintf(stderr, "%s: nothing between %.3f and %.3f s\n", filename, start, end);
+	    return -1;
+	}
+	key = reader.FindKeyframe(0, from);
+	first = key > 0 ? reader.GetFrameOffset(0, key) - 8 : 0;
+	last = to < frames ? reader.GetFrameOffset(0, to) - 8 : UINT64_MAX;
+
+	for (i = 0; i < reader.GetStreamCount(); i++)
+	    for (f = 0; f < reader.GetFrameCount(i); f++) {
+		c.offset = reader.GetFrameOffset(i, f) - 8;
+		if (c.offset < first || c.offset >= last)
+		    continue;
+		(void) reader.GetFrame(i, f, &len);
+		c.stream = i;
+		c.size = (len + 1) & ~1;
+		c.keyframe = reader.IsKeyframe(i, f);
+		chunks.push_back(c);
+		if (i == 0)
+		    video++;
+		bytes += c.size + 8;
+	    }
+	std::sort(chunks.begin(), chunks.end(), [](const GWAVI::gwavi_chunk_t &a, const GWAVI::gwavi_chunk_t &b) {
+	    return a.offset < b.offset;
+	});
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+	    throw std::system_error(errno, std::generic_category(), filename);
+	ret = avi->CopyChunks(fd, chunks.data(), chunks.size());
+	close(fd);
+    } catch (std::system_error& e) {
+	fprintf(stderr, "%s: %s\n", filename, e.code().message().c_str());
+	return -1;
+    }
+
+    if (ret == 0) {
+	avi->GetStats(&s);
+	stats.cloned = s.cloned;
+	stats.inputs++;
+	stats.frames += video;
+	stats.chunks += chunks.size();
+	stats.bytes += bytes;
+    }
+    return ret;
+}
+
+/**
+ * Write the indexes and headers of the output.
+ *
+ * @return 0 on success, -1 on error or if no input was added.
+ */
+int GWAVIRemux::Finalize()
+{
+    int ret;
+
+    if (finalized)
+	return -1;
+    finalized = true;
+    if (!avi) {
+	fputs("no input to remux\n", stderr);
+	return -1;
+    }
+    ret = avi->Finalize();
+    delete avi;
+    avi = NULL;
+    return ret;
+}
+
+void GWAVIRemux::GetStats(gwavi_remux_stats_t *stats)
+{
+    *stats = this->stats;
+}
@@ -0,0 +1,55 @@
+/*
+ * GWAVIRemux.h
+ *
+ *  Created on: 16 окт. 2026 г.
+ */
+
+#ifndef GWAVIREMUX_H_
+#define GWAVIREMUX_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "GWAVI.h"
+#include "GWAVIReader.h"
+
+/**
+ * Joins AVI files and cuts them at key frames without decoding them or
+ * reading their frames into memory: the chunks of the kept ranges are
+ * appended with GWAVI::CopyChunks(), only the headers and indexes are
+ * written anew. The inputs need the same streams in the same order as
+ * GWAVI writes them, with the same codec, frame size, frame rate and PCM
+ * audio format.
+ */
+class GWAVIRemux {
+public:
+    typedef struct {
+	unsigned int inputs;
+	unsigned long long frames; /* video frames of stream 0 */
+	unsigned long long chunks; /* chunks of all streams */
+	unsigned long long bytes; /* of the chunks, headers included */
+	unsigned long long cloned; /* bytes shared with the inputs instead of copied */
+    } gwavi_remux_stats_t;
+
+    GWAVIRemux(const char *filename, GWAVI::gwavi_options_t *options = NULL);
+    virtual ~GWAVIRemux();
+
+    int AddInput(const char *filename);
+    int AddInput(const char *filename, double start, double end);
+    int Finalize();
+    void GetStats(gwavi_remux_stats_t *stats);
+
+private:
+    std::string filename;
+    GWAVI::gwavi_options_t options;
+    GWAVI *avi; /* opened with the streams of the first input */
+    std::vector<GWAVIReader::gwavi_stream_info_t> streams;
+    gwavi_remux_stats_t stats;
+    bool finalized;
+
+    int open_output(GWAVIReader *reader);
+    bool compatible(GWAVIReader *reader, const char *name);
+};
+
+#endif /* GWAVIREMUX_H_ */
@@ -0,0 +1,291 @@
+/*
+ * GWAVISegmenter.cpp
+ *
+ *  Created on: 16 окт. 2026 г.
+ */
+
+#include "GWAVISegmenter.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+/* chunk header and index entry of a frame */
+#define CHUNK_OVERHEAD (8 + 16)
+
+/**
+ * Open the first file, the second one is opened in the background.
+ *
+ * @param pattern File names, printf format with one unsigned conversion.
+ * @param options Passed to every GWAVI, may be NULL.
+ * @param segment_options Limits of a file, NULL - no limits.
+ *
+ * @throw std::system_error if the first file cannot be opened.
+ */
+GWAVISegmenter::GWAVISegmenter(const char *pattern, unsigned width, unsigned height, unsigned bpp,
+	const char *fourcc, unsigned fps, GWAVI::gwavi_audio_t *audio, GWAVI::gwavi_options_t *options,
+	gwavi_segment_options_t *segment_options)
+{
+    this->pattern = pattern;
+    this->width = width;
+    this->height = height;
+    this->bpp = bpp;
+    memset(this->fourcc, 0, sizeof(this->fourcc));
+    strncpy(this->fourcc, fourcc, 4);
+    this->fps = fps;
+    has_audio = audio != NULL;
+    memset(&this->audio, 0, sizeof(this->audio));
+    if (audio)
+	this->audio = *audio;
+    memset(&this->options, 0, sizeof(this->options));
+    if (options)
+	this->options = *options;
+    memset(&this->segment_options, 0, sizeof(this->segment_options));
+    if (segment_options)
+	this->segment_options = *segment_options;
+
+    number = this->segment_options.first_number;
+    bytes = 0;
+    frames = 0;
+    finalized = false;
+    next = NULL;
+    next_failed = false;
+    stop = false;
+    error = 0;
+
+    filename = segment_filename(number);
+    avi = open(filename);
+    thread = std::thread(&GWAVISegmenter::background_thread, this);
+}
+
+/**
+ * Finalizes the files if Finalize() was not called.
+ */
+GWAVISegmenter::~GWAVISegmenter()
+{
+    if (!finalized)
+	Finalize();
+}
+
+std::string GWAVISegmenter::segment_filename(unsigned int n)
+{
+    char name[4096];
+
+    snprintf(name, sizeof(name), pattern.c_str(), n);
+    return name;
+}
+
+GWAVI *GWAVISegmenter::open(const std::string &name)
+{
+    return new GWAVI(name.c_str(), width, height, bpp, fourcc, fps, has_audio ? &audio : NULL, &options);
+}
+
+/*
+ * Opens the next file once the current one took it over, and finalizes
+ * the full ones. At the end the unused next file is removed.
+ */
+void GWAVISegmenter::background_thread()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    std::string name;
+    GWAVI *g;
+    int r;
+
+    /* stay out of the way of the capture thread */
+    (void) setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+    for (;;) {
+	work_cv.wait(lock, [&] { return stop || !finishing.empty() || (!next && !next_failed); });
+
+	/* the next file is needed first */
+	if (!next && !next_failed && !stop) {
+	    name = next_filename = segment_filename(number + 1);
+	    lock.unlock();
+	    try {
+		g = open(name);
+	    } catch (std::system_error& e) {
+		(void) fprintf(stderr, "%s: %s\n", name.c_str(), e.code().message().c_str());
+		g = NULL;
+	    } catch (...) {
+		g = NULL;
+	    }
+	    lock.lock();
+	    next = g;
+	    next_failed = !g;
+	    continue;
+	}
+
+	if (!finishing.empty()) {
+	    g = finishing.front();
+	    finishing.pop_front();
+	    lock.unlock();
+	    r = g->Finalize();
+	    delete g;
+	    lock.lock();
+	    if (r < 0)
+		error = -1;
+	    continue;
+	}
+
+	if (stop) {
+	    if (next) {
+		name = next_filename;
+		g = next;
+		next = NULL;
+		lock.unlock();
+		delete g;
+		unlink(name.c_str());
+		lock.lock();
+	    }
+	    return;
+	}
+    }
+}
+
+/*
+ * The current file is full when the frame would take it over a limit.
+ */
+bool GWAVISegmenter::due(size_t len)
+{
+    if (frames == 0)
+	return false;
+    if (segment_options.max_size && bytes + len + CHUNK_OVERHEAD > (uint64_t) segment_options.max_size << 20)
+	return true;
+    if (segment_options.max_duration && frames >= (uint64_t) segment_options.max_duration * fps)
+	return true;
+    return false;
+}
+
+/*
+ * Switch to the next file and hand the current one to the background
+ * thread. Never waits, the next file is opened by a thread at nice 19.
+ *
+ * @return 0 on success, -1 if the next file is not open yet or could not be
+ * opened, the current one goes on then and the next due frame tries again.
+ */
+int GWAVISegmenter::rollover()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (!next) {
+	if (next_failed) {
+	    /* open it again in the background */
+	    next_failed = false;
+	    work_cv.notify_one();
+	}
+	return -1;
+    }
+
+    finishing.push_back(avi);
+    avi = next;
+    filename = next_filename;
+    next = NULL;
+    number++;
+    bytes = 0;
+    frames = 0;
+    work_cv.notify_one();
+    return 0;
+}
+
+void GWAVISegmenter::account(int ret, size_t len)
+{
+    if (ret < 0)
+	return;
+    bytes += len + (len & 3 ? 4 - (len & 3) : 0) + CHUNK_OVERHEAD;
+}
+
+int GWAVISegmenter::AddVideoFrame(unsigned char *buffer, size_t len)
+{
+    return AddVideoFrame(buffer, len, true, NULL, NULL);
+}
+
+int GWAVISegmenter::AddVideoFrame(unsigned char *buffer, size_t len, bool keyframe)
+{
+    return AddVideoFrame(buffer, len, keyframe, NULL, NULL);
+}
+
+/**
+ * Add a video frame, it starts the next file if the current one is full.
+ * See GWAVI::AddVideoFrame().
+ *
+ * @return 0 on success, -1 on error.
+ */
+int GWAVISegmenter::AddVideoFrame(unsigned char *buffer, size_t len, bool keyframe, GWAVI::gwavi_release_t release,
+	void *opaque)
+{
+    int ret;
+
+    if (finalized) {
+	fputs("segmenter is finalized\n", stderr);
+	return -1;
+    }
+    if (due(len) && (keyframe || !segment_options.keyframe_split))
+	(void) rollover();
+
+    ret = avi->AddVideoFrame(buffer, len, keyframe, release, opaque);
+    account(ret, len);
+    if (ret == 0)
+	frames++;
+    return ret;
+}
+
+int GWAVISegmenter::AddAudioFrame(unsigned char *buffer, size_t len)
+{
+    return AddAudioFrame(buffer, len, NULL, NULL);
+}
+
+/**
+ * Add audio to the current file, see GWAVI::AddAudioFrame().
+ *
+ * @return 0 on success, -1 on error.
+ */
+int GWAVISegmenter::AddAudioFrame(unsigned char *buffer, size_t len, GWAVI::gwavi_release_t release, void *opaque)
+{
+    int ret;
+
+    if (finalized) {
+	fputs("segmenter is finalized\n", stderr);
+	return -1;
+    }
+    ret = avi->AddAudioFrame(buffer, len, release, opaque);
+    account(ret, len);
+    return ret;
+}
+
+/**
+ * Finalize the current file and wait for the background thread to finish
+ * the others. The next file opened ahead is removed.
+ *
+ * @return 0 on success, -1 if finalizing any of the files failed.
+ */
+int GWAVISegmenter::Finalize()
+{
+    if (finalized)
+	return error;
+    finalized = true;
+
+    {
+	std::lock_guard<std::mutex> lock(mutex);
+	finishing.push_back(avi);
+	avi = NULL;
+	stop = true;
+    }
+    work_cv.notify_one();
+    thread.join();
+    return error;
+}
+
+/**
+ * Number of the file frames go to.
+ */
+unsigned int GWAVISegmenter::GetSegment()
+{
+    return number;
+}
+
+const char *GWAVISegmenter::GetFilename()
+{
+    return filename.c_str();
+}
@@ -0,0 +1,94 @@
+/*
+ * GWAVISegmenter.h
+ *
+ *  Created on: 16 окт. 2026 г.
+ */
+
+#ifndef GWAVISEGMENTER_H_
+#define GWAVISEGMENTER_H_
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "GWAVI.h"
+
+/**
+ * Splits a recording into files of limited size or duration. The next
+ * file is opened and its header written by a background thread while the
+ * current one fills up, the switch at a frame boundary only swaps a
+ * pointer, and the full file is finalized by the background thread too.
+ * Until the next file is open the current one goes on past its limits.
+ *
+ * Files are named by a printf pattern with one unsigned conversion for the
+ * segment number, e.g. "rec_%04u.avi". A new segment starts with a video
+ * frame, with keyframe_split only with a key frame.
+ */
+class GWAVISegmenter {
+public:
+    typedef struct {
+	unsigned int max_size; /* MB per file, about, 0 - no limit */
+	unsigned int max_duration; /* seconds of video per file, 0 - no limit */
+	int keyframe_split; /* start a file only with a key frame */
+	unsigned int first_number; /* number of the first file */
+    } gwavi_segment_options_t;
+
+    GWAVISegmenter(const char *pattern, unsigned width, unsigned height, unsigned bpp, const char *fourcc,
+	    unsigned fps, GWAVI::gwavi_audio_t *audio, GWAVI::gwavi_options_t *options,
+	    gwavi_segment_options_t *segment_options);
+    virtual ~GWAVISegmenter();
+
+    int AddVideoFrame(unsigned char *buffer, size_t len);
+    int AddVideoFrame(unsigned char *buffer, size_t len, bool keyframe);
+    int AddVideoFrame(unsigned char *buffer, size_t len, bool keyframe, GWAVI::gwavi_release_t release,
+	    void *opaque);
+    int AddAudioFrame(unsigned char *buffer, size_t len);
+    int AddAudioFrame(unsigned char *buffer, size_t len, GWAVI::gwavi_release_t release, void *opaque);
+    int Finalize();
+    unsigned int GetSegment();
+    const char *GetFilename();
+
+private:
+    /* arguments of the GWAVI constructor */
+    std::string pattern;
+    unsigned int width;
+    unsigned int height;
+    unsigned int bpp;
+    char fourcc[5];
+    unsigned int fps;
+    GWAVI::gwavi_audio_t audio;
+    bool has_audio;
+    GWAVI::gwavi_options_t options;
+    gwavi_segment_options_t segment_options;
+
+    /* current file, used by the caller only */
+    GWAVI *avi;
+    unsigned int number;
+    std::string filename;
+    uint64_t bytes;
+    unsigned long frames;
+    bool finalized;
+
+    /* background thread */
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable work_cv;
+    GWAVI *next; /* opened file with the header written */
+    std::string next_filename;
+    bool next_failed;
+    std::deque<GWAVI *> finishing;
+    bool stop;
+    int error;
+
+    std::string segment_filename(unsigned int n);
+    GWAVI *open(const std::string &name);
+    bool due(size_t len);
+    int rollover();
+    void account(int ret, size_t len);
+    void background_thread();
+};
+
+#endif /* GWAVISEGMENTER_H_ */
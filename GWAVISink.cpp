@@ -0,0 +1,800 @@
+/*
+ * GWAVISink.cpp
+ *
+ *  Created on: 16 окт. 2026 г.
+ */
+
+#include "GWAVISink.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <system_error>
+
+#define FD_SINK_BUF_SIZE 65536
+#define COPY_BUF_SIZE (1 << 20)
+
+using namespace std;
+
+/**
+ * Write all of iov, restarting after short writes.
+ */
+static void writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t r;
+    int cnt;
+
+    while (iovcnt > 0) {
+	cnt = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+	r = writev(fd, iov, cnt);
+	if (r < 0) {
+	    if (errno == EINTR)
+		continue;
+	    throw system_error(errno, generic_category(), "writev");
+	}
+	while (iovcnt > 0 && (size_t) r >= iov->iov_len) {
+	    r -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt > 0) {
+	    iov->iov_base = (char *) iov->iov_base + r;
+	    iov->iov_len -= r;
+	}
+    }
+}
+
+GWAVISink::GWAVISink()
+{
+    prealloc_increment = 0;
+    prealloc_initial = 0;
+    prealloc_end = 0;
+}
+
+/**
+ * Reserve disk space with fallocate() ahead of the write position, so the
+ * file grows in large contiguous extents. The first allocation takes at
+ * least initial bytes, the space beyond the end of data is released on
+ * Close(). Sinks without a file descriptor ignore it.
+ */
+void GWAVISink::SetPreallocation(uint64_t increment, uint64_t initial)
+{
+    prealloc_increment = increment;
+    prealloc_initial = initial;
+}
+
+/**
+ * Make sure the space up to end is allocated, called before data goes to fd.
+ */
+void GWAVISink::preallocate(int fd, uint64_t end)
+{
+    uint64_t target = 0;
+
+    if (prealloc_end == 0)
+	target = prealloc_initial;
+    if (prealloc_increment && end + prealloc_increment / 2 > prealloc_end && end + prealloc_increment > target)
+	target = end + prealloc_increment;
+    if (target <= prealloc_end)
+	return;
+
+#ifdef FALLOC_FL_KEEP_SIZE
+    /* keep the file size, so a crash does not leave zeros at the end */
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, prealloc_end, target - prealloc_end) == 0) {
+	prealloc_end = target;
+	prealloc_initial = 0;
+	return;
+    }
+#endif
+    /* not supported or no space, go on without */
+    prealloc_increment = 0;
+    prealloc_initial = 0;
+}
+
+/**
+ * Release the preallocated space past size.
+ */
+void GWAVISink::trim(int fd, uint64_t size)
+{
+    if (prealloc_end <= size)
+	return;
+    if (ftruncate(fd, size) < 0)
+	throw system_error(errno, generic_category(), "ftruncate");
+    prealloc_end = size;
+}
+
+void GWAVISink::WriteV(const struct iovec *iov, int iovcnt)
+{
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+	Write(iov[i].iov_base, iov[i].iov_len);
+}
+
+/**
+ * Write like WriteV() and take over data, one of the iov buffers: the sink
+ * calls release(data, len, opaque) once it no longer needs it, also when it
+ * throws. This one writes it at once and releases it before returning.
+ */
+void GWAVISink::WriteVOwned(const struct iovec *iov, int iovcnt, unsigned char *data, size_t len,
+	gwavi_release_t release, void *opaque)
+{
+    try {
+	WriteV(iov, iovcnt);
+    } catch (...) {
+	release(data, len, opaque);
+	throw;
+    }
+    release(data, len, opaque);
+}
+
+/**
+ * Append len bytes of file fd from offset, the file position of fd is not
+ * used. This one reads them into memory and writes them.
+ *
+ * @return bytes shared with the source by a clone instead of copied.
+ */
+uint64_t GWAVISink::CopyFrom(int fd, uint64_t offset, uint64_t len)
+{
+    unsigned char *buf;
+    ssize_t r;
+
+    buf = new unsigned char[len < COPY_BUF_SIZE ? len : COPY_BUF_SIZE];
+    try {
+	while (len > 0) {
+	    r = pread(fd, buf, len < COPY_BUF_SIZE ? len : COPY_BUF_SIZE, offset);
+	    if (r < 0 && errno == EINTR)
+		continue;
+	    if (r < 0)
+		throw system_error(errno, generic_category(), "pread");
+	    if (r == 0)
+		throw system_error(EIO, generic_category(), "pread past the end of the source");
+	    Write(buf, r);
+	    offset += r;
+	    len -= r;
+	}
+    } catch (...) {
+	delete[] buf;
+	throw;
+    }
+    delete[] buf;
+    return 0;
+}
+
+/**
+ * Memory of len bytes at offset of the output, to be filled in place and
+ * then written with Write() at offset. Valid until the next call of the
+ * sink. NULL if the sink does not keep its output in memory.
+ */
+unsigned char *GWAVISink::Map(uint64_t /* offset */, size_t /* len */)
+{
+    return NULL;
+}
+
+GWAVIFileSink::GWAVIFileSink(const char *filename)
+{
+    outFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+    outFile.open(filename, ios_base::out | ios_base::trunc | ios_base::binary);
+}
+
+GWAVIFileSink::~GWAVIFileSink()
+{
+    if (outFile.is_open()) {
+	outFile.close();
+    }
+}
+
+void GWAVIFileSink::Write(const void *buf, size_t len)
+{
+    outFile.write((const char *) buf, len);
+}
+
+void GWAVIFileSink::PWrite(const void *buf, size_t len, uint64_t offset)
+{
+    long t;
+
+    t = outFile.tellp();
+    outFile.seekp(offset, ios_base::beg);
+    outFile.write((const char *) buf, len);
+    outFile.seekp(t, ios_base::beg);
+}
+
+void GWAVIFileSink::Seek(uint64_t offset)
+{
+    outFile.seekp(offset, ios_base::beg);
+}
+
+uint64_t GWAVIFileSink::Tell()
+{
+    return outFile.tellp();
+}
+
+/**
+ * The stream has no file descriptor to sync, the data only reaches the
+ * kernel.
+ */
+void GWAVIFileSink::Sync()
+{
+    outFile.flush();
+}
+
+void GWAVIFileSink::Close()
+{
+    outFile.close();
+}
+
+GWAVIFdSink::GWAVIFdSink(const char *filename)
+{
+    pos = 0;
+    buf_len = 0;
+    copy_range = true;
+    clone_range = true;
+    own_fd = true;
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+	throw system_error(errno, generic_category(), filename);
+    buf = new unsigned char[FD_SINK_BUF_SIZE];
+}
+
+/**
+ * Write to a file the caller opened, from its start on. The file should
+ * be empty, it is not closed. A pipe or a socket needs
+ * GWAVI::gwavi_options_t::streaming.
+ */
+GWAVIFdSink::GWAVIFdSink(int fd)
+{
+    pos = 0;
+    buf_len = 0;
+    copy_range = true;
+    clone_range = true;
+    own_fd = false;
+    if (lseek(fd, 0, SEEK_SET) < 0 && errno != ESPIPE)
+	throw system_error(errno, generic_category(), "lseek");
+    this->fd = fd;
+    buf = new unsigned char[FD_SINK_BUF_SIZE];
+}
+
+GWAVIFdSink::~GWAVIFdSink()
+{
+    if (fd >= 0) {
+	try {
+	    flush();
+	} catch (...) {
+	}
+	if (own_fd)
+	    close(fd);
+    }
+    delete[] buf;
+}
+
+void GWAVIFdSink::flush()
+{
+    struct iovec iov;
+
+    if (buf_len == 0)
+	return;
+    iov.iov_base = buf;
+    iov.iov_len = buf_len;
+    buf_len = 0;
+    preallocate(fd, pos);
+    writev_all(fd, &iov, 1);
+}
+
+void GWAVIFdSink::Write(const void *data, size_t len)
+{
+    struct iovec iov;
+
+    if (buf_len + len <= FD_SINK_BUF_SIZE) {
+	memcpy(buf + buf_len, data, len);
+	buf_len += len;
+	pos += len;
+	return;
+    }
+
+    iov.iov_base = (void *) data;
+    iov.iov_len = len;
+    WriteV(&iov, 1);
+}
+
+/**
+ * The buffered bytes and iov go out in a single writev(), the payload is
+ * never copied.
+ */
+void GWAVIFdSink::WriteV(const struct iovec *iov, int iovcnt)
+{
+    struct iovec v[8], *pv = v;
+    size_t total = 0;
+    int i, n = 0;
+
+    if (iovcnt + 1 > 8)
+	pv = new struct iovec[iovcnt + 1];
+
+    if (buf_len) {
+	pv[n].iov_base = buf;
+	pv[n++].iov_len = buf_len;
+    }
+    for (i = 0; i < iovcnt; i++) {
+	pv[n++] = iov[i];
+	total += iov[i].iov_len;
+    }
+    buf_len = 0;
+
+    try {
+	preallocate(fd, pos + total);
+	writev_all(fd, pv, n);
+    } catch (...) {
+	if (pv != v)
+	    delete[] pv;
+	throw;
+    }
+    if (pv != v)
+	delete[] pv;
+    pos += total;
+}
+
+void GWAVIFdSink::PWrite(const void *data, size_t len, uint64_t offset)
+{
+    ssize_t r;
+
+    flush();
+    while (len > 0) {
+	r = pwrite(fd, data, len, offset);
+	if (r < 0) {
+	    if (errno == EINTR)
+		continue;
+	    throw system_error(errno, generic_category(), "pwrite");
+	}
+	data = (const char *) data + r;
+	len -= r;
+	offset += r;
+    }
+}
+
+void GWAVIFdSink::Seek(uint64_t offset)
+{
+    flush();
+    if (lseek(fd, offset, SEEK_SET) < 0)
+	throw system_error(errno, generic_category(), "lseek");
+    pos = offset;
+}
+
+uint64_t GWAVIFdSink::Tell()
+{
+    return pos;
+}
+
+void GWAVIFdSink::Sync()
+{
+    flush();
+    if (fdatasync(fd) < 0)
+	throw system_error(errno, generic_category(), "fdatasync");
+}
+
+/**
+ * A clone shares whole blocks only, at the same offset modulo CLONE_BLOCK
+ * in both files: the unaligned head and tail of the range are copied, the
+ * blocks in between cloned. Without reflinks everything is copied. No
+ * space is preallocated for the copy, a clone needs none.
+ */
+uint64_t GWAVIFdSink::CopyFrom(int src, uint64_t offset, uint64_t len)
+{
+    uint64_t head, blocks = 0;
+
+    flush();
+    head = (CLONE_BLOCK - offset % CLONE_BLOCK) % CLONE_BLOCK;
+    if (clone_range && offset % CLONE_BLOCK == pos % CLONE_BLOCK && len >= head + CLONE_BLOCK) {
+	copy(src, offset, head);
+	offset += head;
+	len -= head;
+	blocks = len & ~(uint64_t) (CLONE_BLOCK - 1);
+	if (clone(src, offset, blocks)) {
+	    offset += blocks;
+	    len -= blocks;
+	} else {
+	    blocks = 0;
+	}
+    }
+    copy(src, offset, len);
+    return blocks;
+}
+
+/*
+ * Clone len bytes at offset of src to the end of the file, both block
+ * aligned. False if the filesystem cannot, cloning is not tried again.
+ */
+bool GWAVIFdSink::clone(int src, uint64_t offset, uint64_t len)
+{
+#ifdef FICLONERANGE
+    struct file_clone_range range;
+
+    range.src_fd = src;
+    range.src_offset = offset;
+    range.src_length = len;
+    range.dest_offset = pos;
+    if (ioctl(fd, FICLONERANGE, &range) == 0) {
+	pos += len;
+	/* the ioctl does not move the file position writev() goes on from */
+	if (lseek(fd, pos, SEEK_SET) < 0)
+	    throw system_error(errno, generic_category(), "lseek");
+	return true;
+    }
+#endif
+    clone_range = false;
+    return false;
+}
+
+/*
+ * The kernel copies, without passing the data through user space. Falls
+ * back to read and write when copy_file_range() is not supported between
+ * the files.
+ */
+void GWAVIFdSink::copy(int src, uint64_t offset, uint64_t len)
+{
+    loff_t off = offset;
+    ssize_t r;
+
+    while (len > 0 && copy_range) {
+	/* the output file position moves with the copy */
+	r = copy_file_range(src, &off, fd, NULL, len, 0);
+	if (r < 0 && errno == EINTR)
+	    continue;
+	if (r < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+	    copy_range = false;
+	    break;
+	}
+	if (r < 0)
+	    throw system_error(errno, generic_category(), "copy_file_range");
+	if (r == 0)
+	    throw system_error(EIO, generic_category(), "copy_file_range past the end of the source");
+	pos += r;
+	len -= r;
+    }
+    if (len > 0)
+	GWAVISink::CopyFrom(src, off, len);
+}
+
+void GWAVIFdSink::Close()
+{
+    int r;
+
+    if (fd < 0)
+	return;
+    flush();
+    trim(fd, pos);
+    r = own_fd ? close(fd) : 0;
+    fd = -1;
+    if (r < 0)
+	throw system_error(errno, generic_category(), "close");
+}
+
+GWAVIMemorySink::GWAVIMemorySink()
+{
+    buf = NULL;
+    size = 0;
+    capacity = 0;
+    pos = 0;
+}
+
+GWAVIMemorySink::~GWAVIMemorySink()
+{
+    free(buf);
+}
+
+/**
+ * Make room for data up to end.
+ */
+void GWAVIMemorySink::reserve(uint64_t end)
+{
+    unsigned char *p;
+    size_t n;
+
+    if (end <= capacity)
+	return;
+    if (end > SIZE_MAX / 2)
+	throw system_error(ENOMEM, generic_category(), "memory sink");
+    n = capacity ? capacity : 65536;
+    while (n < end)
+	n *= 2;
+    p = (unsigned char *) realloc(buf, n);
+    if (!p)
+	throw system_error(ENOMEM, generic_category(), "memory sink");
+    buf = p;
+    capacity = n;
+}
+
+void GWAVIMemorySink::Write(const void *data, size_t len)
+{
+    PWrite(data, len, pos);
+    pos += len;
+}
+
+void GWAVIMemorySink::PWrite(const void *data, size_t len, uint64_t offset)
+{
+    reserve(offset + len);
+    /* a gap left by Seek() reads as zeros */
+    if (offset > size)
+	memset(buf + size, 0, offset - size);
+    /* filled in place through Map() */
+    if (data != buf + offset)
+	memcpy(buf + offset, data, len);
+    if (offset + len > size)
+	size = offset + len;
+}
+
+void GWAVIMemorySink::Seek(uint64_t offset)
+{
+    pos = offset;
+}
+
+uint64_t GWAVIMemorySink::Tell()
+{
+    return pos;
+}
+
+void GWAVIMemorySink::Sync()
+{
+}
+
+void GWAVIMemorySink::Close()
+{
+}
+
+unsigned char *GWAVIMemorySink::Map(uint64_t offset, size_t len)
+{
+    reserve(offset + len);
+    return buf + offset;
+}
+
+/**
+ * Allocate initial bytes up front, the increment is not used.
+ */
+void GWAVIMemorySink::SetPreallocation(uint64_t /* increment */, uint64_t initial)
+{
+    reserve(initial);
+}
+
+/**
+ * The file written so far, valid until the next write.
+ */
+const unsigned char *GWAVIMemorySink::GetData()
+{
+    return buf;
+}
+
+size_t GWAVIMemorySink::GetSize()
+{
+    return size;
+}
+
+/**
+ * Hand the buffer over to the caller, who has to free() it. The sink is
+ * empty afterwards.
+ *
+ * @param len Set to the size of the file.
+ */
+unsigned char *GWAVIMemorySink::Release(size_t *len)
+{
+    unsigned char *p = buf;
+
+    *len = size;
+    buf = NULL;
+    size = 0;
+    capacity = 0;
+    pos = 0;
+    return p;
+}
+
+GWAVIArenaSink::GWAVIArenaSink(void *arena, size_t capacity)
+{
+    buf = (unsigned char *) arena;
+    this->capacity = capacity;
+}
+
+GWAVIArenaSink::~GWAVIArenaSink()
+{
+    /* not ours */
+    buf = NULL;
+}
+
+void GWAVIArenaSink::reserve(uint64_t end)
+{
+    if (end > capacity)
+	throw system_error(ENOSPC, generic_category(), "arena sink");
+}
+
+void GWAVIArenaSink::SetPreallocation(uint64_t /* increment */, uint64_t /* initial */)
+{
+}
+
+static void pwrite_all(int fd, const unsigned char *data, size_t len, uint64_t offset)
+{
+    ssize_t r;
+
+    while (len > 0) {
+	r = pwrite(fd, data, len, offset);
+	if (r < 0) {
+	    if (errno == EINTR)
+		continue;
+	    throw system_error(errno, generic_category(), "pwrite");
+	}
+	data += r;
+	len -= r;
+	offset += r;
+    }
+}
+
+GWAVIDirectSink::GWAVIDirectSink(const char *filename)
+{
+    void *mem;
+
+    fill = 0;
+    base = 0;
+    pos = 0;
+    staging = NULL;
+    block = NULL;
+
+    fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+    if (fd < 0 && errno == EINVAL) {
+	(void) fprintf(stderr, "WARNING: O_DIRECT is not supported for %s, "
+		"using buffered I/O\n", filename);
+	fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    }
+    if (fd < 0)
+	throw system_error(errno, generic_category(), filename);
+
+    if (posix_memalign(&mem, BLOCK, STAGING_SIZE + BLOCK)) {
+	close(fd);
+	throw system_error(ENOMEM, generic_category(), "O_DIRECT staging buffer");
+    }
+    staging = (unsigned char *) mem;
+    block = staging + STAGING_SIZE;
+}
+
+GWAVIDirectSink::~GWAVIDirectSink()
+{
+    if (fd >= 0) {
+	try {
+	    Close();
+	} catch (...) {
+	}
+    }
+    free(staging);
+}
+
+/**
+ * Write len bytes of the staging buffer, padded to a whole block.
+ */
+void GWAVIDirectSink::write_out(size_t len)
+{
+    size_t n = (len + BLOCK - 1) & ~(size_t) (BLOCK - 1);
+
+    memset(staging + len, 0, n - len);
+    preallocate(fd, base + n);
+    pwrite_all(fd, staging, n, base);
+}
+
+void GWAVIDirectSink::append(const unsigned char *data, size_t len)
+{
+    size_t n;
+
+    while (len > 0) {
+	n = STAGING_SIZE - fill;
+	if (n > len)
+	    n = len;
+	memcpy(staging + fill, data, n);
+	fill += n;
+	data += n;
+	len -= n;
+
+	if (fill == STAGING_SIZE) {
+	    write_out(fill);
+	    base += fill;
+	    fill = 0;
+	}
+    }
+}
+
+/**
+ * Overwrite data already written, in the staging buffer or on disk.
+ */
+void GWAVIDirectSink::patch(const unsigned char *data, size_t len, uint64_t offset)
+{
+    uint64_t blk;
+    size_t n, o;
+    ssize_t r;
+
+    if (offset + len > base + fill)
+	throw system_error(EINVAL, generic_category(), "O_DIRECT patch past the end");
+
+    while (len > 0 && offset < base) {
+	blk = offset & ~(uint64_t) (BLOCK - 1);
+	o = offset - blk;
+	n = BLOCK - o;
+	if (n > len)
+	    n = len;
+	r = pread(fd, block, BLOCK, blk);
+	if (r != BLOCK)
+	    throw system_error(r < 0 ? errno : EIO, generic_category(), "pread");
+	memcpy(block + o, data, n);
+	pwrite_all(fd, block, BLOCK, blk);
+	data += n;
+	len -= n;
+	offset += n;
+    }
+    if (len > 0)
+	memcpy(staging + (offset - base), data, len);
+}
+
+void GWAVIDirectSink::Write(const void *buf, size_t len)
+{
+    const unsigned char *data = (const unsigned char *) buf;
+    size_t n;
+
+    if (pos < base + fill) {
+	n = base + fill - pos;
+	if (n > len)
+	    n = len;
+	patch(data, n, pos);
+	data += n;
+	len -= n;
+	pos += n;
+    }
+    append(data, len);
+    pos += len;
+}
+
+void GWAVIDirectSink::PWrite(const void *buf, size_t len, uint64_t offset)
+{
+    patch((const unsigned char *) buf, len, offset);
+}
+
+void GWAVIDirectSink::Seek(uint64_t offset)
+{
+    if (offset > base + fill)
+	throw system_error(EINVAL, generic_category(), "O_DIRECT seek past the end");
+    pos = offset;
+}
+
+uint64_t GWAVIDirectSink::Tell()
+{
+    return pos;
+}
+
+/**
+ * The partly filled staging buffer goes out padded to a whole block, it is
+ * written again when it fills up.
+ */
+void GWAVIDirectSink::Sync()
+{
+    if (fill)
+	write_out(fill);
+    if (fdatasync(fd) < 0)
+	throw system_error(errno, generic_category(), "fdatasync");
+}
+
+void GWAVIDirectSink::Close()
+{
+    int r;
+
+    if (fd < 0)
+	return;
+    try {
+	if (fill)
+	    write_out(fill);
+	if (ftruncate(fd, base + fill) < 0)
+	    throw system_error(errno, generic_category(), "ftruncate");
+    } catch (...) {
+	close(fd);
+	fd = -1;
+	throw;
+    }
+    r = close(fd);
+    fd = -1;
+    if (r < 0)
+	throw system_error(errno, generic_category(), "close");
+}
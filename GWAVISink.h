@@ -0,0 +1,306 @@
+/*
+ * GWAVISink.h
+ *
+ *  Created on: 16 окт. 2026 г.
+ */
+
+#ifndef GWAVISINK_H_
+#define GWAVISINK_H_
+
+#include <fstream>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/**
+ * Output of the AVI writer. Write() and WriteV() write at the current
+ * position, PWrite() patches data already written without moving it, Sync()
+ * puts everything written so far on disk, CopyFrom() appends a range of
+ * another file. Map() gives the memory of a range of the output where the
+ * sink keeps it in memory anyway, a Write() from that very memory then
+ * copies nothing. WriteVOwned() hands one buffer of the iov over to the
+ * sink, which may keep writing from it after returning. Errors are reported
+ * by throwing std::system_error.
+ */
+class GWAVISink {
+public:
+    typedef void (*gwavi_release_t)(unsigned char *data, size_t len, void *opaque);
+
+    enum {
+	CLONE_BLOCK = 4096 /* CopyFrom() clones only blocks aligned to this in both files */
+    };
+
+    GWAVISink();
+    virtual ~GWAVISink()
+    {
+    }
+
+    virtual void Write(const void *buf, size_t len) = 0;
+    virtual void WriteV(const struct iovec *iov, int iovcnt);
+    virtual void WriteVOwned(const struct iovec *iov, int iovcnt, unsigned char *data, size_t len,
+	    gwavi_release_t release, void *opaque);
+    virtual void PWrite(const void *buf, size_t len, uint64_t offset) = 0;
+    virtual void Seek(uint64_t offset) = 0;
+    virtual uint64_t Tell() = 0;
+    virtual void Sync() = 0;
+    virtual void Close() = 0;
+    virtual uint64_t CopyFrom(int fd, uint64_t offset, uint64_t len);
+    virtual unsigned char *Map(uint64_t offset, size_t len);
+
+    virtual void SetPreallocation(uint64_t increment, uint64_t initial);
+
+protected:
+    uint64_t prealloc_increment;
+    uint64_t prealloc_initial;
+    uint64_t prealloc_end;
+
+    void preallocate(int fd, uint64_t end);
+    void trim(int fd, uint64_t size);
+};
+
+/**
+ * std::ofstream based sink.
+ */
+class GWAVIFileSink: public GWAVISink {
+public:
+    GWAVIFileSink(const char *filename);
+    virtual ~GWAVIFileSink();
+
+    void Write(const void *buf, size_t len);
+    void PWrite(const void *buf, size_t len, uint64_t offset);
+    void Seek(uint64_t offset);
+    uint64_t Tell();
+    void Sync();
+    void Close();
+
+private:
+    std::ofstream outFile;
+};
+
+/**
+ * POSIX file descriptor sink. Small writes are collected in a buffer which
+ * goes out in the same writev() as the next frame. CopyFrom() clones the
+ * whole blocks of a range with FICLONERANGE on filesystems with reflinks
+ * and copies the rest with copy_file_range(), the data does not pass
+ * through user space.
+ */
+class GWAVIFdSink: public GWAVISink {
+public:
+    GWAVIFdSink(const char *filename);
+    GWAVIFdSink(int fd);
+    virtual ~GWAVIFdSink();
+
+    void Write(const void *buf, size_t len);
+    void WriteV(const struct iovec *iov, int iovcnt);
+    void PWrite(const void *buf, size_t len, uint64_t offset);
+    void Seek(uint64_t offset);
+    uint64_t Tell();
+    void Sync();
+    void Close();
+    uint64_t CopyFrom(int fd, uint64_t offset, uint64_t len);
+
+protected:
+    int fd;
+    uint64_t pos; /* end of data, including the buffered bytes */
+    unsigned char *buf;
+    size_t buf_len;
+    bool copy_range; /* copy_file_range() works between the files */
+    bool clone_range; /* FICLONERANGE works between the files */
+    bool own_fd; /* opened by the constructor */
+
+    void flush();
+    void copy(int src, uint64_t offset, uint64_t len);
+    bool clone(int src, uint64_t offset, uint64_t len);
+};
+
+/**
+ * Growable memory sink, to build a file in RAM, e.g. a short clip for a
+ * network reply. The buffer grows by doubling, SetPreallocation() reserves
+ * its initial size up front.
+ */
+class GWAVIMemorySink: public GWAVISink {
+public:
+    GWAVIMemorySink();
+    virtual ~GWAVIMemorySink();
+
+    void Write(const void *buf, size_t len);
+    void PWrite(const void *buf, size_t len, uint64_t offset);
+    void Seek(uint64_t offset);
+    uint64_t Tell();
+    void Sync();
+    void Close();
+    unsigned char *Map(uint64_t offset, size_t len);
+    void SetPreallocation(uint64_t increment, uint64_t initial);
+
+    const unsigned char *GetData();
+    size_t GetSize();
+    unsigned char *Release(size_t *len);
+
+protected:
+    unsigned char *buf;
+    size_t size; /* end of data */
+    size_t capacity;
+    size_t pos;
+
+    virtual void reserve(uint64_t end);
+};
+
+/**
+ * Memory sink over a fixed region of the caller, e.g. shared memory. A
+ * write past its end fails with ENOSPC. The region stays the caller's, the
+ * file is at its start, GetSize() bytes long; do not Release() it.
+ */
+class GWAVIArenaSink: public GWAVIMemorySink {
+public:
+    GWAVIArenaSink(void *arena, size_t capacity);
+    virtual ~GWAVIArenaSink();
+
+    void SetPreallocation(uint64_t increment, uint64_t initial);
+
+protected:
+    void reserve(uint64_t end);
+};
+
+/**
+ * O_DIRECT sink. Everything goes through an aligned staging buffer that is
+ * written in whole blocks, so the page cache is bypassed. Patches of data
+ * already on disk are done block wise by read-modify-write, the tail block
+ * is padded and the file truncated to its real size on Close(). Falls back
+ * to buffered I/O when the filesystem refuses O_DIRECT.
+ */
+class GWAVIDirectSink: public GWAVISink {
+public:
+    GWAVIDirectSink(const char *filename);
+    virtual ~GWAVIDirectSink();
+
+    void Write(const void *buf, size_t len);
+    void PWrite(const void *buf, size_t len, uint64_t offset);
+    void Seek(uint64_t offset);
+    uint64_t Tell();
+    void Sync();
+    void Close();
+
+private:
+    enum {
+	BLOCK = 4096, STAGING_SIZE = 4 << 20
+    };
+
+    int fd;
+    unsigned char *staging;
+    size_t fill;
+    uint64_t base; /* file offset of staging[0] */
+    uint64_t pos;
+    unsigned char *block;
+
+    void append(const unsigned char *data, size_t len);
+    void patch(const unsigned char *data, size_t len, uint64_t offset);
+    void write_out(size_t len);
+};
+
+/**
+ * mmap() sink. The file is mapped as a whole and grows in windows of
+ * WINDOW bytes (or the preallocation increment if larger), allocated with
+ * fallocate() before they are mapped, so that a full disk is an error of
+ * the write and not a SIGBUS. Writes are memcpy() into the mapping, patches
+ * plain stores, Map() lets a caller fill a chunk in place. Close() trims
+ * the file to the end of data; until then it has zeros past it.
+ */
+class GWAVIMmapSink: public GWAVISink {
+public:
+    GWAVIMmapSink(const char *filename);
+    virtual ~GWAVIMmapSink();
+
+    void Write(const void *buf, size_t len);
+    void PWrite(const void *buf, size_t len, uint64_t offset);
+    void Seek(uint64_t offset);
+    uint64_t Tell();
+    void Sync();
+    void Close();
+    uint64_t CopyFrom(int fd, uint64_t offset, uint64_t len);
+    unsigned char *Map(uint64_t offset, size_t len);
+
+private:
+    enum {
+	WINDOW = 64 << 20, POPULATE_STEP = 4 << 20
+    };
+
+    int fd;
+    unsigned char *map;
+    uint64_t mapped; /* length of the mapping and the file */
+    uint64_t populated; /* pages faulted in */
+    uint64_t size; /* end of data */
+    uint64_t pos;
+
+    void grow(uint64_t end);
+    void populate(uint64_t end);
+};
+
+/**
+ * io_uring sink. Small writes are gathered in registered buffers and
+ * submitted as WRITE_FIXED requests that stay in flight while the caller
+ * goes on; a large payload is sent as a write of its own behind the
+ * preceding buffer. A payload handed over with WriteVOwned() stays in
+ * flight as well and is released when its write completes, a borrowed one
+ * is waited for. All writes are positioned, so they need no ordering,
+ * Seek() only moves the append cursor.
+ *
+ * The constructor throws std::system_error when io_uring or its WRITE
+ * operation is not available.
+ */
+class GWAVIUringSink: public GWAVISink {
+public:
+    GWAVIUringSink(const char *filename);
+    virtual ~GWAVIUringSink();
+
+    void Write(const void *buf, size_t len);
+    void WriteV(const struct iovec *iov, int iovcnt);
+    void WriteVOwned(const struct iovec *iov, int iovcnt, unsigned char *data, size_t len,
+	    gwavi_release_t release, void *opaque);
+    void PWrite(const void *buf, size_t len, uint64_t offset);
+    void Seek(uint64_t offset);
+    uint64_t Tell();
+    void Sync();
+    void Close();
+
+private:
+    enum {
+	DEPTH = 64, BUFFERS = 8, BUFFER_SIZE = 1 << 20, DIRECT_MIN = 65536
+    };
+    struct request_t {
+	int buffer; /* fixed buffer, -1 for the caller's memory */
+	const unsigned char *data;
+	size_t len;
+	uint64_t offset;
+	bool busy;
+	gwavi_release_t release; /* of an owned payload, called by complete() */
+	void *opaque;
+    };
+    struct ring_t;
+
+    int fd;
+    uint64_t pos;
+    ring_t *ring;
+    unsigned char *buffers;
+    bool buffers_registered;
+    int buffer_busy[BUFFERS];
+    int cur; /* buffer being filled, -1 for none */
+    size_t cur_len;
+    uint64_t cur_offset;
+    request_t *requests;
+    unsigned int inflight;
+    unsigned int unsubmitted;
+    int error;
+
+    int get_request();
+    void queue_write(int buffer, const void *data, size_t len, uint64_t offset, int *req);
+    void submit(unsigned int wait);
+    void reap();
+    void complete(unsigned int req, int res);
+    void queue_buffer();
+    bool probe_write();
+    void drain();
+    void wait_request(int req);
+    void check_error();
+    void destroy();
+};
+
+#endif /* GWAVISINK_H_ */
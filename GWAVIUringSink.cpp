@@ -0,0 +1,563 @@
+/*
+ * GWAVIUringSink.cpp
+ *
+ *  Created on: 16 окт. 2026 г.
+ */
+
+#include "GWAVISink.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <system_error>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+using namespace std;
+
+#ifdef HAVE_IO_URING
+
+struct GWAVIUringSink::ring_t {
+    int fd;
+    unsigned int sq_entries;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    size_t sqes_size;
+};
+
+GWAVIUringSink::GWAVIUringSink(const char *filename)
+{
+    struct io_uring_params p;
+    struct iovec iov[BUFFERS];
+    unsigned char *sq, *cq;
+    void *mem;
+    int i;
+
+    fd = -1;
+    pos = 0;
+    buffers = NULL;
+    buffers_registered = false;
+    cur = -1;
+    cur_len = 0;
+    cur_offset = 0;
+    requests = NULL;
+    inflight = 0;
+    unsubmitted = 0;
+    error = 0;
+    memset(buffer_busy, 0, sizeof(buffer_busy));
+
+    ring = new ring_t;
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+
+    try {
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, DEPTH, &p);
+	if (ring->fd < 0)
+	    throw system_error(errno, generic_category(), "io_uring_setup");
+
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	    if (ring->cq_size > ring->sq_size)
+		ring->sq_size = ring->cq_size;
+	    ring->cq_size = 0;
+	}
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+		IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+	    ring->sq_ptr = NULL;
+	    throw system_error(errno, generic_category(), "io_uring mmap");
+	}
+	if (ring->cq_size) {
+	    ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+		    IORING_OFF_CQ_RING);
+	    if (ring->cq_ptr == MAP_FAILED) {
+		ring->cq_ptr = NULL;
+		throw system_error(errno, generic_category(), "io_uring mmap");
+	    }
+	}
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+	    ring->sqes = NULL;
+	    throw system_error(errno, generic_category(), "io_uring mmap");
+	}
+
+	sq = (unsigned char *) ring->sq_ptr;
+	cq = ring->cq_ptr ? (unsigned char *) ring->cq_ptr : sq;
+	ring->sq_entries = p.sq_entries;
+	ring->sq_head = (unsigned int *) (sq + p.sq_off.head);
+	ring->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *) (sq + p.sq_off.array);
+	ring->cq_head = (unsigned int *) (cq + p.cq_off.head);
+	ring->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	/* IORING_OP_WRITE is newer than io_uring, fall back before the first write fails */
+	if (!probe_write())
+	    throw system_error(EOPNOTSUPP, generic_category(), "io_uring write");
+
+	if (posix_memalign(&mem, 4096, (size_t) BUFFERS * BUFFER_SIZE))
+	    throw system_error(ENOMEM, generic_category(), "io_uring buffers");
+	buffers = (unsigned char *) mem;
+
+	/* without registered buffers (RLIMIT_MEMLOCK) plain writes are used */
+	for (i = 0; i < BUFFERS; i++) {
+	    iov[i].iov_base = buffers + (size_t) i * BUFFER_SIZE;
+	    iov[i].iov_len = BUFFER_SIZE;
+	}
+	buffers_registered = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, BUFFERS) == 0;
+
+	requests = new request_t[DEPTH];
+	memset(requests, 0, DEPTH * sizeof(request_t));
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+	    throw system_error(errno, generic_category(), filename);
+    } catch (...) {
+	destroy();
+	throw;
+    }
+}
+
+GWAVIUringSink::~GWAVIUringSink()
+{
+    if (fd >= 0) {
+	try {
+	    drain();
+	} catch (...) {
+	}
+    }
+    /* before close(), complete() may still finish a short write */
+    destroy();
+    if (fd >= 0)
+	close(fd);
+}
+
+void GWAVIUringSink::destroy()
+{
+    bool idle;
+    int i, r;
+
+    /*
+     * Closing the ring does not wait for the writes the kernel holds, reap
+     * them before their memory goes. Requests never submitted are not
+     * seen by the kernel.
+     */
+    while (ring && inflight > unsubmitted) {
+	r = syscall(__NR_io_uring_enter, ring->fd, 0, inflight - unsubmitted, IORING_ENTER_GETEVENTS, NULL, 0);
+	if (r < 0 && errno != EINTR)
+	    break;
+	reap();
+    }
+    idle = inflight == unsubmitted;
+
+    if (ring) {
+	if (ring->sqes)
+	    munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr)
+	    munmap(ring->cq_ptr, ring->cq_size);
+	if (ring->sq_ptr)
+	    munmap(ring->sq_ptr, ring->sq_size);
+	if (ring->fd >= 0)
+	    close(ring->fd);
+	delete ring;
+	ring = NULL;
+    }
+    if (idle) {
+	free(buffers);
+	/* owned payloads of writes that were never submitted */
+	for (i = 0; requests && i < DEPTH; i++)
+	    if (requests[i].busy && requests[i].release)
+		requests[i].release((unsigned char *) requests[i].data, requests[i].len, requests[i].opaque);
+    }
+    /* else the kernel may still read the buffers and payloads, they are leaked */
+    buffers = NULL;
+    delete[] requests;
+    requests = NULL;
+}
+
+/**
+ * The kernel knows IORING_OP_WRITE. Kernels without it have no
+ * IORING_REGISTER_PROBE either.
+ */
+bool GWAVIUringSink::probe_write()
+{
+    struct io_uring_probe *probe;
+    size_t n = 256;
+    bool ok;
+
+    probe = (struct io_uring_probe *) calloc(1, sizeof(*probe) + n * sizeof(struct io_uring_probe_op));
+    if (!probe)
+	throw system_error(ENOMEM, generic_category(), "io_uring probe");
+    ok = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, n) == 0
+	    && IORING_OP_WRITE <= probe->last_op && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok;
+}
+
+int GWAVIUringSink::get_request()
+{
+    int i;
+
+    for (;;) {
+	for (i = 0; i < DEPTH; i++)
+	    if (!requests[i].busy)
+		return i;
+	submit(1);
+    }
+}
+
+/**
+ * Queue a positioned write, it is sent to the kernel by the next submit().
+ */
+void GWAVIUringSink::queue_write(int buffer, const void *data, size_t len, uint64_t offset, int *req)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int tail, idx;
+    int r;
+
+    preallocate(fd, offset + len);
+    r = get_request();
+    tail = *ring->sq_tail;
+    idx = tail & *ring->sq_mask;
+    sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    if (buffer >= 0 && buffers_registered) {
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->buf_index = buffer;
+    } else
+	sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) data;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = r;
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    requests[r].buffer = buffer;
+    requests[r].data = (const unsigned char *) data;
+    requests[r].len = len;
+    requests[r].offset = offset;
+    requests[r].busy = true;
+    requests[r].release = NULL;
+    inflight++;
+    unsubmitted++;
+    if (req)
+	*req = r;
+}
+
+/**
+ * Submit the queued requests and wait for at least wait completions.
+ */
+void GWAVIUringSink::submit(unsigned int wait)
+{
+    int r;
+
+    if (wait > inflight)
+	wait = inflight;
+    while (unsubmitted || wait) {
+	r = syscall(__NR_io_uring_enter, ring->fd, unsubmitted, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (r < 0) {
+	    if (errno == EINTR)
+		continue;
+	    throw system_error(errno, generic_category(), "io_uring_enter");
+	}
+	unsubmitted -= r;
+	wait = 0;
+    }
+    reap();
+}
+
+void GWAVIUringSink::reap()
+{
+    struct io_uring_cqe *cqe;
+    unsigned int head, tail;
+    unsigned int req;
+    int res;
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+	cqe = &ring->cqes[head & *ring->cq_mask];
+	req = cqe->user_data;
+	res = cqe->res;
+	head++;
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	complete(req, res);
+    }
+}
+
+void GWAVIUringSink::complete(unsigned int req, int res)
+{
+    request_t *rq = &requests[req];
+    ssize_t r = res;
+    int err = 0;
+
+    if (res < 0)
+	err = -res;
+    /* finish a short write synchronously */
+    while (!err && (size_t) r < rq->len) {
+	ssize_t n = pwrite(fd, rq->data + r, rq->len - r, rq->offset + r);
+	if (n < 0 && errno != EINTR)
+	    err = errno;
+	else if (n == 0)
+	    err = ENOSPC;
+	else if (n > 0)
+	    r += n;
+    }
+
+    if (rq->buffer >= 0)
+	buffer_busy[rq->buffer] = 0;
+    rq->busy = false;
+    inflight--;
+    if (rq->release)
+	rq->release((unsigned char *) rq->data, rq->len, rq->opaque);
+    rq->release = NULL;
+
+    /* reported by check_error(), the caller may still wait for its payload */
+    if (err && !error)
+	error = err;
+}
+
+void GWAVIUringSink::check_error()
+{
+    if (error)
+	throw system_error(error, generic_category(), "io_uring write");
+}
+
+/**
+ * Queue the buffer being filled.
+ */
+void GWAVIUringSink::queue_buffer()
+{
+    if (cur < 0)
+	return;
+    if (cur_len) {
+	buffer_busy[cur] = 1;
+	queue_write(cur, buffers + (size_t) cur * BUFFER_SIZE, cur_len, cur_offset, NULL);
+    }
+    cur = -1;
+}
+
+void GWAVIUringSink::wait_request(int req)
+{
+    while (requests[req].busy)
+	submit(1);
+}
+
+void GWAVIUringSink::drain()
+{
+    queue_buffer();
+    while (unsubmitted || inflight)
+	submit(inflight);
+}
+
+void GWAVIUringSink::Write(const void *data, size_t len)
+{
+    size_t n;
+    int i;
+
+    while (len > 0) {
+	while (cur < 0) {
+	    for (i = 0; i < BUFFERS; i++)
+		if (!buffer_busy[i])
+		    break;
+	    if (i == BUFFERS) {
+		submit(1);
+		continue;
+	    }
+	    cur = i;
+	    cur_len = 0;
+	    cur_offset = pos;
+	}
+
+	n = BUFFER_SIZE - cur_len;
+	if (n > len)
+	    n = len;
+	memcpy(buffers + (size_t) cur * BUFFER_SIZE + cur_len, data, n);
+	cur_len += n;
+	pos += n;
+	data = (const unsigned char *) data + n;
+	len -= n;
+
+	if (cur_len == BUFFER_SIZE) {
+	    queue_buffer();
+	    submit(0);
+	}
+    }
+    check_error();
+}
+
+void GWAVIUringSink::WriteV(const struct iovec *iov, int iovcnt)
+{
+    WriteVOwned(iov, iovcnt, NULL, 0, NULL, NULL);
+}
+
+/**
+ * Small pieces are copied to the registered buffers and batched across
+ * calls. Large ones are written from their memory, queued after the
+ * buffered bytes. The owned payload stays in flight, complete() releases
+ * it; the caller's large pieces are waited for before returning.
+ */
+void GWAVIUringSink::WriteVOwned(const struct iovec *iov, int iovcnt, unsigned char *data, size_t len,
+	gwavi_release_t release, void *opaque)
+{
+    int reqs[16];
+    int i, r, n = 0;
+    bool owned;
+
+    try {
+	for (i = 0; i < iovcnt; i++) {
+	    owned = release && iov[i].iov_base == data && iov[i].iov_len == len;
+	    if (iov[i].iov_len < DIRECT_MIN || (!owned && n == 16)) {
+		Write(iov[i].iov_base, iov[i].iov_len);
+		continue;
+	    }
+	    queue_buffer();
+	    queue_write(-1, iov[i].iov_base, iov[i].iov_len, pos, &r);
+	    pos += iov[i].iov_len;
+	    if (owned) {
+		requests[r].release = release;
+		requests[r].opaque = opaque;
+		release = NULL;
+	    } else {
+		reqs[n++] = r;
+	    }
+	}
+	if (unsubmitted)
+	    submit(0);
+    } catch (...) {
+	if (release)
+	    release(data, len, opaque);
+	throw;
+    }
+    /* copied to the buffers */
+    if (release)
+	release(data, len, opaque);
+
+    for (i = 0; i < n; i++)
+	wait_request(reqs[i]);
+    check_error();
+}
+
+void GWAVIUringSink::PWrite(const void *data, size_t len, uint64_t offset)
+{
+    int req;
+
+    drain();
+    queue_write(-1, data, len, offset, &req);
+    wait_request(req);
+    check_error();
+}
+
+void GWAVIUringSink::Seek(uint64_t offset)
+{
+    drain();
+    pos = offset;
+    check_error();
+}
+
+uint64_t GWAVIUringSink::Tell()
+{
+    return pos;
+}
+
+void GWAVIUringSink::Sync()
+{
+    drain();
+    check_error();
+    if (fdatasync(fd) < 0)
+	throw system_error(errno, generic_category(), "fdatasync");
+}
+
+void GWAVIUringSink::Close()
+{
+    int r;
+
+    if (fd < 0)
+	return;
+    drain();
+    trim(fd, pos);
+    r = close(fd);
+    fd = -1;
+    destroy();
+    check_error();
+    if (r < 0)
+	throw system_error(errno, generic_category(), "close");
+}
+
+#else /* HAVE_IO_URING */
+
+GWAVIUringSink::GWAVIUringSink(const char *filename)
+{
+    throw system_error(ENOSYS, generic_category(), "io_uring");
+}
+
+GWAVIUringSink::~GWAVIUringSink()
+{
+}
+
+void GWAVIUringSink::Write(const void *buf, size_t len)
+{
+}
+
+void GWAVIUringSink::WriteV(const struct iovec *iov, int iovcnt)
+{
+}
+
+void GWAVIUringSink::WriteVOwned(const struct iovec *iov, int iovcnt, unsigned char *data, size_t len,
+	gwavi_release_t release, void *opaque)
+{
+}
+
+void GWAVIUringSink::PWrite(const void *buf, size_t len, uint64_t offset)
+{
+}
+
+void GWAVIUringSink::Seek(uint64_t offset)
+{
+}
+
+uint64_t GWAVIUringSink::Tell()
+{
+    return 0;
+}
+
+void GWAVIUringSink::Sync()
+{
+}
+
+void GWAVIUringSink::Close()
+{
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,57 @@
+/*
+ * avirecover.cpp
+ *
+ * Completes AVI files the writer did not finalize, e.g. after a crash.
+ *
+ * usage: avirecover file.avi...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <system_error>
+
+#include "GWAVIRecover.h"
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    GWAVIRecover::gwavi_recover_stats_t stats;
+    int i, ret = EXIT_SUCCESS;
+    double t0, t1;
+
+    if (argc < 2) {
+	fprintf(stderr, "usage: %s file.avi...\n", argv[0]);
+	return EXIT_FAILURE;
+    }
+
+    for (i = 1; i < argc; i++) {
+	t0 = now();
+	try {
+	    GWAVIRecover recover(argv[i]);
+	    if (recover.Recover(&stats) == -1) {
+		ret = EXIT_FAILURE;
+		continue;
+	    }
+	} catch (std::system_error& e) {
+	    fprintf(stderr, "%s: %s\n", argv[i], e.code().message().c_str());
+	    ret = EXIT_FAILURE;
+	    continue;
+	}
+	t1 = now();
+
+	if (stats.finalized) {
+	    printf("%s: complete, %llu chunks\n", argv[i], stats.chunks);
+	    continue;
+	}
+	printf("%s: %u RIFF, %llu chunks, %llu indexed, %llu bytes cut, %llu bytes, %.1f ms\n", argv[i],
+		stats.riffs, stats.chunks, stats.indexed, stats.truncated, stats.size, (t1 - t0) * 1e3);
+    }
+    return ret;
+}
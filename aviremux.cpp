@@ -0,0 +1,61 @@
+/*
+ * aviremux.cpp
+ *
+ * Joins AVI files and cuts them at key frames, the frames are copied by
+ * the kernel or shared with the inputs where the filesystem allows.
+ *
+ * usage: aviremux output.avi [-s seconds] [-e seconds] input.avi...
+ *
+ * -s and -e give the part of the next input to keep, the start moves back
+ * to the key frame before it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "GWAVIRemux.h"
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    GWAVIRemux::gwavi_remux_stats_t stats;
+    double start = 0, end = -1, t0;
+    int i;
+
+    if (argc < 3) {
+	fprintf(stderr, "usage: %s output.avi [-s seconds] [-e seconds] input.avi...\n", argv[0]);
+	return EXIT_FAILURE;
+    }
+
+    t0 = now();
+    GWAVIRemux remux(argv[1]);
+    for (i = 2; i < argc; i++) {
+	if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+	    start = atof(argv[++i]);
+	    continue;
+	}
+	if (!strcmp(argv[i], "-e") && i + 1 < argc) {
+	    end = atof(argv[++i]);
+	    continue;
+	}
+	if (remux.AddInput(argv[i], start, end) == -1)
+	    return EXIT_FAILURE;
+	start = 0;
+	end = -1;
+    }
+    if (remux.Finalize() == -1)
+	return EXIT_FAILURE;
+
+    remux.GetStats(&stats);
+    printf("%s: %u inputs, %llu frames, %llu chunks, %.1f MB (%.1f MB cloned), %.1f ms\n", argv[1], stats.inputs,
+	    stats.frames, stats.chunks, stats.bytes / 1048576.0, stats.cloned / 1048576.0, (now() - t0) * 1e3);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,1574 @@
+/*
+ * bench.cpp
+ *
+ * Throughput benchmarks of the GWAVI writer.
+ *
+ * usage: bench writev [frame_size [frames [dir]]]
+ *        bench async [frame_size [frames [queue [dir]]]]
+ *        bench direct [frame_size [frames [dir]]]
+ *        bench prealloc [frame_size [frames [files [dir]]]]
+ *        bench finalize [entries [dir]]
+ *        bench raw [frames [dir]]
+ *        bench yuv [frames [threads]]
+ *        bench rle [frames [threads [dir]]]
+ *        bench pipeline [frames [threads [dir]]]
+ *        bench interleave [frames [dir]]
+ *        bench reader [GB [dir]]
+ *        bench recover [GB [dir]]
+ *        bench segment [frames [MB [dir]]]
+ *        bench remux [GB [dir]]
+ *        bench memory [frames [frame_size [dir]]]
+ *        bench stream [frames [dir]]
+ *        bench mmap [frames [frame_size [dir]]]
+ *        bench batch [chunks [chunk_size [batch [dir]]]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+
+#include "GWAVI.h"
+#include "GWAVIPipeline.h"
+#include "GWAVIReader.h"
+#include "GWAVIRecover.h"
+#include "GWAVIRemux.h"
+#include "GWAVISegmenter.h"
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *output_names[] = { "ofstream", "fd+writev", "io_uring", "O_DIRECT" };
+
+static void release_count(unsigned char * /* data */, size_t /* len */, void *opaque)
+{
+    (*(int *) opaque)++;
+}
+
+/*
+ * Write frames of frame_size bytes (a 4K MJPEG frame is ~1 MB) through each
+ * output backend, and through io_uring once more handing the frames over
+ * with a release callback, so that their writes stay in flight.
+ */
+static int bench_writev(int argc, char **argv)
+{
+    size_t frame_size = argc > 0 ? strtoul(argv[0], NULL, 0) : 1000001;
+    int frames = argc > 1 ? atoi(argv[1]) : 1000;
+    const char *dir = argc > 2 ? argv[2] : "/tmp";
+    GWAVI::gwavi_options_t opt;
+    char filename[256];
+    unsigned char *buffer;
+    double t0, t1, t2;
+    int i, output, released;
+    bool owned;
+
+    buffer = (unsigned char *) malloc(frame_size);
+    for (i = 0; i < (int) frame_size; i++)
+	buffer[i] = (unsigned char) (i * 7);
+
+    printf("%-12s %10s %10s %12s %10s\n", "output", "frames", "MB/s", "us/frame", "finalize");
+    for (output = GWAVI::GWAVI_OUTPUT_OFSTREAM; output <= GWAVI::GWAVI_OUTPUT_URING + 1; output++) {
+	owned = output > GWAVI::GWAVI_OUTPUT_URING;
+	memset(&opt, 0, sizeof(opt));
+	opt.output = owned ? (int) GWAVI::GWAVI_OUTPUT_URING : output;
+	snprintf(filename, sizeof(filename), "%s/gwavi_bench_%d.avi", dir, output);
+
+	released = 0;
+	t0 = now();
+	GWAVI gwavi(filename, 3840, 2160, 24, "MJPG", 30, NULL, &opt);
+	/* the frames only read the buffer, it may be in flight many times */
+	for (i = 0; i < frames; i++)
+	    if (gwavi.AddVideoFrame(buffer, frame_size, owned ? release_count : NULL, &released) == -1)
+		return EXIT_FAILURE;
+	t1 = now();
+	if (gwavi.Finalize() == -1)
+	    return EXIT_FAILURE;
+	t2 = now();
+	if (owned && released != frames) {
+	    fprintf(stderr, "%d of %d frames released\n", released, frames);
+	    return EXIT_FAILURE;
+	}
+
+	printf("%-12s %10d %10.1f %12.2f %9.1fms\n", owned ? "io_uring/own" : output_names[output], frames,
+		(double) frame_size * frames / (t1 - t0) / 1e6, (t1 - t0) * 1e6 / frames, (t2 - t1) * 1e3);
+	unlink(filename);
+    }
+
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Add*Frame() latency seen by the capture thread, synchronous writes against
+ * the writer thread.
+ */
+static int bench_async(int argc, char **argv)
+{
+    size_t frame_size = argc > 0 ? strtoul(argv[0], NULL, 0) : 1000001;
+    int frames = argc > 1 ? atoi(argv[1]) : 1000;
+    unsigned int queue = argc > 2 ? atoi(argv[2]) : 64;
+    const char *dir = argc > 3 ? argv[3] : "/tmp";
+    GWAVI::gwavi_options_t opt;
+    GWAVI::gwavi_stats_t stats;
+    char filename[256];
+    unsigned char *buffer;
+    double t0, t1;
+    int i, async;
+
+    buffer = (unsigned char *) malloc(frame_size);
+    for (i = 0; i < (int) frame_size; i++)
+	buffer[i] = (unsigned char) (i * 7);
+
+    printf("%-6s %8s %10s %10s %10s %10s %8s %8s\n", "mode", "frames", "MB/s", "p50 us", "p99 us", "max us",
+	    "queued", "dropped");
+    for (async = 0; async <= 1; async++) {
+	memset(&opt, 0, sizeof(opt));
+	opt.output = GWAVI::GWAVI_OUTPUT_FD;
+	opt.async_queue = async ? queue : 0;
+	snprintf(filename, sizeof(filename), "%s/gwavi_bench_async.avi", dir);
+
+	t0 = now();
+	GWAVI gwavi(filename, 3840, 2160, 24, "MJPG", 30, NULL, &opt);
+	for (i = 0; i < frames; i++)
+	    if (gwavi.AddVideoFrame(buffer, frame_size) == -1)
+		return EXIT_FAILURE;
+	if (gwavi.Finalize() == -1)
+	    return EXIT_FAILURE;
+	t1 = now();
+
+	gwavi.GetStats(&stats);
+	printf("%-6s %8d %10.1f %10.1f %10.1f %10.1f %8u %8llu\n", async ? "async" : "sync", frames,
+		(double) frame_size * frames / (t1 - t0) / 1e6, stats.p50_ns / 1e3, stats.p99_ns / 1e3,
+		stats.max_ns / 1e3, stats.queue_max, stats.dropped);
+	unlink(filename);
+    }
+
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Pages of the file left in the page cache.
+ */
+static size_t cached_pages(const char *filename, size_t *total)
+{
+    unsigned char *vec;
+    struct stat st;
+    size_t i, n, cached = 0;
+    void *p;
+    int fd;
+
+    *total = 0;
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+	return 0;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+	close(fd);
+	return 0;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+	return 0;
+
+    n = (st.st_size + getpagesize() - 1) / getpagesize();
+    vec = (unsigned char *) malloc(n);
+    if (mincore(p, st.st_size, vec) == 0)
+	for (i = 0; i < n; i++)
+	    cached += vec[i] & 1;
+    free(vec);
+    munmap(p, st.st_size);
+
+    *total = n;
+    return cached;
+}
+
+/*
+ * Sustained throughput and page cache footprint, buffered against O_DIRECT.
+ * Use a directory on a real disk, tmpfs does not support O_DIRECT.
+ */
+static int bench_direct(int argc, char **argv)
+{
+    size_t frame_size = argc > 0 ? strtoul(argv[0], NULL, 0) : 1000001;
+    int frames = argc > 1 ? atoi(argv[1]) : 1000;
+    const char *dir = argc > 2 ? argv[2] : "/var/tmp";
+    static const int outputs[] = { GWAVI::GWAVI_OUTPUT_FD, GWAVI::GWAVI_OUTPUT_DIRECT };
+    GWAVI::gwavi_options_t opt;
+    size_t cached, total;
+    char filename[256];
+    unsigned char *buffer;
+    double t0, t1;
+    int i, k;
+
+    buffer = (unsigned char *) malloc(frame_size);
+    for (i = 0; i < (int) frame_size; i++)
+	buffer[i] = (unsigned char) (i * 7);
+
+    printf("%-10s %10s %10s %14s\n", "output", "frames", "MB/s", "cached pages");
+    for (k = 0; k < 2; k++) {
+	memset(&opt, 0, sizeof(opt));
+	opt.output = outputs[k];
+	snprintf(filename, sizeof(filename), "%s/gwavi_bench_direct.avi", dir);
+
+	t0 = now();
+	GWAVI gwavi(filename, 3840, 2160, 24, "MJPG", 30, NULL, &opt);
+	for (i = 0; i < frames; i++)
+	    if (gwavi.AddVideoFrame(buffer, frame_size) == -1)
+		return EXIT_FAILURE;
+	if (gwavi.Finalize() == -1)
+	    return EXIT_FAILURE;
+	t1 = now();
+
+	cached = cached_pages(filename, &total);
+	printf("%-10s %10d %10.1f %7zu/%zu\n", output_names[outputs[k]], frames,
+		(double) frame_size * frames / (t1 - t0) / 1e6, cached, total);
+	unlink(filename);
+    }
+
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Extents of the file, -1 if the filesystem does not tell.
+ */
+static int extent_count(const char *filename)
+{
+    struct fiemap fm;
+    int fd, r;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+	return -1;
+    fsync(fd);
+    memset(&fm, 0, sizeof(fm));
+    fm.fm_length = FIEMAP_MAX_OFFSET;
+    r = ioctl(fd, FS_IOC_FIEMAP, &fm);
+    close(fd);
+    return r < 0 ? -1 : (int) fm.fm_mapped_extents;
+}
+
+/*
+ * Several files written at once, the way a multi-camera recorder does, with
+ * and without preallocation. Interleaved appends fragment the files unless
+ * the space is reserved ahead.
+ */
+static int bench_prealloc(int argc, char **argv)
+{
+    size_t frame_size = argc > 0 ? strtoul(argv[0], NULL, 0) : 100001;
+    int frames = argc > 1 ? atoi(argv[1]) : 1000;
+    int files = argc > 2 ? atoi(argv[2]) : 4;
+    const char *dir = argc > 3 ? argv[3] : "/var/tmp";
+    GWAVI::gwavi_options_t opt;
+    GWAVI **gwavi;
+    char filename[256];
+    unsigned char *buffer;
+    double t0, t1;
+    int i, j, k, extents;
+
+    buffer = (unsigned char *) malloc(frame_size);
+    for (i = 0; i < (int) frame_size; i++)
+	buffer[i] = (unsigned char) (i * 7);
+    gwavi = new GWAVI *[files];
+
+    printf("%-10s %10s %10s %10s\n", "prealloc", "frames", "MB/s", "extents");
+    for (k = 0; k < 2; k++) {
+	memset(&opt, 0, sizeof(opt));
+	opt.output = GWAVI::GWAVI_OUTPUT_FD;
+	opt.prealloc = k ? 64 : 0;
+
+	t0 = now();
+	for (j = 0; j < files; j++) {
+	    snprintf(filename, sizeof(filename), "%s/gwavi_bench_prealloc_%d.avi", dir, j);
+	    gwavi[j] = new GWAVI(filename, 1920, 1080, 24, "MJPG", 30, NULL, &opt);
+	}
+	for (i = 0; i < frames; i++)
+	    for (j = 0; j < files; j++)
+		if (gwavi[j]->AddVideoFrame(buffer, frame_size) == -1)
+		    return EXIT_FAILURE;
+	for (j = 0; j < files; j++) {
+	    if (gwavi[j]->Finalize() == -1)
+		return EXIT_FAILURE;
+	    delete gwavi[j];
+	}
+	t1 = now();
+
+	extents = 0;
+	for (j = 0; j < files; j++) {
+	    snprintf(filename, sizeof(filename), "%s/gwavi_bench_prealloc_%d.avi", dir, j);
+	    extents += extent_count(filename);
+	    unlink(filename);
+	}
+	printf("%-10s %10d %10.1f %10.1f\n", k ? "64 MB" : "off", frames * files,
+		(double) frame_size * frames * files / (t1 - t0) / 1e6, (double) extents / files);
+    }
+
+    delete[] gwavi;
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Finalize() latency with large indexes, 1M and 10M chunks by default. The
+ * frames are tiny, so the time goes into the index.
+ */
+static int bench_finalize(int argc, char **argv)
+{
+    static const unsigned long defaults[] = { 1000000, 10000000 };
+    const char *dir = argc > 1 ? argv[1] : "/tmp";
+    GWAVI::gwavi_options_t opt;
+    char filename[256];
+    unsigned char buffer[256] = { 0 };
+    unsigned long entries;
+    double t0, t1, t2;
+    unsigned long i;
+    int k, odml;
+
+    printf("%-8s %10s %10s %12s\n", "index", "entries", "write s", "finalize ms");
+    for (k = 0; k < 2; k++) {
+	if (argc > 0) {
+	    if (k)
+		break;
+	    entries = strtoul(argv[0], NULL, 0);
+	} else {
+	    entries = defaults[k];
+	}
+	for (odml = 0; odml < 2; odml++) {
+	    memset(&opt, 0, sizeof(opt));
+	    opt.output = GWAVI::GWAVI_OUTPUT_FD;
+	    opt.odml = odml;
+	    snprintf(filename, sizeof(filename), "%s/gwavi_bench_finalize.avi", dir);
+
+	    t0 = now();
+	    GWAVI gwavi(filename, 320, 240, 24, "MJPG", 30, NULL, &opt);
+	    for (i = 0; i < entries; i++)
+		if (gwavi.AddVideoFrame(buffer, sizeof(buffer)) == -1)
+		    return EXIT_FAILURE;
+	    t1 = now();
+	    if (gwavi.Finalize() == -1)
+		return EXIT_FAILURE;
+	    t2 = now();
+
+	    printf("%-8s %10lu %10.2f %12.1f\n", odml ? "OpenDML" : "idx1", entries, t1 - t0,
+		    (t2 - t1) * 1e3);
+	    unlink(filename);
+	}
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static const struct {
+    unsigned int width, height;
+} resolutions[] = { { 640, 480 }, { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 } };
+
+static const char *simd_names[] = { "C", "SSSE3", "AVX2" };
+static const char *pix_names[] = { "RGB24", "BGR24", "RGBA", "BGRA" };
+
+/*
+ * Raw frame ingest: pixel conversion alone for every instruction set, then
+ * AddRawVideoFrame() into a file. Every instruction set has to give the
+ * frame of the C code.
+ */
+static int bench_raw(int argc, char **argv)
+{
+    int frames = argc > 0 ? atoi(argv[0]) : 100;
+    const char *dir = argc > 1 ? argv[1] : "/tmp";
+    static const int formats[] = { GWAVI::GWAVI_PIX_RGB24, GWAVI::GWAVI_PIX_RGBA, GWAVI::GWAVI_PIX_BGRA };
+    unsigned int width, height, bpp;
+    GWAVI::gwavi_options_t opt;
+    char filename[256];
+    unsigned char *pixels, *dib, *ref;
+    double t0, t1, mb;
+    size_t size;
+    int r, f, level, max, i;
+
+    max = GWAVIConvert::GetSimd();
+    printf("%-10s %-6s %4s %-6s %10s\n", "size", "input", "bpp", "simd", "MB/s");
+    for (r = 0; r < (int) (sizeof(resolutions) / sizeof(resolutions[0])); r++) {
+	width = resolutions[r].width;
+	height = resolutions[r].height;
+	pixels = (unsigned char *) malloc((size_t) width * height * 4);
+	dib = (unsigned char *) malloc(GWAVIConvert::DibStride(width, 32) * height);
+	ref = (unsigned char *) malloc(GWAVIConvert::DibStride(width, 32) * height);
+	for (i = 0; i < (int) (width * height * 4); i++)
+	    pixels[i] = (unsigned char) (i * 7);
+
+	for (f = 0; f < 3; f++) {
+	    bpp = formats[f] == GWAVI::GWAVI_PIX_RGB24 ? 24 : 32;
+	    mb = (double) width * height * GWAVIConvert::PixelSize(formats[f]) * frames / 1e6;
+	    size = GWAVIConvert::DibStride(width, bpp) * height;
+	    for (level = GWAVIConvert::SIMD_NONE; level <= max; level++) {
+		GWAVIConvert::SetSimd(level);
+		GWAVIConvert::ToDib(pixels, (size_t) width * GWAVIConvert::PixelSize(formats[f]), formats[f], width,
+			height, level == GWAVIConvert::SIMD_NONE ? ref : dib, bpp);
+		if (level != GWAVIConvert::SIMD_NONE && memcmp(dib, ref, size)) {
+		    fprintf(stderr, "%ux%u %s %s differs from C\n", width, height, pix_names[formats[f]],
+			    simd_names[level]);
+		    return EXIT_FAILURE;
+		}
+		t0 = now();
+		for (i = 0; i < frames; i++)
+		    GWAVIConvert::ToDib(pixels, (size_t) width * GWAVIConvert::PixelSize(formats[f]), formats[f],
+			    width, height, dib, bpp);
+		t1 = now();
+		printf("%4ux%-5u %-6s %4u %-6s %10.1f\n", width, height, pix_names[formats[f]], bpp,
+			simd_names[level], mb / (t1 - t0));
+	    }
+
+	    memset(&opt, 0, sizeof(opt));
+	    opt.output = GWAVI::GWAVI_OUTPUT_FD;
+	    snprintf(filename, sizeof(filename), "%s/gwavi_bench_raw.avi", dir);
+	    t0 = now();
+	    GWAVI gwavi(filename, width, height, bpp, "DIB ", 30, NULL, &opt);
+	    for (i = 0; i < frames; i++)
+		if (gwavi.AddRawVideoFrame(pixels, 0, formats[f]) == -1)
+		    return EXIT_FAILURE;
+	    if (gwavi.Finalize() == -1)
+		return EXIT_FAILURE;
+	    t1 = now();
+	    printf("%4ux%-5u %-6s %4u %-6s %10.1f\n", width, height, pix_names[formats[f]], bpp, "write",
+		    mb / (t1 - t0));
+	    unlink(filename);
+	}
+	free(ref);
+	free(dib);
+	free(pixels);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * RGB to YUV conversion of RGB24 and BGRA frames per resolution, output
+ * format and instruction set. Every instruction set has to give the frame
+ * of the C code.
+ */
+static int bench_yuv(int argc, char **argv)
+{
+    int frames = argc > 0 ? atoi(argv[0]) : 100;
+    unsigned int threads = argc > 1 ? atoi(argv[1]) : 1;
+    static const char *yuv_names[] = { "YUY2", "I420", "YV12", "NV12" };
+    static const int formats[] = { GWAVI::GWAVI_PIX_RGB24, GWAVI::GWAVI_PIX_BGRA };
+    static const int yuvs[] = { GWAVIConvert::YUV_YUY2, GWAVIConvert::YUV_I420, GWAVIConvert::YUV_NV12 };
+    GWAVIConvert::Pool pool(threads);
+    unsigned int width, height;
+    unsigned char *pixels, *yuv, *ref;
+    double t0, t1, mpix;
+    size_t size;
+    int r, f, y, level, max, i;
+
+    max = GWAVIConvert::GetSimd();
+    printf("%-10s %-6s %-5s %-6s %10s\n", "size", "input", "yuv", "simd", "Mpix/s");
+    for (r = 0; r < (int) (sizeof(resolutions) / sizeof(resolutions[0])); r++) {
+	width = resolutions[r].width;
+	height = resolutions[r].height;
+	pixels = (unsigned char *) malloc((size_t) width * height * 4);
+	yuv = (unsigned char *) malloc((size_t) width * height * 2);
+	ref = (unsigned char *) malloc((size_t) width * height * 2);
+	for (i = 0; i < (int) (width * height * 4); i++)
+	    pixels[i] = (unsigned char) (i * 7);
+	mpix = (double) width * height * frames / 1e6;
+
+	for (f = 0; f < 2; f++) {
+	    for (y = 0; y < 3; y++) {
+		size = GWAVIConvert::YuvSize(yuvs[y], width, height);
+		for (level = GWAVIConvert::SIMD_NONE; level <= max; level++) {
+		    GWAVIConvert::SetSimd(level);
+		    GWAVIConvert::ToYuv(pixels, (size_t) width * GWAVIConvert::PixelSize(formats[f]), formats[f], width,
+			    height, level == GWAVIConvert::SIMD_NONE ? ref : yuv, yuvs[y], &pool);
+		    if (level != GWAVIConvert::SIMD_NONE && memcmp(yuv, ref, size)) {
+			fprintf(stderr, "%ux%u %s %s %s differs from C\n", width, height, pix_names[formats[f]],
+				yuv_names[yuvs[y]], simd_names[level]);
+			return EXIT_FAILURE;
+		    }
+		    t0 = now();
+		    for (i = 0; i < frames; i++)
+			GWAVIConvert::ToYuv(pixels, (size_t) width * GWAVIConvert::PixelSize(formats[f]), formats[f],
+				width, height, yuv, yuvs[y], &pool);
+		    t1 = now();
+		    printf("%4ux%-5u %-6s %-5s %-6s %10.1f\n", width, height, pix_names[formats[f]],
+			    yuv_names[yuvs[y]], simd_names[level], mpix / (t1 - t0));
+		}
+	    }
+	}
+	free(ref);
+	free(yuv);
+	free(pixels);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * A 2560x1440 palette desktop: flat windows with lines of "text", a cursor
+ * moving every frame, typing in one window and a scroll now and then.
+ */
+static void desktop_frame(unsigned char *p, unsigned int width, unsigned int height, int frame)
+{
+    unsigned int x, y, x0, y0;
+
+    if (frame == 0) {
+	memset(p, 17, (size_t) width * height);
+	for (y = 100; y < height - 100; y++)
+	    for (x = 200; x < width - 200; x++)
+		p[y * width + x] = y < 130 ? 40 : (y % 20 < 12 && x % 9 < 6 && (x * 7 + y) % 13 < 9) ? 0 : 255;
+    }
+
+    /* scroll the window by a text line */
+    if (frame % 60 == 59)
+	for (y = 130; y + 20 < height - 100; y++)
+	    memcpy(p + y * width + 200, p + (y + 20) * width + 200, width - 400);
+
+    /* type a character */
+    x0 = 220 + (frame * 9) % (width - 460);
+    y0 = height - 140;
+    for (y = y0; y < y0 + 12; y++)
+	for (x = x0; x < x0 + 6; x++)
+	    p[y * width + x] = (x + y + frame) % 3 ? 0 : 255;
+
+    /* move the cursor */
+    x0 = (frame * 37) % (width - 16);
+    y0 = (frame * 23) % (height - 16);
+    for (y = y0; y < y0 + 16; y++)
+	for (x = x0; x < x0 + 16 - (y - y0); x++)
+	    p[y * width + x] = 1;
+}
+
+/*
+ * Decode a BI_RLE8 bitmap onto a top-down frame that holds the previous one,
+ * false if it runs past the frame or the data.
+ */
+static bool rle8_decode(const unsigned char *s, size_t len, unsigned char *p, unsigned int width,
+	unsigned int height)
+{
+    const unsigned char *end = s + len;
+    unsigned int x = 0, y = 0, n; /* y counts rows from the bottom */
+
+    while (s + 2 <= end) {
+	n = s[0];
+	if (n) {
+	    if (y >= height || x + n > width)
+		return false;
+	    memset(p + (size_t) (height - 1 - y) * width + x, s[1], n);
+	    x += n;
+	    s += 2;
+	    continue;
+	}
+	n = s[1];
+	s += 2;
+	if (n == 0) { /* end of line */
+	    x = 0;
+	    y++;
+	} else if (n == 1) { /* end of bitmap */
+	    return true;
+	} else if (n == 2) { /* delta */
+	    if (s + 2 > end)
+		return false;
+	    x += s[0];
+	    y += s[1];
+	    s += 2;
+	} else {
+	    if (y >= height || x + n > width || s + n > end)
+		return false;
+	    memcpy(p + (size_t) (height - 1 - y) * width + x, s, n);
+	    x += n;
+	    s += n + (n & 1);
+	}
+    }
+    return false;
+}
+
+/*
+ * Encode a key frame and a delta frame and decode them again.
+ */
+static bool rle8_round_trip(unsigned char *pixels, unsigned char *prev, unsigned char *rle, unsigned char *out,
+	unsigned int width, unsigned int height, GWAVIConvert::Pool *pool)
+{
+    size_t len;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+	desktop_frame(pixels, width, height, i);
+	len = GWAVIConvert::ToRle8(pixels, width, i ? prev : NULL, width, height, rle, pool);
+	if (!rle8_decode(rle, len, out, width, height) || memcmp(out, pixels, (size_t) width * height))
+	    return false;
+	memcpy(prev, pixels, (size_t) width * height);
+    }
+    return true;
+}
+
+/*
+ * MRLE encoding of desktop content: frame rate and size against raw 8 bit
+ * and 24 bit frames. The frames of every instruction set have to decode to
+ * the source.
+ */
+static int bench_rle(int argc, char **argv)
+{
+    int frames = argc > 0 ? atoi(argv[0]) : 300;
+    unsigned int threads = argc > 1 ? atoi(argv[1]) : 1;
+    const char *dir = argc > 2 ? argv[2] : "/tmp";
+    const unsigned int width = 2560, height = 1440;
+    GWAVIConvert::Pool pool(threads);
+    GWAVI::gwavi_options_t opt;
+    char filename[256];
+    unsigned char *pixels, *prev, *rle, *out;
+    unsigned long long bytes = 0;
+    double t0, t1, raw;
+    struct stat st;
+    int i, level, max;
+
+    pixels = (unsigned char *) malloc((size_t) width * height);
+    prev = (unsigned char *) malloc((size_t) width * height);
+    rle = (unsigned char *) malloc(GWAVIConvert::Rle8Bound(width, height));
+    out = (unsigned char *) malloc((size_t) width * height);
+    raw = (double) width * height * frames;
+
+    max = GWAVIConvert::GetSimd();
+    printf("%-6s %8s %10s %10s %10s\n", "simd", "threads", "fps", "vs 8 bit", "vs RGB24");
+    for (level = GWAVIConvert::SIMD_NONE; level <= max; level++) {
+	GWAVIConvert::SetSimd(level);
+	if (!rle8_round_trip(pixels, prev, rle, out, width, height, &pool)) {
+	    fprintf(stderr, "%s RLE8 frames do not decode to the source\n", simd_names[level]);
+	    return EXIT_FAILURE;
+	}
+	bytes = 0;
+	t0 = now();
+	for (i = 0; i < frames; i++) {
+	    desktop_frame(pixels, width, height, i);
+	    bytes += GWAVIConvert::ToRle8(pixels, width, i ? prev : NULL, width, height, rle, &pool);
+	    memcpy(prev, pixels, (size_t) width * height);
+	}
+	t1 = now();
+	printf("%-6s %8u %10.1f %9.1fx %9.1fx\n", simd_names[level], threads, frames / (t1 - t0), raw / bytes,
+		raw * 3 / bytes);
+    }
+
+    memset(&opt, 0, sizeof(opt));
+    opt.output = GWAVI::GWAVI_OUTPUT_FD;
+    opt.convert_threads = threads;
+    snprintf(filename, sizeof(filename), "%s/gwavi_bench_rle.avi", dir);
+    t0 = now();
+    {
+	GWAVI gwavi(filename, width, height, 8, "MRLE", 60, NULL, &opt);
+	for (i = 0; i < frames; i++) {
+	    desktop_frame(pixels, width, height, i);
+	    if (gwavi.AddRawVideoFrame(pixels, 0, GWAVI::GWAVI_PIX_PAL8) == -1)
+		return EXIT_FAILURE;
+	}
+	if (gwavi.Finalize() == -1)
+	    return EXIT_FAILURE;
+    }
+    t1 = now();
+    stat(filename, &st);
+    printf("%-6s %8u %10.1f %9.1fx %9.1fx (file, key frame every 250)\n", "write", threads, frames / (t1 - t0),
+	    raw / st.st_size, raw * 3 / st.st_size);
+    unlink(filename);
+
+    free(out);
+    free(rle);
+    free(prev);
+    free(pixels);
+    return EXIT_SUCCESS;
+}
+
+static void release_frame(unsigned char *data, size_t /* len */, void * /* opaque */)
+{
+    delete[] data;
+}
+
+/* RGB24 to I420, the source frame is borrowed */
+static int yuv_stage(GWAVIPipeline::gwavi_job_t *job, void *opaque)
+{
+    const unsigned int *size = (const unsigned int *) opaque;
+    size_t len = GWAVIConvert::YuvSize(GWAVIConvert::YUV_I420, size[0], size[1]);
+    unsigned char *yuv = new unsigned char[len];
+
+    if (GWAVIConvert::ToYuv(job->data, (size_t) size[0] * 3, GWAVIConvert::PIX_RGB24, size[0], size[1], yuv,
+	    GWAVIConvert::YUV_I420) == -1) {
+	delete[] yuv;
+	return -1;
+    }
+    GWAVIPipeline::SetData(job, yuv, len, release_frame, NULL);
+    return 0;
+}
+
+/*
+ * 1080p RGB24 frames converted to I420 and written through the pipeline
+ * with 1 to threads workers, with the time spent in each stage.
+ */
+static int bench_pipeline(int argc, char **argv)
+{
+    int frames = argc > 0 ? atoi(argv[0]) : 300;
+    unsigned int threads = argc > 1 ? atoi(argv[1]) : 4;
+    const char *dir = argc > 2 ? argv[2] : "/tmp";
+    unsigned int size[2] = { 1920, 1080 };
+    GWAVIPipeline::gwavi_stage_stats_t stats;
+    GWAVI::gwavi_options_t opt;
+    char filename[256];
+    unsigned char *pixels[8];
+    double t0, t1;
+    unsigned int n, s;
+    int i, ret;
+
+    for (i = 0; i < 8; i++) {
+	pixels[i] = (unsigned char *) malloc((size_t) size[0] * size[1] * 3);
+	memset(pixels[i], i * 31, (size_t) size[0] * size[1] * 3);
+    }
+
+    memset(&opt, 0, sizeof(opt));
+    opt.output = GWAVI::GWAVI_OUTPUT_FD;
+    snprintf(filename, sizeof(filename), "%s/gwavi_bench_pipeline.avi", dir);
+    printf("%8s %10s %10s %-8s %10s %10s\n", "threads", "fps", "reorder", "stage", "avg ms", "max ms");
+    for (n = 1; n <= threads; n++) {
+	GWAVI gwavi(filename, size[0], size[1], 12, "I420", 30, NULL, &opt);
+	GWAVIPipeline pipeline(&gwavi, n, 0);
+
+	pipeline.AddStage("yuv", yuv_stage, size);
+	t0 = now();
+	for (i = 0; i < frames; i++)
+	    if (pipeline.Submit(i, 0, pixels[i % 8], (size_t) size[0] * size[1] * 3, NULL, NULL) == -1)
+		return EXIT_FAILURE;
+	ret = pipeline.Flush();
+	if (ret == -1 || gwavi.Finalize() == -1)
+	    return EXIT_FAILURE;
+	t1 = now();
+
+	printf("%8u %10.1f %10u", n, frames / (t1 - t0), pipeline.GetReorderMax());
+	for (s = 0; s < pipeline.GetStageCount(); s++) {
+	    pipeline.GetStageStats(s, &stats);
+	    printf("%s%-8s %10.2f %10.2f\n", s ? "                                 " : " ", stats.name,
+		    stats.frames ? stats.total_ns / 1e6 / stats.frames : 0.0, stats.max_ns / 1e6);
+	}
+	unlink(filename);
+    }
+
+    for (i = 0; i < 8; i++)
+	free(pixels[i]);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Walk the chunks of an AVI 1.0 file with video stream 0 at fps and audio
+ * stream 1 at bps bytes per second. Reports how far each audio chunk is
+ * from the video frame playing at its start.
+ */
+static void av_distance(const char *filename, unsigned int fps, unsigned int bps, double *avg, double *max)
+{
+    std::vector<uint64_t> video, audio_pos;
+    std::vector<double> audio_time;
+    unsigned char *p, *end, *q;
+    uint64_t bytes = 0, size, d, sum = 0;
+    struct stat st;
+    size_t i, v;
+    int fd;
+
+    *avg = 0;
+    *max = 0;
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+	return;
+    fstat(fd, &st);
+    p = (unsigned char *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+	return;
+
+    end = p + st.st_size;
+    for (q = p + 12; q + 8 <= end; q += 8 + size + (size & 1)) {
+	size = q[4] | q[5] << 8 | q[6] << 16 | (uint64_t) q[7] << 24;
+	if (!memcmp(q, "LIST", 4) && !memcmp(q + 8, "movi", 4)) {
+	    size = 4;
+	} else if (!memcmp(q, "00dc", 4)) {
+	    video.push_back(q - p);
+	} else if (!memcmp(q, "01wb", 4)) {
+	    audio_pos.push_back(q - p);
+	    audio_time.push_back((double) bytes / bps);
+	    bytes += size;
+	}
+    }
+    munmap(p, st.st_size);
+
+    for (i = 0; i < audio_pos.size(); i++) {
+	v = (size_t) (audio_time[i] * fps);
+	if (v >= video.size())
+	    v = video.size() - 1;
+	d = audio_pos[i] > video[v] ? audio_pos[i] - video[v] : video[v] - audio_pos[i];
+	sum += d;
+	if (d > *max)
+	    *max = d;
+    }
+    if (!audio_pos.empty())
+	*avg = (double) sum / audio_pos.size();
+}
+
+/*
+ * 100 KB video frames at 30 fps with the audio delivered in one second
+ * bursts, written as it comes and interleaved.
+ */
+static int bench_interleave(int argc, char **argv)
+{
+    int frames = argc > 0 ? atoi(argv[0]) : 1800;
+    const char *dir = argc > 1 ? argv[1] : "/tmp";
+    GWAVI::gwavi_audio_t audio = { 2, 16, 48000 };
+    const size_t frame_size = 100000, burst = 192000;
+    GWAVI::gwavi_options_t opt;
+    char filename[256];
+    unsigned char *buffer;
+    double t0, t1, avg, max;
+    int i, mode;
+
+    buffer = (unsigned char *) malloc(burst);
+    memset(buffer, 0x55, burst);
+    snprintf(filename, sizeof(filename), "%s/gwavi_bench_interleave.avi", dir);
+
+    printf("%-12s %10s %14s %14s\n", "mode", "fps", "avg A/V KB", "max A/V KB");
+    for (mode = 0; mode < 2; mode++) {
+	memset(&opt, 0, sizeof(opt));
+	opt.output = GWAVI::GWAVI_OUTPUT_FD;
+	opt.interleave = mode;
+
+	t0 = now();
+	{
+	    GWAVI gwavi(filename, 1920, 1080, 24, "MJPG", 30, &audio, &opt);
+	    for (i = 0; i < frames; i++) {
+		if (gwavi.AddVideoFrame(buffer, frame_size) == -1)
+		    return EXIT_FAILURE;
+		if (i % 30 == 29 && gwavi.AddAudioFrame(buffer, burst) == -1)
+		    return EXIT_FAILURE;
+	    }
+	    if (gwavi.Finalize() == -1)
+		return EXIT_FAILURE;
+	}
+	t1 = now();
+
+	av_distance(filename, 30, 192000, &avg, &max);
+	printf("%-12s %10.1f %14.1f %14.1f\n", mode ? "interleaved" : "as added", frames / (t1 - t0), avg / 1024,
+		max / 1024);
+	unlink(filename);
+    }
+
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Index load time and random frame access of a multi-GB OpenDML file and a
+ * 1 GB AVI 1.0 file, 64 KB video frames with 48 kHz audio.
+ */
+static int bench_reader(int argc, char **argv)
+{
+    double gb = argc > 0 ? atof(argv[0]) : 4;
+    const char *dir = argc > 1 ? argv[1] : "/tmp";
+    static const char *index_names[] = { "ODML", "idx1", "scan" };
+    GWAVI::gwavi_audio_t audio = { 2, 16, 48000 };
+    const size_t frame_size = 65536, audio_size = 6400, reads = 1000000;
+    GWAVI::gwavi_options_t opt;
+    char filename[256];
+    unsigned char *buffer;
+    const unsigned char *p;
+    unsigned long frames;
+    volatile unsigned int sum = 0; /* keeps the reads */
+    volatile long key = 0;
+    double t0, t1, t2, t3, t4;
+    size_t len, n, r, i;
+    int odml;
+
+    buffer = (unsigned char *) malloc(frame_size);
+    memset(buffer, 0x55, frame_size);
+    snprintf(filename, sizeof(filename), "%s/gwavi_bench_reader.avi", dir);
+
+    printf("%-5s %8s %10s %12s %14s %12s\n", "index", "GB", "frames", "open ms", "ns/frame", "ns/seek");
+    for (odml = 1; odml >= 0; odml--) {
+	memset(&opt, 0, sizeof(opt));
+	opt.output = GWAVI::GWAVI_OUTPUT_FD;
+	opt.odml = odml;
+	frames = (odml ? gb : 0.99) * (1 << 30) / (frame_size + audio_size + 16);
+	{
+	    GWAVI gwavi(filename, 1920, 1080, 24, "MJPG", 30, &audio, &opt);
+	    for (i = 0; i < frames; i++)
+		if (gwavi.AddVideoFrame(buffer, frame_size, i % 30 == 0) == -1
+			|| gwavi.AddAudioFrame(buffer, audio_size) == -1)
+		    return EXIT_FAILURE;
+	    if (gwavi.Finalize() == -1)
+		return EXIT_FAILURE;
+	}
+
+	/* the second open runs from the page cache */
+	for (i = 0; i < 2; i++) {
+	    t0 = now();
+	    GWAVIReader reader(filename);
+	    t1 = now();
+	    if (i == 0)
+		continue;
+
+	    n = reader.GetFrameCount(0);
+	    t2 = now();
+	    for (r = 0; r < reads; r++) {
+		p = reader.GetFrame(0, (r * 2654435761u) % n, &len);
+		sum += p[0] + p[len - 1];
+	    }
+	    t3 = now();
+	    /* a key frame every 30 frames */
+	    for (r = 0; r < reads; r++)
+		key = key + reader.FindKeyframe(0, (r * 2654435761u) % n);
+	    t4 = now();
+	    printf("%-5s %8.2f %10zu %12.2f %14.1f %12.1f\n", index_names[reader.GetIndexType()],
+		    frames * (frame_size + audio_size) / 1073741824.0, n, (t1 - t0) * 1e3, (t3 - t2) * 1e9 / reads,
+		    (t4 - t3) * 1e9 / reads);
+	}
+	unlink(filename);
+    }
+
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Read a file with the page cache dropped first.
+ *
+ * @return seconds.
+ */
+static double cold_read(const char *filename)
+{
+    static char buffer[1 << 20];
+    double t0;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+	return 0;
+    (void) fdatasync(fd);
+    (void) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    t0 = now();
+    while (read(fd, buffer, sizeof(buffer)) > 0)
+	;
+    t0 = now() - t0;
+    (void) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    return t0;
+}
+
+/*
+ * The recovered file reads back with every frame bench_recover() wrote: its
+ * size, fill byte and key frame flag. Delta frames behind the last checkpoint
+ * come back as key frames, the flags up to the last delta frame recovered
+ * have to match.
+ */
+static bool recovered(const char *filename, unsigned long frames, size_t frame_size, size_t audio_size)
+{
+    GWAVIReader reader(filename);
+    const unsigned char *p, *a;
+    size_t len, alen;
+    unsigned long i, last = 0;
+
+    if (reader.GetFrameCount(0) != frames || reader.GetFrameCount(1) != frames) {
+	fprintf(stderr, "%zu video and %zu audio chunks recovered, %lu written\n", reader.GetFrameCount(0),
+		reader.GetFrameCount(1), frames);
+	return false;
+    }
+    for (i = 0; i < frames; i++)
+	if (!reader.IsKeyframe(0, i))
+	    last = i;
+    for (i = 0; i < frames; i++) {
+	p = reader.GetFrame(0, i, &len);
+	a = reader.GetFrame(1, i, &alen);
+	if (len != frame_size || p[0] != 0x55 || p[len - 1] != 0x55 || alen != audio_size || a[0] != 0x55
+		|| a[alen - 1] != 0x55 || (i % 30 == 0 && !reader.IsKeyframe(0, i))
+		|| (i <= last && reader.IsKeyframe(0, i) != (i % 30 == 0))) {
+	    fprintf(stderr, "frame %lu differs after recovery\n", i);
+	    return false;
+	}
+    }
+    return true;
+}
+
+/*
+ * Write an OpenDML file with crash checkpoints, kill the writer before
+ * Finalize() and recover the file from a cold page cache, compared with
+ * reading it once. The recovered file has to hold every frame.
+ */
+static int bench_recover(int argc, char **argv)
+{
+    double gb = argc > 0 ? atof(argv[0]) : 2;
+    const char *dir = argc > 1 ? argv[1] : "/tmp";
+    static const unsigned int intervals[] = { 0, 1000, 100 };
+    GWAVI::gwavi_audio_t audio = { 2, 16, 48000 };
+    const size_t frame_size = 262144, audio_size = 6400;
+    GWAVIRecover::gwavi_recover_stats_t rs;
+    GWAVI::gwavi_options_t opt;
+    char filename[256];
+    unsigned char *buffer;
+    unsigned long frames, i;
+    double t0, t1, write_s, read_s, bytes;
+    unsigned int k;
+    pid_t pid;
+    int status;
+
+    buffer = (unsigned char *) malloc(frame_size);
+    memset(buffer, 0x55, frame_size);
+    snprintf(filename, sizeof(filename), "%s/gwavi_bench_recover.avi", dir);
+    frames = gb * (1 << 30) / (frame_size + audio_size + 16);
+    bytes = frames * (frame_size + audio_size);
+
+    printf("%-14s %10s %12s %12s %10s\n", "checkpoint ms", "write MB/s", "read MB/s", "recover MB/s", "chunks");
+    for (k = 0; k < sizeof(intervals) / sizeof(intervals[0]); k++) {
+	t0 = now();
+	pid = fork();
+	if (pid == 0) {
+	    memset(&opt, 0, sizeof(opt));
+	    opt.output = GWAVI::GWAVI_OUTPUT_FD;
+	    opt.odml = 1;
+	    opt.checkpoint_interval = intervals[k];
+	    GWAVI gwavi(filename, 1920, 1080, 24, "MJPG", 30, &audio, &opt);
+	    for (i = 0; i < frames; i++)
+		if (gwavi.AddVideoFrame(buffer, frame_size, i % 30 == 0) == -1
+			|| gwavi.AddAudioFrame(buffer, audio_size) == -1)
+		    _exit(EXIT_FAILURE);
+	    /* the process dies before Finalize() */
+	    _exit(EXIT_SUCCESS);
+	}
+	if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+	    return EXIT_FAILURE;
+	write_s = now() - t0;
+
+	/* the second cold_read() drops the pages of the first */
+	read_s = cold_read(filename);
+	cold_read(filename);
+	t0 = now();
+	{
+	    GWAVIRecover recover(filename);
+	    if (recover.Recover(&rs) == -1)
+		return EXIT_FAILURE;
+	}
+	t1 = now();
+	printf("%-14u %10.1f %12.1f %12.1f %10llu\n", intervals[k], bytes / write_s / 1e6, bytes / read_s / 1e6,
+		bytes / (t1 - t0) / 1e6, rs.chunks);
+	if (!recovered(filename, frames, frame_size, audio_size))
+	    return EXIT_FAILURE;
+	unlink(filename);
+    }
+
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Capture latency across file boundaries: closing a file and opening the
+ * next one on the capture path, against GWAVISegmenter.
+ */
+static int bench_segment(int argc, char **argv)
+{
+    int frames = argc > 0 ? atoi(argv[0]) : 3000;
+    unsigned int max_size = argc > 1 ? atoi(argv[1]) : 64;
+    const char *dir = argc > 2 ? argv[2] : "/tmp";
+    GWAVI::gwavi_audio_t audio = { 2, 16, 48000 };
+    const size_t frame_size = 262144, audio_size = 6400;
+    GWAVISegmenter::gwavi_segment_options_t seg;
+    GWAVI::gwavi_options_t opt;
+    std::vector<double> lat, edge;
+    char pattern[256], filename[256];
+    unsigned char *buffer;
+    unsigned int n, segments;
+    uint64_t bytes;
+    double t0, t1;
+    int i, mode, r;
+
+    buffer = (unsigned char *) malloc(frame_size);
+    memset(buffer, 0x55, frame_size);
+    snprintf(pattern, sizeof(pattern), "%s/gwavi_bench_segment_%%03u.avi", dir);
+    memset(&opt, 0, sizeof(opt));
+    opt.output = GWAVI::GWAVI_OUTPUT_FD;
+    memset(&seg, 0, sizeof(seg));
+    seg.max_size = max_size;
+
+    printf("%-10s %8s %10s %10s %10s %14s %14s\n", "mode", "files", "p50 us", "p99 us", "max us", "switch p50 us",
+	    "switch max us");
+    for (mode = 0; mode <= 1; mode++) {
+	lat.clear();
+	edge.clear();
+	segments = 1;
+	if (mode == 0) {
+	    bytes = 0;
+	    snprintf(filename, sizeof(filename), pattern, 0);
+	    GWAVI *gwavi = new GWAVI(filename, 1920, 1080, 24, "MJPG", 30, &audio, &opt);
+	    for (i = 0; i < frames; i++) {
+		t0 = now();
+		if (bytes + frame_size > (uint64_t) max_size << 20) {
+		    r = gwavi->Finalize();
+		    delete gwavi;
+		    snprintf(filename, sizeof(filename), pattern, segments++);
+		    gwavi = new GWAVI(filename, 1920, 1080, 24, "MJPG", 30, &audio, &opt);
+		    bytes = 0;
+		    if (r == -1)
+			return EXIT_FAILURE;
+		}
+		if (gwavi->AddVideoFrame(buffer, frame_size) == -1 || gwavi->AddAudioFrame(buffer, audio_size) == -1)
+		    return EXIT_FAILURE;
+		t1 = now();
+		(bytes == 0 ? edge : lat).push_back(t1 - t0);
+		bytes += frame_size + audio_size + 48;
+	    }
+	    if (gwavi->Finalize() == -1)
+		return EXIT_FAILURE;
+	    delete gwavi;
+	} else {
+	    GWAVISegmenter segmenter(pattern, 1920, 1080, 24, "MJPG", 30, &audio, &opt, &seg);
+	    for (i = 0; i < frames; i++) {
+		n = segmenter.GetSegment();
+		t0 = now();
+		if (segmenter.AddVideoFrame(buffer, frame_size) == -1
+			|| segmenter.AddAudioFrame(buffer, audio_size) == -1)
+		    return EXIT_FAILURE;
+		t1 = now();
+		(segmenter.GetSegment() != n ? edge : lat).push_back(t1 - t0);
+	    }
+	    segments = segmenter.GetSegment() + 1;
+	    if (segmenter.Finalize() == -1)
+		return EXIT_FAILURE;
+	}
+
+	lat.insert(lat.end(), edge.begin(), edge.end());
+	std::sort(lat.begin(), lat.end());
+	std::sort(edge.begin(), edge.end());
+	if (edge.empty())
+	    edge.push_back(0);
+	printf("%-10s %8u %10.1f %10.1f %10.1f %14.1f %14.1f\n", mode ? "background" : "inline", segments,
+		lat[lat.size() / 2] * 1e6, lat[lat.size() - 1 - lat.size() / 100] * 1e6, lat.back() * 1e6,
+		edge[edge.size() / 2] * 1e6, edge.back() * 1e6);
+	for (n = 0; n < segments; n++) {
+	    snprintf(filename, sizeof(filename), pattern, n);
+	    unlink(filename);
+	}
+    }
+
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Join two files and cut a clip out of one from a cold page cache: every
+ * frame read and written again with GWAVIReader and GWAVI, against
+ * GWAVIRemux, which leaves the copying to the kernel.
+ */
+static int bench_remux(int argc, char **argv)
+{
+    double gb = argc > 0 ? atof(argv[0]) : 2;
+    const char *dir = argc > 1 ? argv[1] : "/tmp";
+    GWAVI::gwavi_audio_t audio = { 2, 16, 48000 };
+    const size_t frame_size = 262144, audio_size = 6400;
+    GWAVIRemux::gwavi_remux_stats_t rs;
+    GWAVI::gwavi_options_t opt;
+    char input[2][256], output[256];
+    const unsigned char *video, *pcm;
+    unsigned char *buffer;
+    unsigned long frames, i, from, to;
+    size_t len, alen;
+    double t0, t1, bytes, cloned, start, end;
+    int k, job, mode, n;
+
+    buffer = (unsigned char *) malloc(frame_size);
+    memset(buffer, 0x55, frame_size);
+    frames = gb / 2 * (1 << 30) / (frame_size + audio_size + 16);
+    memset(&opt, 0, sizeof(opt));
+    opt.output = GWAVI::GWAVI_OUTPUT_FD;
+    opt.odml = 1;
+    for (k = 0; k < 2; k++) {
+	snprintf(input[k], sizeof(input[k]), "%s/gwavi_bench_remux_%d.avi", dir, k);
+	GWAVI gwavi(input[k], 1920, 1080, 24, "MJPG", 30, &audio, &opt);
+	for (i = 0; i < frames; i++)
+	    if (gwavi.AddVideoFrame(buffer, frame_size, i % 30 == 0) == -1
+		    || gwavi.AddAudioFrame(buffer, audio_size) == -1)
+		return EXIT_FAILURE;
+	if (gwavi.Finalize() == -1)
+	    return EXIT_FAILURE;
+    }
+    snprintf(output, sizeof(output), "%s/gwavi_bench_remux_out.avi", dir);
+    /* the second quarter of the first file */
+    start = frames / 4 / 30.0;
+    end = frames / 2 / 30.0;
+
+    printf("%-8s %-8s %10s %10s %10s %10s\n", "job", "mode", "MB", "s", "MB/s", "cloned MB");
+    for (job = 0; job < 2; job++) {
+	n = job ? 1 : 2;
+	for (mode = 0; mode < 2; mode++) {
+	    for (k = 0; k < n; k++)
+		cold_read(input[k]);
+	    bytes = 0;
+	    cloned = 0;
+	    t0 = now();
+	    if (mode == 0) {
+		GWAVI gwavi(output, 1920, 1080, 24, "MJPG", 30, &audio, &opt);
+		for (k = 0; k < n; k++) {
+		    GWAVIReader reader(input[k]);
+		    from = job ? reader.FindKeyframeAt(0, start) : 0;
+		    to = job ? end * 30 : reader.GetFrameCount(0);
+		    for (i = from; i < to; i++) {
+			video = reader.GetFrame(0, i, &len);
+			pcm = reader.GetFrame(1, i, &alen);
+			if (gwavi.AddVideoFrame((unsigned char *) video, len, reader.IsKeyframe(0, i)) == -1
+				|| gwavi.AddAudioFrame((unsigned char *) pcm, alen) == -1)
+			    return EXIT_FAILURE;
+			bytes += len + alen;
+		    }
+		}
+		if (gwavi.Finalize() == -1)
+		    return EXIT_FAILURE;
+	    } else {
+		GWAVIRemux remux(output);
+		for (k = 0; k < n; k++)
+		    if ((job ? remux.AddInput(input[k], start, end) : remux.AddInput(input[k])) == -1)
+			return EXIT_FAILURE;
+		if (remux.Finalize() == -1)
+		    return EXIT_FAILURE;
+		remux.GetStats(&rs);
+		bytes = rs.bytes;
+		cloned = rs.cloned;
+	    }
+	    t1 = now();
+	    printf("%-8s %-8s %10.1f %10.3f %10.1f %10.1f\n", job ? "cut" : "concat", mode ? "remux" : "rewrite",
+		    bytes / 1e6, t1 - t0, bytes / (t1 - t0) / 1e6, cloned / 1e6);
+	    unlink(output);
+	}
+    }
+
+    for (k = 0; k < 2; k++)
+	unlink(input[k]);
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Build a short clip again and again in a file, in a growing memory
+ * buffer and in a fixed arena.
+ */
+static int bench_memory(int argc, char **argv)
+{
+    int frames = argc > 0 ? atoi(argv[0]) : 300;
+    size_t frame_size = argc > 1 ? atoi(argv[1]) : 65536;
+    const char *dir = argc > 2 ? argv[2] : "/tmp";
+    static const char *names[] = { "file", "memory", "arena" };
+    GWAVI::gwavi_audio_t audio = { 2, 16, 48000 };
+    const size_t audio_size = 6400;
+    const int rounds = 20;
+    GWAVI::gwavi_options_t opt;
+    unsigned char *buffer, *arena;
+    size_t arena_size, size = 0;
+    char filename[256];
+    int i, r, mode;
+    double t0, t1;
+
+    buffer = (unsigned char *) malloc(frame_size);
+    memset(buffer, 0x55, frame_size);
+    arena_size = (size_t) frames * (frame_size + audio_size + 64) + (1 << 20);
+    arena = (unsigned char *) malloc(arena_size);
+    memset(arena, 0, arena_size);
+    snprintf(filename, sizeof(filename), "%s/gwavi_bench_memory.avi", dir);
+    memset(&opt, 0, sizeof(opt));
+    opt.output = GWAVI::GWAVI_OUTPUT_FD;
+
+    printf("%-8s %10s %12s %10s\n", "sink", "MB", "ms / clip", "MB/s");
+    for (mode = 0; mode < 3; mode++) {
+	t0 = now();
+	for (r = 0; r < rounds; r++) {
+	    GWAVIMemorySink memory;
+	    GWAVIArenaSink fixed(arena, arena_size);
+	    GWAVI *gwavi;
+
+	    if (mode == 0)
+		gwavi = new GWAVI(filename, 1280, 720, 24, "MJPG", 30, &audio, &opt);
+	    else
+		gwavi = new GWAVI(mode == 1 ? (GWAVISink *) &memory : &fixed, 1280, 720, 24, "MJPG", 30, &audio, &opt);
+	    for (i = 0; i < frames; i++)
+		if (gwavi->AddVideoFrame(buffer, frame_size) == -1 || gwavi->AddAudioFrame(buffer, audio_size) == -1)
+		    return EXIT_FAILURE;
+	    if (gwavi->Finalize() == -1)
+		return EXIT_FAILURE;
+	    delete gwavi;
+	    size = mode == 1 ? memory.GetSize() : fixed.GetSize();
+	}
+	t1 = now();
+	if (mode == 0) {
+	    size = (size_t) frames * (frame_size + audio_size);
+	    unlink(filename);
+	}
+	printf("%-8s %10.1f %12.2f %10.1f\n", names[mode], size / 1e6, (t1 - t0) / rounds * 1e3,
+		size * rounds / (t1 - t0) / 1e6);
+    }
+
+    free(arena);
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Hand a file to a consumer through a pipe: written to a temporary file
+ * and copied into the pipe after Finalize(), against streamed straight
+ * into it. The consumer notes when its first byte arrives.
+ */
+static int bench_stream(int argc, char **argv)
+{
+    int frames = argc > 0 ? atoi(argv[0]) : 600;
+    const char *dir = argc > 1 ? argv[1] : "/tmp";
+    GWAVI::gwavi_audio_t audio = { 2, 16, 48000 };
+    const size_t frame_size = 262144, audio_size = 6400;
+    static char copy[1 << 16];
+    GWAVI::gwavi_options_t opt;
+    double t0, first, bytes;
+    char filename[256];
+    unsigned char *buffer;
+    int i, mode, fd, p[2];
+    ssize_t r;
+
+    buffer = (unsigned char *) malloc(frame_size);
+    memset(buffer, 0x55, frame_size);
+    snprintf(filename, sizeof(filename), "%s/gwavi_bench_stream.avi", dir);
+
+    printf("%-10s %10s %14s %10s\n", "mode", "MB", "first byte ms", "done ms");
+    for (mode = 0; mode < 2; mode++) {
+	if (pipe(p) < 0)
+	    return EXIT_FAILURE;
+	first = 0;
+	bytes = 0;
+	std::thread consumer([&] {
+	    ssize_t n;
+	    while ((n = read(p[0], copy, sizeof(copy))) > 0) {
+		if (!first)
+		    first = now();
+		bytes += n;
+	    }
+	});
+
+	memset(&opt, 0, sizeof(opt));
+	opt.output = GWAVI::GWAVI_OUTPUT_FD;
+	t0 = now();
+	if (mode == 0) {
+	    GWAVI gwavi(filename, 1920, 1080, 24, "MJPG", 30, &audio, &opt);
+	    for (i = 0; i < frames; i++)
+		if (gwavi.AddVideoFrame(buffer, frame_size) == -1 || gwavi.AddAudioFrame(buffer, audio_size) == -1)
+		    return EXIT_FAILURE;
+	    if (gwavi.Finalize() == -1)
+		return EXIT_FAILURE;
+	    fd = open(filename, O_RDONLY);
+	    while (fd >= 0 && (r = read(fd, buffer, frame_size)) > 0)
+		if (write(p[1], buffer, r) != r)
+		    return EXIT_FAILURE;
+	    close(fd);
+	    unlink(filename);
+	} else {
+	    opt.streaming = 1;
+	    opt.streaming_trailer = 1;
+	    GWAVIFdSink sink(p[1]);
+	    GWAVI gwavi(&sink, 1920, 1080, 24, "MJPG", 30, &audio, &opt);
+	    for (i = 0; i < frames; i++)
+		if (gwavi.AddVideoFrame(buffer, frame_size) == -1 || gwavi.AddAudioFrame(buffer, audio_size) == -1)
+		    return EXIT_FAILURE;
+	    if (gwavi.Finalize() == -1)
+		return EXIT_FAILURE;
+	}
+	close(p[1]);
+	consumer.join();
+	close(p[0]);
+	printf("%-10s %10.1f %14.2f %10.1f\n", mode ? "streaming" : "temp file", bytes / 1e6, (first - t0) * 1e3,
+		(now() - t0) * 1e3);
+    }
+
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * An encoder producing frames (a memset here): into its own buffer handed
+ * to AddVideoFrame() with fd and mmap output, and straight into the
+ * mapped file through ReserveVideoFrame().
+ */
+static int bench_mmap(int argc, char **argv)
+{
+    int frames = argc > 0 ? atoi(argv[0]) : 1000;
+    size_t frame_size = argc > 1 ? atoi(argv[1]) : 262144;
+    const char *dir = argc > 2 ? argv[2] : "/tmp";
+    static const char *names[] = { "fd", "mmap", "mmap fill" };
+    GWAVI::gwavi_options_t opt;
+    std::vector<double> lat;
+    unsigned char *buffer, *p;
+    char filename[256];
+    double t0, t1, t;
+    int i, mode;
+
+    buffer = (unsigned char *) malloc(frame_size);
+    snprintf(filename, sizeof(filename), "%s/gwavi_bench_mmap.avi", dir);
+    lat.resize(frames);
+
+    printf("%-10s %10s %10s %10s %10s\n", "mode", "MB/s", "p50 us", "p99 us", "max us");
+    for (mode = 0; mode < 3; mode++) {
+	memset(&opt, 0, sizeof(opt));
+	opt.odml = 1;
+	opt.output = mode == 0 ? GWAVI::GWAVI_OUTPUT_FD : GWAVI::GWAVI_OUTPUT_MMAP;
+
+	t0 = now();
+	GWAVI gwavi(filename, 1920, 1080, 24, "MJPG", 30, NULL, &opt);
+	for (i = 0; i < frames; i++) {
+	    t = now();
+	    if (mode < 2) {
+		memset(buffer, i, frame_size);
+		if (gwavi.AddVideoFrame(buffer, frame_size) == -1)
+		    return EXIT_FAILURE;
+	    } else {
+		if (!(p = gwavi.ReserveVideoFrame(frame_size)))
+		    return EXIT_FAILURE;
+		memset(p, i, frame_size);
+		if (gwavi.CommitVideoFrame(frame_size) == -1)
+		    return EXIT_FAILURE;
+	    }
+	    lat[i] = now() - t;
+	}
+	if (gwavi.Finalize() == -1)
+	    return EXIT_FAILURE;
+	t1 = now();
+	unlink(filename);
+
+	std::sort(lat.begin(), lat.end());
+	printf("%-10s %10.1f %10.1f %10.1f %10.1f\n", names[mode], (double) frames * frame_size / (t1 - t0) / 1e6,
+		lat[frames / 2] * 1e6, lat[frames - 1 - frames / 100] * 1e6, lat[frames - 1] * 1e6);
+    }
+
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Replay a burst of small audio chunks: one AddAudioFrame() per chunk
+ * against AddFrames() of batch chunks at a time.
+ */
+static int bench_batch(int argc, char **argv)
+{
+    int chunks = argc > 0 ? atoi(argv[0]) : 200000;
+    size_t chunk_size = argc > 1 ? atoi(argv[1]) : 640;
+    int batch = argc > 2 ? atoi(argv[2]) : 256;
+    const char *dir = argc > 3 ? argv[3] : "/tmp";
+    static const char *names[] = { "single", "batch" };
+    GWAVI::gwavi_audio_t audio = { 2, 16, 16000 };
+    std::vector<GWAVI::gwavi_batch_frame_t> frames;
+    GWAVI::gwavi_options_t opt;
+    unsigned char *buffer;
+    char filename[256];
+    int i, j, n, mode;
+    double t0, t1;
+
+    buffer = (unsigned char *) malloc(chunk_size * batch);
+    memset(buffer, 0x55, chunk_size * batch);
+    snprintf(filename, sizeof(filename), "%s/gwavi_bench_batch.avi", dir);
+    frames.resize(batch);
+    for (j = 0; j < batch; j++) {
+	frames[j].stream = 1;
+	frames[j].buffer = buffer + j * chunk_size;
+	frames[j].len = chunk_size;
+	frames[j].delta = false;
+    }
+
+    printf("%-8s %10s %12s %10s\n", "mode", "chunks", "ns / chunk", "MB/s");
+    for (mode = 0; mode < 2; mode++) {
+	memset(&opt, 0, sizeof(opt));
+	opt.output = GWAVI::GWAVI_OUTPUT_FD;
+
+	GWAVI gwavi(filename, 1280, 720, 24, "MJPG", 30, &audio, &opt);
+	t0 = now();
+	for (i = 0; i < chunks; i += n) {
+	    n = chunks - i < batch ? chunks - i : batch;
+	    if (mode == 0) {
+		for (j = 0; j < n; j++)
+		    if (gwavi.AddAudioFrame(buffer + j * chunk_size, chunk_size) == -1)
+			return EXIT_FAILURE;
+	    } else if (gwavi.AddFrames(frames.data(), n) == -1) {
+		return EXIT_FAILURE;
+	    }
+	}
+	t1 = now();
+	if (gwavi.Finalize() == -1)
+	    return EXIT_FAILURE;
+	unlink(filename);
+
+	printf("%-8s %10d %12.1f %10.1f\n", names[mode], chunks, (t1 - t0) / chunks * 1e9,
+		(double) chunks * chunk_size / (t1 - t0) / 1e6);
+    }
+
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && !strcmp(argv[1], "writev"))
+	return bench_writev(argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "async"))
+	return bench_async(argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "direct"))
+	return bench_direct(argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "prealloc"))
+	return bench_prealloc(argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "finalize"))
+	return bench_finalize(argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "raw"))
+	return bench_raw(argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "yuv"))
+	return bench_yuv(argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "rle"))
+	return bench_rle(argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "pipeline"))
+	return bench_pipeline(argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "interleave"))
+	return bench_interleave(argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "reader"))
+	return bench_reader(argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "recover"))
+	return bench_recover(argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "segment"))
+	return bench_segment(argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "remux"))
+	return bench_remux(argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "memory"))
+	return bench_memory(argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "stream"))
+	return bench_stream(argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "mmap"))
+	return bench_mmap(argc - 2, argv + 2);
+    if (argc > 1 && !strcmp(argv[1], "batch"))
+	return bench_batch(argc - 2, argv + 2);
+
+    fprintf(stderr, "usage: %s writev [frame_size [frames [dir]]]\n"
+	    "       %s async [frame_size [frames [queue [dir]]]]\n"
+	    "       %s direct [frame_size [frames [dir]]]\n"
+	    "       %s prealloc [frame_size [frames [files [dir]]]]\n"
+	    "       %s finalize [entries [dir]]\n"
+	    "       %s raw [frames [dir]]\n"
+	    "       %s yuv [frames [threads]]\n"
+	    "       %s rle [frames [threads [dir]]]\n"
+	    "       %s pipeline [frames [threads [dir]]]\n"
+	    "       %s interleave [frames [dir]]\n"
+	    "       %s reader [GB [dir]]\n"
+	    "       %s recover [GB [dir]]\n"
+	    "       %s segment [frames [MB [dir]]]\n"
+	    "       %s remux [GB [dir]]\n"
+	    "       %s memory [frames [frame_size [dir]]]\n"
+	    "       %s stream [frames [dir]]\n"
+	    "       %s mmap [frames [frame_size [dir]]]\n"
+	    "       %s batch [chunks [chunk_size [batch [dir]]]]\n", argv[0], argv[0], argv[0], argv[0], argv[0],
+	    argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0],
+	    argv[0]);
+    return EXIT_FAILURE;
+}